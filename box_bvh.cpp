@@ -0,0 +1,358 @@
+#include "precomp.h"
+#include "box_bvh.h"
+
+
+BoxBVH::BoxBVH(const Cube& cube)
+	: _cube{ cube }
+{	}
+
+
+BoxBVH::~BoxBVH()
+{
+	delete[] _nodes;
+	delete[] _item_indicies;
+}
+
+
+void BoxBVH::findNearestInCube(Ray& ray) const
+{
+	traverseItems(_root_node_index, ray, [this](Ray& leaf_ray, const int first, const int count)
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			intersectItemForNearest(leaf_ray, _item_indicies[first + i]);
+		}
+
+		return false;
+	});
+}
+
+
+bool BoxBVH::findOcclusionInCube(Ray& ray, TintData& tint_data) const
+{
+	return traverseItems(_root_node_index, ray, [this, &tint_data](Ray& leaf_ray, const int first, const int count)
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			if (intersectItemForOcclusion(leaf_ray, tint_data, _item_indicies[first + i]))
+			{
+				return true;
+			}
+		}
+
+		return false;
+	});
+}
+
+
+// INTERSECT ITEM METHODS //
+
+void BoxBVH::intersectItemForNearest(Ray& transformed_ray, const uint item_index) const
+{
+	const VoxelBox& box{ _boxes[item_index] };
+
+	float t_enter, t_exit;
+	if (!intersectBox(transformed_ray, box, t_enter, t_exit))
+	{
+		return;
+	}
+
+	// Like the cube's own traversal, a ray starting inside a solid voxel hits it right away.
+	const float t{ max(t_enter, 0.0f) };
+
+	if (t < transformed_ray.t)
+	{
+		transformed_ray.t = t;
+		transformed_ray._hit_data = box._voxel;
+		transformed_ray._id = _id;
+		transformed_ray.normal = transformed_ray.GetNormal(_cube._size);
+	}
+}
+
+
+bool BoxBVH::intersectItemForOcclusion(Ray& transformed_ray, TintData& tint_data, const uint item_index) const
+{
+	const VoxelBox& box{ _boxes[item_index] };
+
+	float t_enter, t_exit;
+	if (!intersectBox(transformed_ray, box, t_enter, t_exit) || t_enter >= transformed_ray.t)
+	{
+		return false;
+	}
+
+	// Glass does not occlude, but it tints the incoming light.
+	if (MaterialList::GetType(box._voxel) != MaterialType::GLASS)
+	{
+		return true;
+	}
+
+	// The cube's traversal adds a distance of 1 per glass voxel the shadow ray passes, so count the voxels crossed inside the box.
+	// Boxes are not visited front to back, so the first glass color is that of whichever glass box is found first.
+	const int3 lower{ make_int3(box._bmin * WORLDSIZE + 0.5f) };
+	const int3 upper{ make_int3(box._bmax * WORLDSIZE + 0.5f) - 1 };
+
+	const float t_first{ max(t_enter, 0.0f) };
+	const float t_last{ min(t_exit, transformed_ray.t) };
+
+	const int3 first{ clamp(make_int3((transformed_ray.O + t_first * transformed_ray.D) * WORLDSIZE), lower, upper) };
+	const int3 last{ clamp(make_int3((transformed_ray.O + t_last * transformed_ray.D) * WORLDSIZE), lower, upper) };
+
+	tint_data._distance += static_cast<float>(1 + abs(last.x - first.x) + abs(last.y - first.y) + abs(last.z - first.z));
+
+	if (!tint_data._voxel)
+	{
+		tint_data._voxel = box._voxel;
+	}
+
+	return false;
+}
+
+
+bool BoxBVH::intersectBox(const Ray& ray, const VoxelBox& box, float& t_enter, float& t_exit)
+{
+	const float tx1{ (box._bmin.x - ray.O.x) * ray.rD.x }, tx2{ (box._bmax.x - ray.O.x) * ray.rD.x };
+	const float ty1{ (box._bmin.y - ray.O.y) * ray.rD.y }, ty2{ (box._bmax.y - ray.O.y) * ray.rD.y };
+	const float tz1{ (box._bmin.z - ray.O.z) * ray.rD.z }, tz2{ (box._bmax.z - ray.O.z) * ray.rD.z };
+
+	t_enter = max(max(min(tx1, tx2), min(ty1, ty2)), min(tz1, tz2));
+	t_exit = min(min(max(tx1, tx2), max(ty1, ty2)), max(tz1, tz2));
+
+	return t_exit >= t_enter && t_exit > 0.0f;
+}
+
+
+// BUILD METHODS //
+
+void BoxBVH::build()
+{
+	Timer t;
+
+	delete[] _nodes;
+	delete[] _item_indicies;
+	_nodes = nullptr;
+	_item_indicies = nullptr;
+	_nodes_used = 1;
+
+	mergeVoxels();
+
+	// An empty cube has nothing to build over.
+	if (_boxes.empty())
+	{
+		return;
+	}
+
+	// Set primitive count and create all nodes that will be used.
+	const int N{ static_cast<int>(_boxes.size()) };
+	_nodes = new BVHNode[(N * 2) - 1];
+	_item_indicies = new uint[N];
+
+	// Build out primitive indicies array.
+	for (int i = 0; i < N; ++i)
+	{
+		_item_indicies[i] = i;
+	}
+
+	BVHNode& root{ _nodes[_root_node_index] };
+	root._significant_index = 0;
+	root._child_count = N;
+
+	updateNodeBounds(0);
+	subdivide(0);
+	setBounds();
+	finishBuild();
+
+	_build_time = t.elapsed();
+}
+
+
+void BoxBVH::mergeVoxels()
+{
+	_boxes.clear();
+	_voxels_version = _cube._voxels_version;
+	_voxel_count = 0;
+
+	// Only the occupied part of the grid holds voxels.
+	const uint3 lower{ _cube._occupied_min };
+	const uint3 upper{ _cube._occupied_min + _cube._occupied_size };
+
+	std::vector<bool> is_claimed(static_cast<size_t>(_cube._slice) * _cube._size.z, false);
+
+	auto getVoxel = [this](const uint x, const uint y, const uint z) { return _cube._voxels[_cube.getVoxelIndex(x, y, z)]; };
+
+	// True when every voxel in [min, max) holds voxel and is still unclaimed.
+	auto canTake = [&](const uint3& min, const uint3& max, const Cube::PaletteIndex voxel)
+	{
+		for (uint z = min.z; z < max.z; ++z)
+		{
+			for (uint y = min.y; y < max.y; ++y)
+			{
+				for (uint x = min.x; x < max.x; ++x)
+				{
+					if (getVoxel(x, y, z) != voxel || is_claimed[_cube.getLinearIndex(x, y, z)])
+					{
+						return false;
+					}
+				}
+			}
+		}
+
+		return true;
+	};
+
+	for (uint z = lower.z; z < upper.z; ++z)
+	{
+		for (uint y = lower.y; y < upper.y; ++y)
+		{
+			for (uint x = lower.x; x < upper.x; ++x)
+			{
+				const Cube::PaletteIndex voxel{ getVoxel(x, y, z) };
+				if (!voxel || is_claimed[_cube.getLinearIndex(x, y, z)])
+				{
+					continue;
+				}
+
+				// Grow along x, then y, then z.
+				uint3 end{ make_uint3(x + 1, y + 1, z + 1) };
+
+				while (end.x < upper.x && canTake(make_uint3(end.x, y, z), make_uint3(end.x + 1, y + 1, z + 1), voxel))
+				{
+					++end.x;
+				}
+
+				while (end.y < upper.y && canTake(make_uint3(x, end.y, z), make_uint3(end.x, end.y + 1, z + 1), voxel))
+				{
+					++end.y;
+				}
+
+				while (end.z < upper.z && canTake(make_uint3(x, y, end.z), make_uint3(end.x, end.y, end.z + 1), voxel))
+				{
+					++end.z;
+				}
+
+				// Claim the box.
+				for (uint bz = z; bz < end.z; ++bz)
+				{
+					for (uint by = y; by < end.y; ++by)
+					{
+						for (uint bx = x; bx < end.x; ++bx)
+						{
+							is_claimed[_cube.getLinearIndex(bx, by, bz)] = true;
+						}
+					}
+				}
+
+				VoxelBox box;
+				box._bmin = make_float3(make_uint3(x, y, z)) * VOXELSIZE;
+				box._bmax = make_float3(end) * VOXELSIZE;
+				box._voxel = _cube._palette[voxel];
+
+				_boxes.push_back(box);
+				_voxel_count += (end.x - x) * (end.y - y) * (end.z - z);
+			}
+		}
+	}
+}
+
+
+void BoxBVH::updateNodeBounds(uint node_index) const
+{
+	BVHNode& node{ _nodes[node_index] };
+
+	node._aabb_min = float3{ 1e30f };
+	node._aabb_max = float3{ -1e30f };
+
+	// Check all primitives to get the smallest and largest point.
+	for (int i = 0; i < node._child_count; ++i)
+	{
+		const VoxelBox& box{ _boxes[_item_indicies[node._significant_index + i]] };
+
+		node._aabb_min = fminf(node._aabb_min, box._bmin);
+		node._aabb_max = fmaxf(node._aabb_max, box._bmax);
+	}
+}
+
+
+void BoxBVH::subdivide(const uint node_index)
+{
+	// Get node to split.
+	BVHNode& node{ _nodes[node_index] };
+
+	// Abort subdivision / end recursion if contains too few primitives (becomes leaf).
+	if (node._child_count < 2)
+	{
+		return;
+	}
+
+	// Find split position.
+	int axis{ -1 };
+	float split_position{ 0.0f };
+	{
+		int best_axis{ 0 };
+		float best_position{ 0.0f };
+		const float split_cost{ findBestSplitPlane(node, /*inout*/ best_axis, /*inout*/ best_position) };
+		const float no_split_cost{ calculateNodeCost(node) };
+
+		if (split_cost >= no_split_cost)
+		{
+			return;
+		}
+		else
+		{
+			axis = best_axis;
+			split_position = best_position;
+		}
+	}
+
+	// Split the BVH in half. Swap elements so they are consecutive within their new container. No sorting needed beyond that.
+	int left_i{ node._significant_index };
+	int right_i{ left_i + node._child_count - 1 };
+
+	while (left_i <= right_i)
+	{
+		float3 centroid{ (_boxes[left_i]._bmin + _boxes[left_i]._bmax) * 0.5f };
+
+		if (centroid[axis] < split_position)
+		{
+			++left_i;
+		}
+		else
+		{
+			std::swap(_boxes[left_i], _boxes[right_i--]);
+		}
+	}
+
+	// Value of left_i is amount of primitives on the lesser (left) side of the split, offset by the first_primitive in the node.
+	const int left_count{ left_i - node._significant_index };
+	if (left_count == 0 || left_count == node._child_count)
+	{
+		return;
+	}
+
+	// Create new child nodes.
+	const int left_child_index{ allocateChildPair() };
+	_nodes[left_child_index]._significant_index = node._significant_index;
+	_nodes[left_child_index]._child_count = left_count;
+
+	const int right_child_index{ left_child_index + 1 };
+	_nodes[right_child_index]._significant_index = left_i;
+	_nodes[right_child_index]._child_count = node._child_count - left_count;
+
+	// Update this node's data.
+	node._significant_index = left_child_index;
+	node._child_count = 0;
+
+	// Update and split children.
+	updateNodeBounds(left_child_index);
+	updateNodeBounds(right_child_index);
+
+	subdivideChildren(left_child_index, right_child_index, [this](const uint child_index) { subdivide(child_index); });
+}
+
+
+float BoxBVH::findBestSplitPlane(BVHNode& node, int& best_axis, float& best_position) const
+{
+	return findBinnedSplitPlane(node,
+		[this](const uint item_index) { return (_boxes[item_index]._bmin + _boxes[item_index]._bmax) * 0.5f; },
+		[this](const uint item_index) { return aabb{ _boxes[item_index]._bmin, _boxes[item_index]._bmax }; },
+		best_axis, best_position);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+// ALL TLAS/BLAS CODE HEAVILY INSPIRED (OR OUTRIGHT COPIED) FROM JACCO'S SERIES ON BVH CREATION
+// [Credit] https://jacco.ompf2.com/2022/04/13/how-to-build-a-bvh-part-1-basics/
+
+
+// Box of identical voxels, in the object space of the cube it was merged from.
+struct VoxelBox
+{
+	float3 _bmin{ 0.0f };
+	uint _voxel{ 0 };
+	float3 _bmax{ 0.0f };
+	uint _dummy{ 0 };
+};
+
+
+// Traces a cube as a handful of merged boxes instead of stepping through it voxel by voxel.
+// Pays off for mostly-solid cubes. Hits carry the same voxel data and normal as the cube's own traversal.
+class BoxBVH : public BVHTraversal<BoxBVH>
+{
+public:
+	BoxBVH(const Cube& cube);
+
+
+	~BoxBVH() override;
+
+
+	// Traversal for rays already in the cube's object space, as handed over by CubeBVH.
+	void findNearestInCube(Ray& ray) const;
+
+
+	bool findOcclusionInCube(Ray& ray, TintData& tint_data) const;
+
+
+	// INTERSECT ITEM METHODS //
+
+	void intersectItemForNearest(Ray& transformed_ray, const uint item_index) const override;
+
+
+	bool intersectItemForOcclusion(Ray& transformed_ray, TintData& tint_data, const uint item_index) const override;
+
+
+	// BUILD METHODS //
+
+	void build() override;
+
+
+	void updateNodeBounds(uint node_index) const override;
+
+
+	void subdivide(const uint node_index);
+
+
+	float findBestSplitPlane(BVHNode& node, int& best_axis, float& best_position) const;
+
+
+	// Properties.
+	const Cube& _cube;
+	std::vector<VoxelBox> _boxes;
+
+	// Cube::_voxels_version the boxes were merged from, and the number of voxels they cover.
+	uint _voxels_version{ 0 };
+	uint _voxel_count{ 0 };
+
+
+private:
+	// Greedy meshing in 3D. Each box grows along x, then y, then z, for as long as every voxel it takes in is identical and unclaimed.
+	void mergeVoxels();
+
+
+	// Entry and exit distance of the ray through a box. False on a miss.
+	static bool intersectBox(const Ray& ray, const VoxelBox& box, float& t_enter, float& t_exit);
+};
@@ -2,175 +2,28 @@
 #include "bvh.h"
 
 
-// TRAVERSAL METHODS //
-
-void BVH::findNearest(Ray& ray, const uint node_index) const
+BVH::~BVH()
 {
-	// Create a transformed ray to send into the BVH.
-	Ray transformed_ray{ getTransformedRay(ray) };	
-
-	// Trace transformed ray
-	BVHNode* node_ptr{ &_nodes[node_index] };
-	BVHNode* stack[64];
-	uint stack_ptr = 0;
-
-	while (true)
-	{
-		BVHNode& node{ *node_ptr };
-
-		// Resolve leaf node.
-		if (node._child_count > 0)
-		{
-			for (int i = 0; i < node._child_count; ++i)
-			{
-				intersectItemForNearest(transformed_ray, _item_indicies[node._significant_index + i]);
-			}
-
-			if (stack_ptr == 0)
-			{
-				break;
-			}
-			else
-			{
-				node_ptr = stack[--stack_ptr];
-			}
-
-			continue;
-		}
-
-		// Resolve child nodes.
-		BVHNode* child1 = &_nodes[node._significant_index];
-		BVHNode* child2 = &_nodes[node._significant_index + 1];
-
-#if USE_SSE == 1
-		float dist1 = intersectAABBForNearest_SSE(transformed_ray, child1->_aabb_min4, child1->_aabb_max4);
-		float dist2 = intersectAABBForNearest_SSE(transformed_ray, child2->_aabb_min4, child2->_aabb_max4);
-#else
-		float dist1 = intersectAABBForNearest(transformed_ray, child1->_aabb_min, child1->_aabb_max);
-		float dist2 = intersectAABBForNearest(transformed_ray, child2->_aabb_min, child2->_aabb_max);
-#endif
-
-		// Place closer child first for intersection resolution.
-		if (dist1 > dist2)
-		{
-			swap(dist1, dist2); swap(child1, child2);
-		}
-
-		if (dist1 == Ray::t_max)
-		{
-			if (stack_ptr == 0)
-			{
-				break;
-			}
-			else
-			{
-				node_ptr = stack[--stack_ptr];
-			}
-		}
-		else
-		{
-			node_ptr = child1;
-
-			if (dist2 != Ray::t_max)
-			{
-				stack[stack_ptr++] = child2;
-			}
-		}
-	}
-
-	// Move hit information into the original ray.
-	transferDataToRay(transformed_ray, ray);
+	delete[] _qnodes;
+	delete[] _cqnodes;
 }
 
 
-bool BVH::findOcclusion(Ray& ray, TintData& tint_data, const uint node_index) const
-{
-	// Create a transformed ray to send into the BVH.
-	Ray transformed_ray{ getTransformedRay(ray) };
-
-	// Trace transformed ray
-	BVHNode* node_ptr{ &_nodes[node_index] };
-	BVHNode* stack[64];
-	uint stack_ptr = 0;
-
-	while (true)
-	{
-		BVHNode& node{ *node_ptr };
-
-		// Resolve leaf node.
-		if (node._child_count > 0)
-		{
-			for (int i = 0; i < node._child_count; ++i)
-			{
-				if (intersectItemForOcclusion(transformed_ray, tint_data, _item_indicies[node._significant_index + i]))
-				{
-					return true;
-				}
-			}
-
-			if (stack_ptr == 0)
-			{
-				return false;
-			}
-			else
-			{
-				node_ptr = stack[--stack_ptr];
-			}
-
-			continue;
-		}
-
-		// Resolve child nodes.
-		BVHNode* child1 = &_nodes[node._significant_index];
-		BVHNode* child2 = &_nodes[node._significant_index + 1];
-
-#if USE_SSE == 1
-		float dist2 = intersectAABBForNearest_SSE(transformed_ray, child2->_aabb_min4, child2->_aabb_max4);
-		float dist1 = intersectAABBForNearest_SSE(transformed_ray, child1->_aabb_min4, child1->_aabb_max4);
-#else
-		float dist1 = intersectAABBForNearest(transformed_ray, child1->_aabb_min, child1->_aabb_max);
-		float dist2 = intersectAABBForNearest(transformed_ray, child2->_aabb_min, child2->_aabb_max);
-#endif
-
-		// Place closer child first for intersection resolution.
-		if (dist1 > dist2)
-		{
-			swap(dist1, dist2); swap(child1, child2);
-		}
-
-		if (dist1 == Ray::t_max)
-		{
-			if (stack_ptr == 0)
-			{
-				return false;
-			}
-			else
-			{
-				node_ptr = stack[--stack_ptr];
-			}
-		}
-		else
-		{
-			node_ptr = child1;
-
-			if (dist2 != Ray::t_max)
-			{
-				stack[stack_ptr++] = child2;
-			}
-		}
-	}
-
-	// Move hit information into the original ray.
-	transferDataToRay(transformed_ray, ray);
-}
-
+// TRAVERSAL METHODS //
 
-void BVH::findNearestToPlayer(Ray& ray, const uint node_index, const int source_id) const
+// Packet version of findNearest. A node is visited when any of the four rays hits it.
+void BVH::findNearest4(Ray* rays, const uint node_index) const
 {
-	// Create a transformed ray to send into the BVH.
-	Ray transformed_ray{ getTransformedRay(ray) };
-
-	// Trace transformed ray
+	// Create transformed rays to send into the BVH.
+	Ray transformed_rays[4]{
+		getTransformedRay(rays[0]),
+		getTransformedRay(rays[1]),
+		getTransformedRay(rays[2]),
+		getTransformedRay(rays[3])
+	};
+	RayPacket4 packet{ transformed_rays };
+
+	// Trace transformed packet.
 	BVHNode* node_ptr{ &_nodes[node_index] };
 	BVHNode* stack[64];
 	uint stack_ptr = 0;
@@ -184,9 +37,11 @@ void BVH::findNearestToPlayer(Ray& ray, const uint node_index, const int source_
 		{
 			for (int i = 0; i < node._child_count; ++i)
 			{
-				intersectItemForNearestToPlayer(transformed_ray, _item_indicies[node._significant_index + i], source_id);
+				intersectItemForNearest4(transformed_rays, _item_indicies[node._significant_index + i]);
 			}
 
+			packet.updateT(transformed_rays);
+
 			if (stack_ptr == 0)
 			{
 				break;
@@ -203,13 +58,8 @@ void BVH::findNearestToPlayer(Ray& ray, const uint node_index, const int source_
 		BVHNode* child1 = &_nodes[node._significant_index];
 		BVHNode* child2 = &_nodes[node._significant_index + 1];
 
-#if USE_SSE == 1
-		float dist2 = intersectAABBForNearest_SSE(transformed_ray, child2->_aabb_min4, child2->_aabb_max4);
-		float dist1 = intersectAABBForNearest_SSE(transformed_ray, child1->_aabb_min4, child1->_aabb_max4);
-#else
-		float dist1 = intersectAABBForNearest(transformed_ray, child1->_aabb_min, child1->_aabb_max);
-		float dist2 = intersectAABBForNearest(transformed_ray, child2->_aabb_min, child2->_aabb_max);
-#endif
+		float dist1 = getPacketNearest(intersectAABBForNearest4(packet, child1->_aabb_min, child1->_aabb_max));
+		float dist2 = getPacketNearest(intersectAABBForNearest4(packet, child2->_aabb_min, child2->_aabb_max));
 
 		// Place closer child first for intersection resolution.
 		if (dist1 > dist2)
@@ -239,87 +89,21 @@ void BVH::findNearestToPlayer(Ray& ray, const uint node_index, const int source_
 		}
 	}
 
-	// Move hit information into the original ray.
-	transferDataToRay(transformed_ray, ray);
+	// Move hit information into the original rays.
+	for (int i = 0; i < 4; ++i)
+	{
+		transferDataToRay(transformed_rays[i], rays[i]);
+	}
 }
 
 
-void BVH::eraseVoxels(Ray& ray, const uint node_index, Cube*& modified_cube)
+// Items without a packet intersection of their own are resolved one ray at a time.
+void BVH::intersectItemForNearest4(Ray* rays, const uint item_index) const
 {
-	// Create a transformed ray to send into the BVH.
-	Ray transformed_ray{ getTransformedRay(ray) };
-
-	// Trace transformed ray
-	BVHNode* node_ptr{ &_nodes[node_index] };
-	BVHNode* stack[64];
-	uint stack_ptr = 0;
-
-	while (true)
+	for (int i = 0; i < 4; ++i)
 	{
-		BVHNode& node{ *node_ptr };
-
-		// Resolve leaf node.
-		if (node._child_count > 0)
-		{
-			for (int i = 0; i < node._child_count; ++i)
-			{
-				intersectItemForVoxelErasure(transformed_ray, 0, modified_cube);
-			}
-
-			if (stack_ptr == 0)
-			{
-				break;
-			}
-			else
-			{
-				node_ptr = stack[--stack_ptr];
-			}
-
-			continue;
-		}
-
-		// Resolve child nodes.
-		BVHNode* child1 = &_nodes[node._significant_index];
-		BVHNode* child2 = &_nodes[node._significant_index + 1];
-
-#if USE_SSE == 1
-		float dist2 = intersectAABBForNearest_SSE(transformed_ray, child2->_aabb_min4, child2->_aabb_max4);
-		float dist1 = intersectAABBForNearest_SSE(transformed_ray, child1->_aabb_min4, child1->_aabb_max4);
-#else
-		float dist1 = intersectAABBForNearest(transformed_ray, child1->_aabb_min, child1->_aabb_max);
-		float dist2 = intersectAABBForNearest(transformed_ray, child2->_aabb_min, child2->_aabb_max);
-#endif
-
-		// Place closer child first for intersection resolution.
-		if (dist1 > dist2)
-		{
-			swap(dist1, dist2); swap(child1, child2);
-		}
-
-		if (dist1 == Ray::t_max)
-		{
-			if (stack_ptr == 0)
-			{
-				break;
-			}
-			else
-			{
-				node_ptr = stack[--stack_ptr];
-			}
-		}
-		else
-		{
-			node_ptr = child1;
-
-			if (dist2 != Ray::t_max)
-			{
-				stack[stack_ptr++] = child2;
-			}
-		}
+		intersectItemForNearest(rays[i], item_index);
 	}
-
-	// Move hit information into the original ray.
-	transferDataToRay(transformed_ray, ray);
 }
 
 
@@ -387,6 +171,41 @@ float BVH::intersectAABBForNearest_SSE(const Ray& ray, const __m128 bmin4, const
 }
 #endif
 
+// Slab test for four rays at once. Lanes that miss return Ray::t_max.
+__m128 BVH::intersectAABBForNearest4(const RayPacket4& packet, const float3& bmin, const float3& bmax)
+{
+	const __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmin.x), packet.Ox), packet.rDx);
+	const __m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmax.x), packet.Ox), packet.rDx);
+	__m128 tmin = _mm_min_ps(tx1, tx2), tmax = _mm_max_ps(tx1, tx2);
+
+	const __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmin.y), packet.Oy), packet.rDy);
+	const __m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmax.y), packet.Oy), packet.rDy);
+	tmin = _mm_max_ps(tmin, _mm_min_ps(ty1, ty2)), tmax = _mm_min_ps(tmax, _mm_max_ps(ty1, ty2));
+
+	const __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmin.z), packet.Oz), packet.rDz);
+	const __m128 tz2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(bmax.z), packet.Oz), packet.rDz);
+	tmin = _mm_max_ps(tmin, _mm_min_ps(tz1, tz2)), tmax = _mm_min_ps(tmax, _mm_max_ps(tz1, tz2));
+
+	// tmax >= tmin && tmin < ray.t && tmax > 0
+	const __m128 hit = _mm_and_ps(
+		_mm_and_ps(_mm_cmpge_ps(tmax, tmin), _mm_cmplt_ps(tmin, packet.t)),
+		_mm_cmpgt_ps(tmax, _mm_setzero_ps())
+	);
+
+	return _mm_or_ps(_mm_and_ps(hit, tmin), _mm_andnot_ps(hit, _mm_set1_ps(Ray::t_max)));
+}
+
+
+// Nearest entry distance over the four lanes. Ray::t_max when the whole packet missed.
+float BVH::getPacketNearest(const __m128 distances)
+{
+	__m128 nearest = _mm_min_ps(distances, _mm_shuffle_ps(distances, distances, _MM_SHUFFLE(2, 3, 0, 1)));
+	nearest = _mm_min_ps(nearest, _mm_shuffle_ps(nearest, nearest, _MM_SHUFFLE(1, 0, 3, 2)));
+
+	return _mm_cvtss_f32(nearest);
+}
+
+
 // HELPER METHODS //
 
 float BVH::calculateNodeCost(const BVHNode& node)
@@ -407,22 +226,20 @@ void BVH::setTransform(const float3& scale, const float3& rotate, const float3&
 	_rotate = rotate;
 	_translate = translate; // TODO: Use position instead.
 
-	// Translate to pivot point.
+	// Rotate around pivot point and return to original position.
 	// TODO: Move half _size.
-	float3 to_pivot_translation{ -0.5f, -0.5f, -0.5f };
+	composeTransform(float3{ 0.5f }, mat4::RotateX(_rotate.x) * mat4::RotateY(_rotate.y) * mat4::RotateZ(_rotate.z));
 
-	// Rotate around pivot point and return to original position.
-	_matrix = mat4::Identity();
+	setBounds();
+}
 
-	_matrix = _matrix * mat4::Translate(_translate);
-	_matrix = _matrix * mat4::Translate(-to_pivot_translation);
-	_matrix = _matrix * mat4::RotateX(_rotate.x) * mat4::RotateY(_rotate.y) * mat4::RotateZ(_rotate.z);
-	_matrix = _matrix * mat4::Scale(_scale);
-	_matrix = _matrix * mat4::Translate(to_pivot_translation);
 
-	_inverse_matrix = _matrix.Inverted();
+void BVH::composeTransform(const float3& pivot, const mat4& rotation)
+{
+	_matrix = mat4::Translate(_translate + pivot) * rotation * mat4::Scale(_scale) * mat4::Translate(-pivot);
 
-	setBounds();
+	// Undo each step in reverse order. The rotation is orthonormal, so its inverse is its transpose.
+	_inverse_matrix = mat4::Translate(pivot) * mat4::Scale(1.0f / _scale) * rotation.Transposed() * mat4::Translate(-(_translate + pivot));
 }
 
 
@@ -444,31 +261,203 @@ void BVH::setBounds()
 			_matrix
 		));
 	}
+
+	// Let the TLAS refit this instance's leaf.
+	++_bounds_version;
+}
+
+
+void BVH::setMask(const uint mask)
+{
+	_mask = mask;
+
+	// Let the TLAS pick up the new mask.
+	++_bounds_version;
+}
+
+
+void BVH::publishTransform()
+{
+	if (_published_version == _bounds_version)
+	{
+		return;
+	}
+
+	_traced_transform = AffineTransform{ _matrix };
+	_traced_inverse_transform = AffineTransform{ _inverse_matrix };
+	_traced_inverse_offset = _traced_inverse_transform.getTranslation();
+
+	// Most walls, piers and stones are only ever translated. Rays entering them just move by the inverse offset.
+	const mat4& m{ _matrix };
+	_is_traced_translation =
+		m.cell[0] == 1.0f && m.cell[1] == 0.0f && m.cell[2] == 0.0f &&
+		m.cell[4] == 0.0f && m.cell[5] == 1.0f && m.cell[6] == 0.0f &&
+		m.cell[8] == 0.0f && m.cell[9] == 0.0f && m.cell[10] == 1.0f;
+
+	_published_version = _bounds_version;
 }
 
 
 void BVH::refitBVH() const
 {
+	// Children are created after their parent. Node 1 is the root's left child here, so it is refit as well.
 	for (int i = _nodes_used - 1; i >= 0; i--)
 	{
-		if (i != 1)
+		BVHNode& node = _nodes[i];
+
+		if (node._child_count > 0)
+		{
+			// Leaf node: adjust bounds to contained triangles
+			updateNodeBounds(i);
+		}
+		else
+		{
+			// Interior node: adjust bounds to child node bounds
+			BVHNode& left_child = _nodes[node._significant_index];
+			BVHNode& right_child = _nodes[node._significant_index + 1];
+
+			node._aabb_min = fminf(left_child._aabb_min, right_child._aabb_min);
+			node._aabb_max = fmaxf(left_child._aabb_max, right_child._aabb_max);
+		}
+	}
+
+#if USE_QBVH
+	refitQBVH();
+#endif
+}
+
+
+void BVH::finishBuild()
+{
+#if USE_QBVH
+	buildQBVH();
+#endif
+}
+
+
+void BVH::buildQBVH()
+{
+	// Every four-wide node takes at least one interior binary node, the root included.
+	delete[] _qnodes;
+	_qnodes = new QBVHNode[_nodes_used];
+
+	delete[] _cqnodes;
+	_cqnodes = nullptr;
+
+	if (_use_compressed_nodes)
+	{
+		// Compressed nodes count leaf items in 16 bits. Larger leaves keep the full-precision nodes.
+		bool do_leaves_fit{ true };
+
+		for (int i = 0; i < _nodes_used; ++i)
 		{
-			BVHNode& node = _nodes[i];
+			do_leaves_fit &= _nodes[i]._child_count <= std::numeric_limits<short>::max();
+		}
+
+		if (do_leaves_fit)
+		{
+			_cqnodes = new CompressedQBVHNode[_nodes_used];
+		}
+	}
+
+	refitQBVH();
+}
+
+
+void BVH::refitQBVH() const
+{
+	uint qnodes_used{ 1 };
+
+	collapseToQBVH(*this, _nodes[_root_node_index], _qnodes, 0, qnodes_used);
 
-			if (node._child_count > 0)
+	if (_cqnodes != nullptr)
+	{
+		compressQBVH(_qnodes, qnodes_used, _cqnodes);
+	}
+}
+
+
+void BVH::compressQBVH(const QBVHNode* nodes, const uint node_count, CompressedQBVHNode* compressed_nodes)
+{
+	for (uint n = 0; n < node_count; ++n)
+	{
+		const QBVHNode& node{ nodes[n] };
+		CompressedQBVHNode& compressed{ compressed_nodes[n] };
+
+		alignas(16) float bmin[3][4];
+		alignas(16) float bmax[3][4];
+		_mm_store_ps(bmin[0], node._min_x), _mm_store_ps(bmin[1], node._min_y), _mm_store_ps(bmin[2], node._min_z);
+		_mm_store_ps(bmax[0], node._max_x), _mm_store_ps(bmax[1], node._max_y), _mm_store_ps(bmax[2], node._max_z);
+
+		uchar* qmin[3]{ compressed._min_x, compressed._min_y, compressed._min_z };
+		uchar* qmax[3]{ compressed._max_x, compressed._max_y, compressed._max_z };
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			// The node's own box on this axis is the union of its used child slots.
+			float node_min{ 1e30f };
+			float node_max{ -1e30f };
+
+			for (int i = 0; i < 4; ++i)
 			{
-				// Leaf node: adjust bounds to contained triangles
-				updateNodeBounds(i);
+				if (node._child_count[i] >= 0)
+				{
+					node_min = min(node_min, bmin[axis][i]);
+					node_max = max(node_max, bmax[axis][i]);
+				}
 			}
-			else
+
+			// Smallest power of two step that spans the box in 255 steps.
+			int exponent{ -126 };
+			if (node_max > node_min)
 			{
-				// Interior node: adjust bounds to child node bounds
-				BVHNode& left_child = _nodes[node._significant_index];
-				BVHNode& right_child = _nodes[node._significant_index + 1];
+				exponent = max(-126, static_cast<int>(ceilf(log2f((node_max - node_min) / 255.0f))));
 
-				node._aabb_min = fminf(left_child._aabb_min, right_child._aabb_min);
-				node._aabb_max = fmaxf(left_child._aabb_max, right_child._aabb_max);
+				while (node_min + 255.0f * ldexpf(1.0f, exponent) < node_max)
+				{
+					++exponent;
+				}
 			}
+
+			const float step{ ldexpf(1.0f, exponent) };
+
+			compressed._origin[axis] = node_min;
+			compressed._exponent[axis] = static_cast<signed char>(exponent);
+
+			for (int i = 0; i < 4; ++i)
+			{
+				if (node._child_count[i] < 0)
+				{
+					qmin[axis][i] = 255;
+					qmax[axis][i] = 0;
+
+					continue;
+				}
+
+				// Round outward, then correct for float rounding in the decode.
+				int low{ clamp(static_cast<int>(floorf((bmin[axis][i] - node_min) / step)), 0, 255) };
+				while (low > 0 && node_min + low * step > bmin[axis][i])
+				{
+					--low;
+				}
+
+				int high{ clamp(static_cast<int>(ceilf((bmax[axis][i] - node_min) / step)), 0, 255) };
+				while (high < 255 && node_min + high * step < bmax[axis][i])
+				{
+					++high;
+				}
+
+				qmin[axis][i] = static_cast<uchar>(low);
+				qmax[axis][i] = static_cast<uchar>(high);
+			}
+		}
+
+		compressed._padding = 0;
+
+		for (int i = 0; i < 4; ++i)
+		{
+			compressed._child_index[i] = node._child_index[i];
+			compressed._child_count[i] = static_cast<short>(node._child_count[i]);
 		}
 	}
 }
@@ -3,6 +3,90 @@
 // ALL TLAS/BLAS CODE HEAVILY INSPIRED (OR OUTRIGHT COPIED) FROM JACCO'S SERIES ON BVH CREATION
 // [Credit] https://jacco.ompf2.com/2022/04/13/how-to-build-a-bvh-part-1-basics/
 
+// Collapse the binary BVHs and TLAS into four-wide nodes for scalar traversal.
+#define USE_QBVH 1
+
+
+// Row-major 3x4 affine transform. Instances never project, so the fourth row of their mat4 is not stored.
+struct AffineTransform
+{
+	AffineTransform() = default;
+	explicit AffineTransform(const mat4& matrix)
+		: _rows{ _mm_load_ps(&matrix.cell[0]), _mm_load_ps(&matrix.cell[4]), _mm_load_ps(&matrix.cell[8]) }
+	{	}
+
+	inline __m128 transformPosition(const __m128 position) const
+	{
+		const __m128 p{ _mm_blend_ps(position, _mm_set1_ps(1.0f), 0b1000) };
+
+		return _mm_or_ps(_mm_or_ps(_mm_dp_ps(_rows[0], p, 0xF1), _mm_dp_ps(_rows[1], p, 0xF2)), _mm_dp_ps(_rows[2], p, 0xF4));
+	}
+
+	inline __m128 transformVector(const __m128 vector) const
+	{
+		return _mm_or_ps(_mm_or_ps(_mm_dp_ps(_rows[0], vector, 0x71), _mm_dp_ps(_rows[1], vector, 0x72)), _mm_dp_ps(_rows[2], vector, 0x74));
+	}
+
+	inline float3 transformPosition(const float3& position) const
+	{
+		alignas(16) float result[4];
+		_mm_store_ps(result, transformPosition(_mm_setr_ps(position.x, position.y, position.z, 1.0f)));
+
+		return float3{ result[0], result[1], result[2] };
+	}
+
+	inline float3 transformVector(const float3& vector) const
+	{
+		alignas(16) float result[4];
+		_mm_store_ps(result, transformVector(_mm_setr_ps(vector.x, vector.y, vector.z, 0.0f)));
+
+		return float3{ result[0], result[1], result[2] };
+	}
+
+	// Translation column, as a vector with a zero w.
+	inline __m128 getTranslation() const
+	{
+		return _mm_setr_ps(_mm_cvtss_f32(_mm_shuffle_ps(_rows[0], _rows[0], 0xFF)),
+			_mm_cvtss_f32(_mm_shuffle_ps(_rows[1], _rows[1], 0xFF)),
+			_mm_cvtss_f32(_mm_shuffle_ps(_rows[2], _rows[2], 0xFF)),
+			0.0f);
+	}
+
+	__m128 _rows[3]{ _mm_setr_ps(1.0f, 0.0f, 0.0f, 0.0f), _mm_setr_ps(0.0f, 1.0f, 0.0f, 0.0f), _mm_setr_ps(0.0f, 0.0f, 1.0f, 0.0f) };
+};
+
+
+// Four-wide node that binary trees are collapsed into. Child bounds are stored per axis, so one SSE slab test covers all four children.
+struct QBVHNode
+{
+	__m128 _min_x, _min_y, _min_z;
+	__m128 _max_x, _max_y, _max_z;
+
+	// Index of child node, or first item of a leaf child.
+	int _child_index[4];
+
+	// Number of items in a leaf child. Zero for interior children, -1 for empty slots.
+	int _child_count[4];
+};
+
+
+// Compressed four-wide node, half the size of QBVHNode. Child bounds are stored as 8-bit offsets from the node's own box,
+// in steps of a power of two per axis. Quantization rounds outward, so decoded child boxes only ever grow.
+struct alignas(64) CompressedQBVHNode
+{
+	// Decoded bound = _origin + q * 2^_exponent.
+	float _origin[3];
+	signed char _exponent[3];
+	uchar _padding;
+
+	uchar _min_x[4], _min_y[4], _min_z[4];
+	uchar _max_x[4], _max_y[4], _max_z[4];
+
+	// Same meaning as in QBVHNode.
+	int _child_index[4];
+	short _child_count[4];
+};
+
 
 class BVH
 {
@@ -51,36 +135,81 @@ public:
 	BVH& operator=(BVH&&) = delete;
 
 	// Dtor.
-	virtual ~BVH() = default;
+	virtual ~BVH();
 
 	// Vitual methods.
 	virtual void build() = 0;
 	virtual void refitBVH() const;
+	// Per-frame update of the BLAS' contents. Sphere and triangle BLASes never change their items, so only cubes have work to do.
+	virtual void update() {}
 	virtual void setTransform(const float3& scale, const float3& rotation, const float3& translation);
-	virtual void findNearest(Ray& ray, const uint node_index) const;
-	virtual bool findOcclusion(Ray& ray, TintData& tint_data, const uint node_index) const;
-	virtual void findNearestToPlayer(Ray& ray, const uint node_index, const int source_id) const;
-	virtual void eraseVoxels(Ray& ray, const uint node_index, Cube*& modified_cube);
+	virtual void findNearest4(Ray* rays, const uint node_index) const;
 	virtual void setID(const int id);
 
-	// Abstract methods.
+	// Abstract methods. Traversal is generated per BLAS type by BVHTraversal.
+	virtual void findNearest(Ray& ray, const uint node_index) const = 0;
+	virtual bool findOcclusion(Ray& ray, TintData& tint_data, const uint node_index) const = 0;
+	virtual void eraseVoxels(Ray& ray, const uint node_index, Cube*& modified_cube) = 0;
 	virtual void updateNodeBounds(uint node_index) const = 0;
 	virtual void intersectItemForNearest(Ray& ray, const uint item_index) const = 0;
+	virtual void intersectItemForNearest4(Ray* rays, const uint item_index) const;
 	virtual bool intersectItemForOcclusion(Ray& ray, TintData& tint_data, const uint item_index) const = 0;
 	virtual void interesectItemForMaterialExit(Ray&, const uint) const {};
-	virtual void intersectItemForNearestToPlayer(Ray& ray, const uint item_index, const int source_id) const = 0;
 	virtual void intersectItemForVoxelErasure(Ray&, const uint, Cube*&) {}
 
 	// Real method.
 	void setBounds();
+	void publishTransform();
+	void setMask(const uint mask);
 
 	// Statics methods.
 	static float intersectAABBForNearest(const Ray& ray, const float3& bmin, const float3& bmax);	
 	static float intersectAABBForNearest_SSE(const Ray& ray, const __m128 bmin4, const __m128 bmax4);
+	static __m128 intersectAABBForNearest4(const RayPacket4& packet, const float3& bmin, const float3& bmax);
+	static float getPacketNearest(const __m128 distances);
 	static float calculateNodeCost(const BVHNode& node);
 
+	template <typename Node, typename Tree, typename LeafVisitor>
+	static bool traverse(const Tree& tree, const Node* root, Ray& ray, LeafVisitor&& visit_leaf);
+
+	template <typename QNode, typename LeafVisitor>
+	static bool traverseQBVH(const QNode* nodes, const uint root_index, Ray& ray, LeafVisitor&& visit_leaf);
+
+	template <typename Node, typename Tree>
+	static void collapseToQBVH(const Tree& tree, const Node& node, QBVHNode* nodes, const uint node_index, uint& nodes_used);
+
+	// Quantizes collapsed four-wide nodes. Leaves holding more items than a compressed node can count are not supported.
+	static void compressQBVH(const QBVHNode* nodes, const uint node_count, CompressedQBVHNode* compressed_nodes);
+
+	// Tree interface used by traverse() and collapseToQBVH().
+	bool isLeaf(const BVHNode& node) const { return node._child_count > 0; }
+	const BVHNode* getLeftChild(const BVHNode& node) const { return &_nodes[node._significant_index]; }
+	const BVHNode* getRightChild(const BVHNode& node) const { return &_nodes[node._significant_index + 1]; }
+	int getLeafFirst(const BVHNode& node) const { return node._significant_index; }
+	int getLeafCount(const BVHNode& node) const { return node._child_count; }
+
 	aabb _bounds{ 0.0f, 1.0f };
 
+	// Seconds the last build() took.
+	float _build_time{ 0.0f };
+
+	// Traverse quantized four-wide nodes. Takes effect on the next build().
+	bool _use_compressed_nodes{ false };
+
+	// Incremented whenever the world-space bounds or the mask change. A TLAS refits this instance's leaf when its copy differs.
+	uint _bounds_version{ 1 };
+
+	// Instance masks, stored in the TLAS leaves. Rays only enter instances sharing a bit with their Ray::_mask.
+	static constexpr uint _MASK_SCENERY{ 1 << 0 };
+	static constexpr uint _MASK_PIER{ 1 << 1 };
+	static constexpr uint _MASK_WATER{ 1 << 2 };
+	static constexpr uint _MASK_SPHERES{ 1 << 3 };
+	static constexpr uint _MASK_SHIP{ 1 << 4 };
+	static constexpr uint _MASK_AVATAR{ 1 << 5 };
+	static constexpr uint _MASK_ALL{ 0xFF };
+
+	uint _mask{ _MASK_SCENERY };
+
 	// Transformations.
 	float3 _scale{ 1.0f };
 	float3 _translate{ 0.0f };
@@ -93,6 +222,15 @@ public:
 	mat4 _matrix{ mat4::Identity() };
 	mat4 _inverse_matrix{ _matrix.Inverted() };
 
+	// Transforms used while tracing. Gameplay moves the instance through _matrix while a frame is traced,
+	// publishTransform() copies it over once the TLAS refit with the new bounds is in use.
+	// Instances that are only translated skip the matrix and offset rays instead.
+	AffineTransform _traced_transform;
+	AffineTransform _traced_inverse_transform;
+	__m128 _traced_inverse_offset{ _mm_setzero_ps() };
+	bool _is_traced_translation{ true };
+	uint _published_version{ 0 };
+
 
 protected:
 	// Ctor.
@@ -105,19 +243,63 @@ protected:
 		int _count{ 0 };
 	};
 
+	// Child bounds of a four-wide node as min x/y/z and max x/y/z, four children per register.
+	static inline void loadChildBounds(const QBVHNode& node, __m128* bounds)
+	{
+		bounds[0] = node._min_x, bounds[1] = node._min_y, bounds[2] = node._min_z;
+		bounds[3] = node._max_x, bounds[4] = node._max_y, bounds[5] = node._max_z;
+	}
+
+	static inline __m128 dequantize(const uchar* q, const float origin, const int exponent)
+	{
+		// Build 2^exponent straight from its float bits.
+		const __m128 scale{ _mm_castsi128_ps(_mm_set1_epi32((exponent + 127) << 23)) };
+		const __m128i q4{ _mm_cvtepu8_epi32(_mm_cvtsi32_si128(*reinterpret_cast<const int*>(q))) };
+
+		return _mm_add_ps(_mm_set1_ps(origin), _mm_mul_ps(_mm_cvtepi32_ps(q4), scale));
+	}
+
+	static inline void loadChildBounds(const CompressedQBVHNode& node, __m128* bounds)
+	{
+		bounds[0] = dequantize(node._min_x, node._origin[0], node._exponent[0]);
+		bounds[1] = dequantize(node._min_y, node._origin[1], node._exponent[1]);
+		bounds[2] = dequantize(node._min_z, node._origin[2], node._exponent[2]);
+		bounds[3] = dequantize(node._max_x, node._origin[0], node._exponent[0]);
+		bounds[4] = dequantize(node._max_y, node._origin[1], node._exponent[1]);
+		bounds[5] = dequantize(node._max_z, node._origin[2], node._exponent[2]);
+	}
+
 	// Ray transformation for transformed BVHs.
 	inline Ray getTransformedRay(const Ray& ray) const
 	{
 #if USE_SSE
+		// Translated instances keep the ray's direction and reciprocal. Only the origin moves, its payload lane untouched.
+		if (_is_traced_translation)
+		{
+			Ray new_ray{ ray };
+			new_ray.O4 = _mm_blend_ps(_mm_add_ps(ray.O4, _traced_inverse_offset), ray.O4, 0b1000);
+
+			return new_ray;
+		}
+
 		Ray new_ray{
-			TransformPosition_SSE(ray.O4, _inverse_matrix),
-			TransformVector_SSE(ray.D4, _inverse_matrix),
+			_traced_inverse_transform.transformPosition(ray.O4),
+			_traced_inverse_transform.transformVector(ray.D4),
 			ray };
 #else
 		Ray new_ray{ ray };
 
-		new_ray.O = TransformPosition(new_ray.O, _inverse_matrix);
-		new_ray.D = TransformVector(new_ray.D, _inverse_matrix);
+		if (_is_traced_translation)
+		{
+			alignas(16) float offset[4];
+			_mm_store_ps(offset, _traced_inverse_offset);
+			new_ray.O += float3{ offset[0], offset[1], offset[2] };
+
+			return new_ray;
+		}
+
+		new_ray.O = _traced_inverse_transform.transformPosition(new_ray.O);
+		new_ray.D = _traced_inverse_transform.transformVector(new_ray.D);
 		new_ray.rD = float3{ 1.0f / new_ray.D }; // SIMD?
 		new_ray.calculateDSign();
 #endif
@@ -134,13 +316,617 @@ protected:
 
 		if (ray._id == _id)
 		{
-			ray.normal = normalize(TransformVector(transformed_ray.normal, _matrix));
+			ray.normal = _is_traced_translation ? transformed_ray.normal : normalize(_traced_transform.transformVector(transformed_ray.normal));
+		}
+	}
+
+	// Runs visit_items(ray, first, count) on every leaf the ray reaches, through the four-wide nodes when enabled.
+	template <typename ItemVisitor>
+	bool traverseItems(const uint node_index, Ray& ray, ItemVisitor&& visit_items) const
+	{
+#if USE_QBVH
+		if (_cqnodes != nullptr)
+		{
+			return traverseQBVH(_cqnodes, node_index, ray, visit_items);
 		}
+
+		return traverseQBVH(_qnodes, node_index, ray, visit_items);
+#else
+		return traverse(*this, &_nodes[node_index], ray, [&visit_items](Ray& leaf_ray, const BVHNode& node)
+		{
+			return visit_items(leaf_ray, node._significant_index, node._child_count);
+		});
+#endif
 	}
 
+	// Sets _matrix and its inverse from the transform components, rotating and scaling around pivot.
+	void composeTransform(const float3& pivot, const mat4& rotation);
+
+	// Shared tail of every build().
+	void finishBuild();
+
+	// Binned SAH split shared by the item BVHs. item_centroid(item) and item_bounds(item) read one item.
+	template <typename ItemCentroid, typename ItemBounds>
+	float findBinnedSplitPlane(const BVHNode& node, ItemCentroid&& item_centroid, ItemBounds&& item_bounds, int& best_axis, float& best_position) const;
+
+	// Threads a build may spread over, bounded by the hardware.
+	static int getBuildTaskCount()
+	{
+		static const int task_count{ clamp(static_cast<int>(std::thread::hardware_concurrency()), 1, _BUILD_TASKS) };
+		return task_count;
+	}
+
+	// Claims two consecutive nodes for a split. Safe to call from parallel build tasks.
+	int allocateChildPair() { return _nodes_used.fetch_add(2); }
+
+	// Claims one of the getBuildTaskCount() - 1 threads a build may hand subtrees to. Fails when all are running.
+	bool reserveBuildTask() const;
+
+	// Subdivides both children of a split, handing the left subtree to another thread when it is large enough and one is free.
+	template <typename Subdivide>
+	void subdivideChildren(const uint left_child_index, const uint right_child_index, Subdivide&& subdivide) const;
+
+	// Collapse the binary tree into four-wide nodes. Called at the end of build() and refitBVH().
+	void buildQBVH();
+	void refitQBVH() const;
+
+	// Nodes with at least this many items are split and binned on several threads while building.
+	static constexpr int _PARALLEL_BUILD_THRESHOLD{ 4096 };
+	static constexpr int _BUILD_TASKS{ 8 };
+	static constexpr int _SPLITS{ 8 };
+
 	// Properites.
 	int _root_node_index{ 0 };
-	int _nodes_used{ 1 };
+	std::atomic<int> _nodes_used{ 1 };
+
+	// Subtrees being built on threads of their own, see reserveBuildTask().
+	mutable std::atomic<int> _build_tasks_running{ 0 };
 	BVHNode* _nodes{ nullptr };
+	QBVHNode* _qnodes{ nullptr };
+	CompressedQBVHNode* _cqnodes{ nullptr };
 	uint* _item_indicies{ nullptr };
-};
\ No newline at end of file
+};
+
+
+// Stack traversal shared by every BVH and the TLAS.
+// The tree provides isLeaf(), getLeftChild() and getRightChild() for its node type.
+// visit_leaf(ray, node) resolves a leaf and returns true to end the traversal early (any-hit queries).
+// Stack entries keep their entry distance, so nodes lying behind a hit found in the meantime are dropped when popped.
+template <typename Node, typename Tree, typename LeafVisitor>
+inline bool BVH::traverse(const Tree& tree, const Node* root, Ray& ray, LeafVisitor&& visit_leaf)
+{
+	struct StackEntry
+	{
+		const Node* _node;
+		float _distance;
+	};
+
+	const Node* node_ptr{ root };
+	StackEntry stack[64];
+	uint stack_ptr{ 0 };
+
+	while (true)
+	{
+		const Node& node{ *node_ptr };
+
+		if (tree.isLeaf(node))
+		{
+			// Resolve leaf node.
+			if (visit_leaf(ray, node))
+			{
+				return true;
+			}
+		}
+		else
+		{
+			// Check child nodes.
+			const Node* child1{ tree.getLeftChild(node) };
+			const Node* child2{ tree.getRightChild(node) };
+
+#if USE_SSE == 1
+			float dist1 = intersectAABBForNearest_SSE(ray, child1->_aabb_min4, child1->_aabb_max4);
+			float dist2 = intersectAABBForNearest_SSE(ray, child2->_aabb_min4, child2->_aabb_max4);
+#else
+			float dist1 = intersectAABBForNearest(ray, child1->_aabb_min, child1->_aabb_max);
+			float dist2 = intersectAABBForNearest(ray, child2->_aabb_min, child2->_aabb_max);
+#endif
+
+			// Place closer child first for intersection resolution.
+			if (dist1 > dist2)
+			{
+				swap(dist1, dist2);
+
+				swap(child1, child2);
+			}
+
+			if (dist1 != Ray::t_max)
+			{
+				if (dist2 != Ray::t_max)
+				{
+					stack[stack_ptr++] = StackEntry{ child2, dist2 };
+				}
+
+				node_ptr = child1;
+
+				continue;
+			}
+		}
+
+		// Pop the next node that still lies in front of the ray's current hit.
+		do
+		{
+			if (stack_ptr == 0)
+			{
+				return false;
+			}
+
+			node_ptr = stack[--stack_ptr]._node;
+		} while (stack[stack_ptr]._distance >= ray.t);
+	}
+}
+
+
+// Stack traversal over four-wide nodes. All four child boxes are tested in one SSE slab test, hit children are pushed far to near.
+// visit_leaf(ray, first, count) resolves a leaf and returns true to end the traversal early (any-hit queries).
+// Leaf children are pushed too, so leaves are resolved in front to back order and culled once the ray's hit is closer.
+// Works on QBVHNode and CompressedQBVHNode, whose child bounds are decoded on the fly.
+template <typename QNode, typename LeafVisitor>
+inline bool BVH::traverseQBVH(const QNode* nodes, const uint root_index, Ray& ray, LeafVisitor&& visit_leaf)
+{
+	struct StackEntry
+	{
+		int _index;
+		int _count;
+		float _distance;
+	};
+
+	const __m128 origin_x{ _mm_set1_ps(ray.O.x) };
+	const __m128 origin_y{ _mm_set1_ps(ray.O.y) };
+	const __m128 origin_z{ _mm_set1_ps(ray.O.z) };
+	const __m128 reciprocal_x{ _mm_set1_ps(ray.rD.x) };
+	const __m128 reciprocal_y{ _mm_set1_ps(ray.rD.y) };
+	const __m128 reciprocal_z{ _mm_set1_ps(ray.rD.z) };
+
+	StackEntry entry{ static_cast<int>(root_index), 0, 0.0f };
+	StackEntry stack[256];
+	uint stack_ptr{ 0 };
+
+	while (true)
+	{
+		if (entry._count > 0)
+		{
+			// Resolve leaf.
+			if (visit_leaf(ray, entry._index, entry._count))
+			{
+				return true;
+			}
+		}
+		else
+		{
+			const QNode& node{ nodes[entry._index] };
+
+			__m128 bounds[6];
+			loadChildBounds(node, bounds);
+
+			// Slab test against all four children.
+			const __m128 tx1{ _mm_mul_ps(_mm_sub_ps(bounds[0], origin_x), reciprocal_x) };
+			const __m128 tx2{ _mm_mul_ps(_mm_sub_ps(bounds[3], origin_x), reciprocal_x) };
+			__m128 tmin{ _mm_min_ps(tx1, tx2) }, tmax{ _mm_max_ps(tx1, tx2) };
+
+			const __m128 ty1{ _mm_mul_ps(_mm_sub_ps(bounds[1], origin_y), reciprocal_y) };
+			const __m128 ty2{ _mm_mul_ps(_mm_sub_ps(bounds[4], origin_y), reciprocal_y) };
+			tmin = _mm_max_ps(tmin, _mm_min_ps(ty1, ty2)), tmax = _mm_min_ps(tmax, _mm_max_ps(ty1, ty2));
+
+			const __m128 tz1{ _mm_mul_ps(_mm_sub_ps(bounds[2], origin_z), reciprocal_z) };
+			const __m128 tz2{ _mm_mul_ps(_mm_sub_ps(bounds[5], origin_z), reciprocal_z) };
+			tmin = _mm_max_ps(tmin, _mm_min_ps(tz1, tz2)), tmax = _mm_min_ps(tmax, _mm_max_ps(tz1, tz2));
+
+			// tmax >= tmin && tmin < ray.t && tmax > 0
+			const int hit_mask{ _mm_movemask_ps(_mm_and_ps(
+				_mm_and_ps(_mm_cmpge_ps(tmax, tmin), _mm_cmplt_ps(tmin, _mm_set1_ps(ray.t))),
+				_mm_cmpgt_ps(tmax, _mm_setzero_ps())
+			)) };
+
+			alignas(16) float distances[4];
+			_mm_store_ps(distances, tmin);
+
+			// Sort hit children far to near, so the nearest one ends up on top of the stack.
+			StackEntry hits[4];
+			int hit_count{ 0 };
+
+			for (int i = 0; i < 4; ++i)
+			{
+				if ((hit_mask >> i) & 1 && node._child_count[i] >= 0)
+				{
+					const StackEntry hit{ node._child_index[i], node._child_count[i], distances[i] };
+
+					int j{ hit_count++ };
+
+					for (; j > 0 && hits[j - 1]._distance < hit._distance; --j)
+					{
+						hits[j] = hits[j - 1];
+					}
+
+					hits[j] = hit;
+				}
+			}
+
+			for (int i = 0; i < hit_count; ++i)
+			{
+				stack[stack_ptr++] = hits[i];
+			}
+		}
+
+		// Pop the next entry that still lies in front of the ray's current hit.
+		do
+		{
+			if (stack_ptr == 0)
+			{
+				return false;
+			}
+
+			entry = stack[--stack_ptr];
+		} while (entry._distance >= ray.t);
+	}
+}
+
+
+// Collapses the binary subtree below node into nodes[node_index], recursing into newly allocated nodes.
+// Interior children with the largest surface area are opened until four children remain.
+// The tree provides getLeafFirst() and getLeafCount() on top of the traverse() interface.
+template <typename Node, typename Tree>
+inline void BVH::collapseToQBVH(const Tree& tree, const Node& node, QBVHNode* nodes, const uint node_index, uint& nodes_used)
+{
+	const Node* children[4];
+	int child_count{ 0 };
+
+	// A leaf root becomes the only child of the root node.
+	if (tree.isLeaf(node))
+	{
+		children[child_count++] = &node;
+	}
+	else
+	{
+		children[child_count++] = tree.getLeftChild(node);
+		children[child_count++] = tree.getRightChild(node);
+	}
+
+	while (child_count < 4)
+	{
+		int largest{ -1 };
+		float largest_area{ -1.0f };
+
+		for (int i = 0; i < child_count; ++i)
+		{
+			if (!tree.isLeaf(*children[i]))
+			{
+				const float3 e{ children[i]->_aabb_max - children[i]->_aabb_min };
+				const float area{ (e.x * e.y) + (e.y * e.z) + (e.z * e.x) };
+
+				if (area > largest_area)
+				{
+					largest = i;
+					largest_area = area;
+				}
+			}
+		}
+
+		if (largest == -1)
+		{
+			break;
+		}
+
+		const Node* opened{ children[largest] };
+		children[largest] = tree.getLeftChild(*opened);
+		children[child_count++] = tree.getRightChild(*opened);
+	}
+
+	// Fill the child slots.
+	alignas(16) float bmin[3][4]{};
+	alignas(16) float bmax[3][4]{};
+
+	QBVHNode& qnode{ nodes[node_index] };
+
+	for (int i = 0; i < 4; ++i)
+	{
+		if (i >= child_count)
+		{
+			qnode._child_index[i] = 0;
+			qnode._child_count[i] = -1;
+
+			continue;
+		}
+
+		const Node& child{ *children[i] };
+
+		bmin[0][i] = child._aabb_min.x, bmin[1][i] = child._aabb_min.y, bmin[2][i] = child._aabb_min.z;
+		bmax[0][i] = child._aabb_max.x, bmax[1][i] = child._aabb_max.y, bmax[2][i] = child._aabb_max.z;
+
+		if (tree.isLeaf(child))
+		{
+			qnode._child_index[i] = tree.getLeafFirst(child);
+			qnode._child_count[i] = tree.getLeafCount(child);
+		}
+		else
+		{
+			qnode._child_index[i] = nodes_used++;
+			qnode._child_count[i] = 0;
+		}
+	}
+
+	qnode._min_x = _mm_load_ps(bmin[0]), qnode._min_y = _mm_load_ps(bmin[1]), qnode._min_z = _mm_load_ps(bmin[2]);
+	qnode._max_x = _mm_load_ps(bmax[0]), qnode._max_y = _mm_load_ps(bmax[1]), qnode._max_z = _mm_load_ps(bmax[2]);
+
+	for (int i = 0; i < child_count; ++i)
+	{
+		if (qnode._child_count[i] == 0)
+		{
+			collapseToQBVH(tree, *children[i], nodes, qnode._child_index[i], nodes_used);
+		}
+	}
+}
+
+
+// Bins the centroids of the node's items on all three axes and returns the cheapest split plane.
+// Large nodes gather their centroid bounds and bins in slices on several threads, which are merged before the sweep.
+// Only while no subtree has its own thread yet. After that the subtrees already keep the threads busy.
+template <typename ItemCentroid, typename ItemBounds>
+inline float BVH::findBinnedSplitPlane(const BVHNode& node, ItemCentroid&& item_centroid, ItemBounds&& item_bounds, int& best_axis, float& best_position) const
+{
+	const int first{ node._significant_index };
+	const int count{ node._child_count };
+	const int task_count{ count >= _PARALLEL_BUILD_THRESHOLD && _build_tasks_running.load() == 0 ? getBuildTaskCount() : 1 };
+
+	// Runs slice_task(begin, end, result) over the node's items. Large nodes run it on equal slices in parallel,
+	// the first slice on this thread, and fold the partial results into result with merge(result, partial).
+	auto run_slices = [first, count, task_count](auto&& slice_task, auto& result, auto&& merge)
+	{
+		if (task_count == 1)
+		{
+			slice_task(first, first + count, result);
+			return;
+		}
+
+		using Result = std::remove_reference_t<decltype(result)>;
+
+		Result partials[_BUILD_TASKS];
+		std::future<void> tasks[_BUILD_TASKS];
+
+		for (int i = 1; i < task_count; ++i)
+		{
+			tasks[i] = std::async(std::launch::async, [&slice_task, &partials, first, count, task_count, i]()
+			{
+				slice_task(first + count * i / task_count, first + count * (i + 1) / task_count, partials[i]);
+			});
+		}
+
+		slice_task(first, first + count / task_count, result);
+
+		for (int i = 1; i < task_count; ++i)
+		{
+			tasks[i].get();
+			merge(result, partials[i]);
+		}
+	};
+
+	// Centroid bounds to place the bins in.
+	aabb bounds;
+	run_slices([this, &item_centroid](const int begin, const int end, aabb& slice_bounds)
+	{
+		for (int i = begin; i < end; ++i)
+		{
+			slice_bounds.Grow(item_centroid(_item_indicies[i]));
+		}
+	}, bounds, [](aabb& merged, const aabb& partial) { merged.Grow(partial); });
+
+	float scale[3];
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		const float extent{ bounds.Extend(axis) };
+		scale[axis] = extent > 0.0f ? _SPLITS / extent : 0.0f;
+	}
+
+	// BIN creation, every axis in the same pass.
+	struct AxisBins
+	{
+		Bin _bins[3][_SPLITS];
+	};
+
+	AxisBins axis_bins;
+	run_slices([this, &item_centroid, &item_bounds, &bounds, &scale](const int begin, const int end, AxisBins& slice_bins)
+	{
+		for (int i = begin; i < end; ++i)
+		{
+			const uint item_index{ _item_indicies[i] };
+			const float3 centroid{ item_centroid(item_index) };
+			const aabb item_box{ item_bounds(item_index) };
+
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				const int bin_index{ min(_SPLITS - 1, static_cast<int>((centroid.cell[axis] - bounds.bmin[axis]) * scale[axis])) };
+				Bin& bin{ slice_bins._bins[axis][bin_index] };
+				bin._count++;
+				bin._bounds.Grow(item_box);
+			}
+		}
+	}, axis_bins, [](AxisBins& merged, const AxisBins& partial)
+	{
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			for (int i = 0; i < _SPLITS; ++i)
+			{
+				merged._bins[axis][i]._count += partial._bins[axis][i]._count;
+				merged._bins[axis][i]._bounds.Grow(partial._bins[axis][i]._bounds);
+			}
+		}
+	});
+
+	float best_cost{ 1e30f };
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		// If flat, skip.
+		if (scale[axis] == 0.0f)
+		{
+			continue;
+		}
+
+		const Bin* bins{ axis_bins._bins[axis] };
+
+		// Plane setup.
+		int left_count[_SPLITS - 1];
+		int right_count[_SPLITS - 1];
+		float left_area[_SPLITS - 1];
+		float right_area[_SPLITS - 1];
+		{
+			aabb left_box;
+			aabb right_box;
+
+			int left_sum{ 0 };
+			int right_sum{ 0 };
+
+			for (int i = 0; i < _SPLITS - 1; ++i)
+			{
+				left_sum += bins[i]._count;
+				left_count[i] = left_sum;
+				left_box.Grow(bins[i]._bounds);
+				left_area[i] = left_box.Area();
+
+				right_sum += bins[_SPLITS - 1 - i]._count;
+				right_count[_SPLITS - 2 - i] = right_sum;
+				right_box.Grow(bins[_SPLITS - 1 - i]._bounds);
+				right_area[_SPLITS - 2 - i] = right_box.Area();
+			}
+		}
+
+		// Get interval to check splits at.
+		const float interval{ 1.0f / scale[axis] };
+
+		for (int i = 0; i < _SPLITS - 1; ++i)
+		{
+			const float plane_cost{ (left_count[i] * left_area[i]) + (right_count[i] * right_area[i]) };
+			if (plane_cost < best_cost)
+			{
+				best_axis = axis;
+				best_position = bounds.bmin[axis] + interval * (i + 1);
+				best_cost = plane_cost;
+			}
+		}
+	}
+
+	return best_cost;
+}
+
+
+inline bool BVH::reserveBuildTask() const
+{
+	int running{ _build_tasks_running.load() };
+	do
+	{
+		if (running >= getBuildTaskCount() - 1)
+		{
+			return false;
+		}
+	} while (!_build_tasks_running.compare_exchange_weak(running, running + 1));
+
+	return true;
+}
+
+
+template <typename Subdivide>
+inline void BVH::subdivideChildren(const uint left_child_index, const uint right_child_index, Subdivide&& subdivide) const
+{
+	// The calling thread counts as one of getBuildTaskCount(), so serial recursion takes over once the others are in use.
+	if (_nodes[left_child_index]._child_count < _PARALLEL_BUILD_THRESHOLD || !reserveBuildTask())
+	{
+		subdivide(left_child_index);
+		subdivide(right_child_index);
+
+		return;
+	}
+
+	std::future<void> left_task{ std::async(std::launch::async, [this, &subdivide, left_child_index]()
+	{
+		subdivide(left_child_index);
+		--_build_tasks_running;
+	}) };
+	subdivide(right_child_index);
+	left_task.get();
+}
+
+
+// Generates the traversal methods of a BLAS type.
+// Items are intersected through Derived directly, so there is no virtual call per leaf item.
+template <typename Derived>
+class BVHTraversal : public BVH
+{
+public:
+	void findNearest(Ray& ray, const uint node_index) const override
+	{
+		// Create a transformed ray to send into the BVH.
+		Ray transformed_ray{ getTransformedRay(ray) };
+
+		const Derived& self{ static_cast<const Derived&>(*this) };
+
+		traverseItems(node_index, transformed_ray, [&](Ray& leaf_ray, const int first, const int count)
+		{
+			for (int i = 0; i < count; ++i)
+			{
+				self.Derived::intersectItemForNearest(leaf_ray, _item_indicies[first + i]);
+			}
+
+			return false;
+		});
+
+		// Move hit information into the original ray.
+		transferDataToRay(transformed_ray, ray);
+	}
+
+
+	bool findOcclusion(Ray& ray, TintData& tint_data, const uint node_index) const override
+	{
+		// Create a transformed ray to send into the BVH.
+		Ray transformed_ray{ getTransformedRay(ray) };
+
+		const Derived& self{ static_cast<const Derived&>(*this) };
+
+		return traverseItems(node_index, transformed_ray, [&](Ray& leaf_ray, const int first, const int count)
+		{
+			for (int i = 0; i < count; ++i)
+			{
+				if (self.Derived::intersectItemForOcclusion(leaf_ray, tint_data, _item_indicies[first + i]))
+				{
+					return true;
+				}
+			}
+
+			return false;
+		});
+	}
+
+
+	void eraseVoxels(Ray& ray, const uint node_index, Cube*& modified_cube) override
+	{
+		// Create a transformed ray to send into the BVH.
+		Ray transformed_ray{ getTransformedRay(ray) };
+
+		Derived& self{ static_cast<Derived&>(*this) };
+
+		traverseItems(node_index, transformed_ray, [&](Ray& leaf_ray, const int first, const int count)
+		{
+			for (int i = 0; i < count; ++i)
+			{
+				self.Derived::intersectItemForVoxelErasure(leaf_ray, _item_indicies[first + i], modified_cube);
+			}
+
+			return false;
+		});
+
+		// Move hit information into the original ray.
+		transferDataToRay(transformed_ray, ray);
+	}
+
+
+protected:
+	BVHTraversal() = default;
+};
@@ -5,8 +5,9 @@
 Camera::Camera()
 	: _position{ float3(-5.0f, 0.5f, -1.0f) }
 	, _look_at{ float3{0.5f, 0.5f, 0.5f} }
-	, _aspect_ratio{ static_cast<float>(SCRWIDTH) / static_cast<float>(SCRHEIGHT) }
 {
+	setResolution(make_int2(SCRWIDTH, SCRHEIGHT), static_cast<float>(SCRWIDTH) / static_cast<float>(SCRHEIGHT));
+
 	setFOV(_fov);
 	calculateOrientation();
 }
@@ -182,11 +183,10 @@ void Camera::updatePlayerCamera(int2& mouse_delta, Scene* scene)
 
 	// Check there are no obstructions between camera and avatar.
 	{
-		static int water_triangle_id{ scene->_triangle_bvh._id };
-
 		float ray_length{ length(_ahead * _distance_to_target) };
 		Ray obstruction_check{ _look_at, -_ahead, 0, ray_length, false };
-		scene->findNearestToPlayer(obstruction_check, water_triangle_id);
+		obstruction_check._mask = _OBSTRUCTION_RAY_MASK;
+		scene->findNearest(obstruction_check);
 
 		// If obstruction, move camera to point.
 		if (obstruction_check.t < ray_length)
@@ -229,7 +229,7 @@ void Camera::updateTelescopeCamera(const float delta_time, int2& mouse_delta, co
 	// Calculate the telescope zoom level.
 	{
 		// Limit the max zoom to not go through objects.
-		static float2 midscreen{ make_float2(SCRWIDTH, SCRHEIGHT) * 0.5f };
+		const float2 midscreen{ make_float2(_resolution) * 0.5f };
 
 		Ray zoom_limiting_ray{ getPickingRay(midscreen, 0) };
 		scene->findNearest(zoom_limiting_ray);
@@ -367,10 +367,7 @@ void Camera::calculateVirtualImagePlane()
 
 float2 Camera::getUV(const float2& pixel) const
 {
-	static constexpr float dx = 1.0f / SCRWIDTH;
-	static constexpr float dy = 1.0f / SCRHEIGHT;
-
-	return { pixel.x * dx, pixel.y * dy };
+	return pixel * _inverse_resolution;
 }
 
 
@@ -410,18 +407,17 @@ Ray Camera::getPrimaryRay(const float2 pixel, const uint source_voxel) const
 		float3 focus_point{ _position + position_to_pixel * t_to_focal_plane };
 
 		// Find random point on lens.
-		static constexpr float inverse_scrwidth{ 1.0f / SCRWIDTH };
-		float2 lens_offset{ getRandomPointInPolygon() * inverse_scrwidth }; // Divide to get % to traverse the right/up vectors.
+		float2 lens_offset{ getRandomPointInPolygon() * _inverse_resolution.x }; // Divide to get % to traverse the right/up vectors.
 		float3 origin{ _position + (_right * lens_offset.x) + (_up * lens_offset.y) };
 
 		return { origin, normalize(focus_point - origin), source_voxel, false };
 	}
 	case CamMode::FISHEYE:
 	{
-		constexpr static float radius{ SCRHEIGHT >> 1 };
-		constexpr static float inverse_radius{ 1.0f / radius };
-		constexpr static float radius2{ radius * radius };
-		const static float2 center{ SCRWIDTH >> 1, SCRHEIGHT >> 1 };
+		const float radius{ static_cast<float>(_resolution.y >> 1) };
+		const float inverse_radius{ 1.0f / radius };
+		const float radius2{ radius * radius };
+		const float2 center{ make_float2(_resolution >> 1) };
 
 		// If distance is greater than our circle, discard ray.
 		float2 distance{ pixel - center };
@@ -462,6 +458,18 @@ void Camera::setFOV(float horizontal_degrees)
 }
 
 
+void Camera::setResolution(const int2 resolution, const float aspect_ratio)
+{
+	_resolution = resolution;
+	_inverse_resolution = make_float2(1.0f / resolution.x, 1.0f / resolution.y);
+	_aspect_ratio = aspect_ratio;
+
+	// Same horizontal field of view, new height.
+	_vim_half_height = _vim_half_width / _aspect_ratio;
+	calculateVirtualImagePlane();
+}
+
+
 void Camera::setApertureRadius(float radius)
 {
 	_aperture_radius = radius;
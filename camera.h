@@ -36,6 +36,9 @@ public:
 
 	void setFOV(const float horizontal_degrees);
 
+	// Pixel coordinates passed in are in this resolution. The frustum has the given aspect ratio and keeps the horizontal field of view.
+	void setResolution(const int2 resolution, const float aspect_ratio);
+
 	void setApertureRadius(const float radius);
 
 	void setLookAt(const float3 look_at_position);	
@@ -103,6 +106,10 @@ public:
 	float _vim_half_height{ 1.0f };
 	float _vim_half_width{ 1.0f };
 
+	// Render resolution.
+	int2 _resolution{ 1, 1 };
+	float2 _inverse_resolution{ 1.0f, 1.0f };
+
 	// Aspect ratio & field of view.
 	float _fov{ 130.0f };
 	float _fov_rad{ 1.0f };
@@ -132,8 +139,8 @@ public:
 	bool _can_flip{ true };
 	float _flip_indicator{ 1.0f };
 
-	// Do not intersect this object for camera obstruction checks.
-	uint _ship_id{ 0 };
+	// Camera obstruction checks pass through water during flips, spheres and the ship.
+	static constexpr uint _OBSTRUCTION_RAY_MASK{ BVH::_MASK_ALL & ~(BVH::_MASK_WATER | BVH::_MASK_SPHERES | BVH::_MASK_SHIP) };
 
 private:
 	void updatePlayerCamera(int2& mouse_delta, Scene* scene);
@@ -38,5 +38,5 @@ bool CardManager::update(const float delta_time)
 
 void CardManager::copyTrimmedCardTo(Surface* screen)
 {
-	_card.TrimmedCopyTo(screen, 0, SCRHEIGHT - _card.height, _significant_card_length, _card.height);
+	_card.TrimmedCopyTo(screen, 0, screen->height - _card.height, _significant_card_length, _card.height);
 }
\ No newline at end of file
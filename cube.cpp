@@ -10,45 +10,532 @@ Cube::Cube(const uint3 size)
 }
 
 
+Cube::~Cube()
+{
+	freeBuffers();
+}
+
+
+void Cube::freeBuffers()
+{
+	FREE64(_bricks);
+	FREE64(_occupancy);
+	FREE64(_voxels);
+	FREE64(_palette);
+	FREE64(_distance_field);
+
+	_bricks = nullptr;
+	_occupancy = nullptr;
+	_voxels = nullptr;
+	_palette = nullptr;
+	_distance_field = nullptr;
+}
+
+
 void Cube::initialize(const uint3& size)
 {
+	// A cube can be set up again with another size. Everything built from the old grid goes.
+	freeBuffers();
+	_is_distance_field_dirty = true;
+	_mips.clear();
+	_mips_version = ~0u;
+	++_voxels_version;
+
 	// Set size of cube and 3D indexing helpers.
 	_size = size;
 	_pitch = _size.x;
 	_slice = _size.x * _size.y;
 	
-	// Create voxel grid.
-	_voxels = static_cast<uint*>(MALLOC64(_slice * _size.z * sizeof(uint)));
+	// Create brick layer. Partial bricks at the far edges are allowed.
+	_brick_grid_size = make_uint3(
+		(_size.x + _BRICK_SIZE - 1) >> _BRICK_SHIFT,
+		(_size.y + _BRICK_SIZE - 1) >> _BRICK_SHIFT,
+		(_size.z + _BRICK_SIZE - 1) >> _BRICK_SHIFT
+	);
+	_brick_pitch = _brick_grid_size.x;
+	_brick_slice = _brick_grid_size.x * _brick_grid_size.y;
+
+	_bricks = static_cast<uint*>(MALLOC64(_brick_slice * _brick_grid_size.z * sizeof(uint)));
+	if (_bricks)
+	{
+		memset(_bricks, 0, _brick_slice * _brick_grid_size.z * sizeof(uint));
+	}
+
+	// Create occupancy mask.
+	_block_grid_size = make_uint3(
+		(_size.x + _BLOCK_SIZE - 1) >> _BLOCK_SHIFT,
+		(_size.y + _BLOCK_SIZE - 1) >> _BLOCK_SHIFT,
+		(_size.z + _BLOCK_SIZE - 1) >> _BLOCK_SHIFT
+	);
+	_block_pitch = _block_grid_size.x;
+	_block_slice = _block_grid_size.x * _block_grid_size.y;
+
+	_occupancy = static_cast<uint64_t*>(MALLOC64(_block_slice * _block_grid_size.z * sizeof(uint64_t)));
+	if (_occupancy)
+	{
+		memset(_occupancy, 0, _block_slice * _block_grid_size.z * sizeof(uint64_t));
+	}
+
+	// Create voxel grid. The tiled layout pads the grid to whole 4x4x4 blocks.
+#if TILED_VOXELS
+	_voxel_count = _block_slice * _block_grid_size.z * _BLOCK_SIZE * _BLOCK_SIZE * _BLOCK_SIZE;
+#else
+	_voxel_count = _slice * _size.z;
+#endif
+
+	_voxels = static_cast<PaletteIndex*>(MALLOC64(_voxel_count * sizeof(PaletteIndex)));
 	if (_voxels)
 	{
-		memset(_voxels, 0, _slice * _size.z * sizeof(uint));
+		memset(_voxels, 0, _voxel_count * sizeof(PaletteIndex));
+	}
+
+	// Create palette. Entry 0 is air.
+	_palette = static_cast<uint*>(MALLOC64(_PALETTE_SIZE * sizeof(uint)));
+	if (_palette)
+	{
+		memset(_palette, 0, _PALETTE_SIZE * sizeof(uint));
 	}
+	_palette_size = 1;
 
-	// Set bounds.
-	_bounds[0] = float3{ 0.0f };
-	_bounds[1] = _bounds[0] + (make_float3(size) * VOXELSIZE);
+	// Set bounds. The grid starts out empty.
+	setOccupiedBounds(make_uint3(0), make_uint3(0));
+	_is_occupied_bounds_dirty = false;
 }
 
 
 // Set voxel data.
 void Cube::set(const uint x, const uint y, const uint z, const uint material_data, const uint voxel_color)
 {
-	_voxels[x + y * _pitch + z * _slice] = material_data | voxel_color;
+	PaletteIndex& cell{ _voxels[getVoxelIndex(x, y, z)] };
+	const PaletteIndex voxel{ findPaletteIndex(material_data | voxel_color) };
+
+	updateBrick(x, y, z, cell, voxel);
+	updateOccupancy(x, y, z, voxel);
+	updateDistanceField(x, y, z, cell, voxel);
+	updateOccupiedBounds(x, y, z, cell, voxel);
+
+	cell = voxel;
+	++_voxels_version;
+}
+
+
+// Find the palette entry holding a full voxel word, adding it if this cube has not used it before.
+Cube::PaletteIndex Cube::findPaletteIndex(const uint voxel)
+{
+	if (!voxel)
+	{
+		return 0;
+	}
+
+	for (uint i = 1; i < _palette_size; ++i)
+	{
+		if (_palette[i] == voxel)
+		{
+			return static_cast<PaletteIndex>(i);
+		}
+	}
+
+	if (_palette_size == _PALETTE_SIZE)
+	{
+		FATALERROR("Cube palette is full (%u entries). Raise VOXEL_PALETTE_BITS.", _PALETTE_SIZE - 1);
+	}
+
+	_palette[_palette_size] = voxel;
+
+	return static_cast<PaletteIndex>(_palette_size++);
+}
+
+
+// Build the Chebyshev distance field with a forward and a backward chamfer pass over the 26-neighborhood.
+// All neighbor weights are 1, which makes the two passes exact for the Chebyshev metric.
+void Cube::buildDistanceField()
+{
+	if (!_use_distance_field || !_is_distance_field_dirty)
+	{
+		return;
+	}
+
+	const uint voxel_count{ _slice * _size.z };
+
+	if (!_distance_field)
+	{
+		_distance_field = static_cast<uchar*>(MALLOC64(voxel_count * sizeof(uchar)));
+
+		if (!_distance_field)
+		{
+			return;
+		}
+	}
+
+	const int3 size{ make_int3(_size) };
+
+	// Solid voxels are at distance 0, everything else starts as far away as we track.
+	for (int z = 0; z < size.z; ++z)
+	{
+		for (int y = 0; y < size.y; ++y)
+		{
+			for (int x = 0; x < size.x; ++x)
+			{
+				_distance_field[x + y * _pitch + z * _slice] = _voxels[getVoxelIndex(x, y, z)] ? 0 : static_cast<uchar>(_MAX_DISTANCE);
+			}
+		}
+	}
+
+	// Relax each voxel against the 13 neighbors already visited in the current pass direction.
+	auto relax = [&](const int x, const int y, const int z, const int direction)
+	{
+		uchar& distance{ _distance_field[x + y * _pitch + z * _slice] };
+
+		for (int dz = -1; dz <= 0; ++dz)
+		{
+			for (int dy = -1; dy <= 1; ++dy)
+			{
+				for (int dx = -1; dx <= 1; ++dx)
+				{
+					// Only neighbors that come earlier in traversal order.
+					if (dz == 0 && (dy > 0 || (dy == 0 && dx >= 0)))
+					{
+						continue;
+					}
+
+					const int nx{ x + dx * direction };
+					const int ny{ y + dy * direction };
+					const int nz{ z + dz * direction };
+
+					if (nx < 0 || ny < 0 || nz < 0 || nx >= size.x || ny >= size.y || nz >= size.z)
+					{
+						continue;
+					}
+
+					const uchar neighbor{ _distance_field[nx + ny * _pitch + nz * _slice] };
+					distance = min(distance, static_cast<uchar>(neighbor + 1));
+				}
+			}
+		}
+	};
+
+	// Forward pass.
+	for (int z = 0; z < size.z; ++z)
+	{
+		for (int y = 0; y < size.y; ++y)
+		{
+			for (int x = 0; x < size.x; ++x)
+			{
+				relax(x, y, z, 1);
+			}
+		}
+	}
+
+	// Backward pass.
+	for (int z = size.z - 1; z >= 0; --z)
+	{
+		for (int y = size.y - 1; y >= 0; --y)
+		{
+			for (int x = size.x - 1; x >= 0; --x)
+			{
+				relax(x, y, z, -1);
+			}
+		}
+	}
+
+	_is_distance_field_dirty = false;
+}
+
+
+// Incremental update of the distance field after a voxel change.
+// A new solid voxel pulls its neighborhood closer. A removed voxel would push distances outward,
+//  but leaving the smaller values in place is still safe (it only skips less), so that waits for the next build.
+void Cube::updateDistanceField(const uint x, const uint y, const uint z, const uint old_voxel, const uint new_voxel)
+{
+	if (!_distance_field)
+	{
+		return;
+	}
+
+	if (old_voxel && !new_voxel)
+	{
+		_is_distance_field_dirty = true;
+		return;
+	}
+
+	// A distance of 0 means this voxel was solid when its neighbors were last updated.
+	uchar& distance{ _distance_field[x + y * _pitch + z * _slice] };
+	if (old_voxel || !new_voxel || distance == 0)
+	{
+		return;
+	}
+
+	distance = 0;
+
+	const int radius{ static_cast<int>(_MAX_DISTANCE) - 1 };
+	const int3 lower{ max(static_cast<int>(x) - radius, 0), max(static_cast<int>(y) - radius, 0), max(static_cast<int>(z) - radius, 0) };
+	const int3 upper{
+		min(static_cast<int>(x) + radius, static_cast<int>(_size.x) - 1),
+		min(static_cast<int>(y) + radius, static_cast<int>(_size.y) - 1),
+		min(static_cast<int>(z) + radius, static_cast<int>(_size.z) - 1)
+	};
+
+	for (int nz = lower.z; nz <= upper.z; ++nz)
+	{
+		for (int ny = lower.y; ny <= upper.y; ++ny)
+		{
+			for (int nx = lower.x; nx <= upper.x; ++nx)
+			{
+				const int chebyshev{ max(max(abs(nx - static_cast<int>(x)), abs(ny - static_cast<int>(y))), abs(nz - static_cast<int>(z))) };
+
+				uchar& neighbor{ _distance_field[nx + ny * _pitch + nz * _slice] };
+				neighbor = min(neighbor, static_cast<uchar>(chebyshev));
+			}
+		}
+	}
+}
+
+
+// Shrink the occupied bounds to the solid voxels, after voxels were removed since the last build.
+// Works on the occupancy words, folding each 4x4x4 block down to the rows, columns and slices it has solid voxels in.
+void Cube::buildOccupiedBounds()
+{
+	if (!_is_occupied_bounds_dirty)
+	{
+		return;
+	}
+
+	// Lowest and highest set bit of a 4-bit mask.
+	auto lowestBit = [](const uint bits) { return bits & 1 ? 0u : bits & 2 ? 1u : bits & 4 ? 2u : 3u; };
+	auto highestBit = [](const uint bits) { return bits & 8 ? 3u : bits & 4 ? 2u : bits & 2 ? 1u : 0u; };
+
+	uint3 occupied_min{ _size };
+	uint3 occupied_max{ make_uint3(0) };
+	bool is_empty{ true };
+
+	for (uint bz = 0; bz < _block_grid_size.z; ++bz)
+	{
+		for (uint by = 0; by < _block_grid_size.y; ++by)
+		{
+			for (uint bx = 0; bx < _block_grid_size.x; ++bx)
+			{
+				const uint64_t block{ _occupancy[bx + by * _block_pitch + bz * _block_slice] };
+				if (!block)
+				{
+					continue;
+				}
+
+				// Bits are laid out as x | y << 2 | z << 4. OR the z slices together, then the y rows.
+				const uint z_slices{ static_cast<uint>(block & 0xFFFFull) | static_cast<uint>((block >> 16) & 0xFFFFull)
+					| static_cast<uint>((block >> 32) & 0xFFFFull) | static_cast<uint>(block >> 48) };
+				const uint x_bits{ (z_slices | (z_slices >> 4) | (z_slices >> 8) | (z_slices >> 12)) & 0xF };
+
+				uint y_bits{ 0 };
+				uint z_bits{ 0 };
+				for (uint i = 0; i < 4; ++i)
+				{
+					y_bits |= ((z_slices >> (i * 4)) & 0xF) ? 1u << i : 0u;
+					z_bits |= ((block >> (i * 16)) & 0xFFFFull) ? 1u << i : 0u;
+				}
+
+				const uint3 origin{ make_uint3(bx << _BLOCK_SHIFT, by << _BLOCK_SHIFT, bz << _BLOCK_SHIFT) };
+				occupied_min = min(occupied_min, origin + make_uint3(lowestBit(x_bits), lowestBit(y_bits), lowestBit(z_bits)));
+				occupied_max = max(occupied_max, origin + make_uint3(highestBit(x_bits), highestBit(y_bits), highestBit(z_bits)));
+				is_empty = false;
+			}
+		}
+	}
+
+	if (is_empty)
+	{
+		setOccupiedBounds(make_uint3(0), make_uint3(0));
+	}
+	else
+	{
+		setOccupiedBounds(occupied_min, occupied_max - occupied_min + 1);
+	}
+
+	_is_occupied_bounds_dirty = false;
+}
+
+
+// Build each mip from the level below it. A cell becomes solid when a majority of the cells it covers are,
+//  and takes the voxel most of them hold, so thin detail fades out instead of growing into blobs.
+void Cube::buildMips()
+{
+	if (_mips_version == _voxels_version)
+	{
+		return;
+	}
+
+	_mips_version = _voxels_version;
+	_mips.clear();
+
+	uint3 source_size{ _size };
+
+	for (uint level = 1; level <= _MIP_LEVELS; ++level)
+	{
+		// Nothing left to merge.
+		if (source_size.x == 1 && source_size.y == 1 && source_size.z == 1)
+		{
+			break;
+		}
+
+		MipLevel mip;
+		mip._size = make_uint3((source_size.x + 1) / 2, (source_size.y + 1) / 2, (source_size.z + 1) / 2);
+		mip._voxels.assign(static_cast<size_t>(mip._size.x) * mip._size.y * mip._size.z, 0);
+
+		// Level 1 reads the voxel grid, higher levels read the mip below. Cells past the source's edge are air.
+		const MipLevel* source{ level > 1 ? &_mips.back() : nullptr };
+		auto getSource = [this, source, &source_size](const uint x, const uint y, const uint z) -> PaletteIndex
+		{
+			if (x >= source_size.x || y >= source_size.y || z >= source_size.z)
+			{
+				return 0;
+			}
+
+			return source ? source->_voxels[x + y * source_size.x + z * source_size.x * source_size.y] : _voxels[getVoxelIndex(x, y, z)];
+		};
+
+		for (uint z = 0; z < mip._size.z; ++z)
+		{
+			for (uint y = 0; y < mip._size.y; ++y)
+			{
+				for (uint x = 0; x < mip._size.x; ++x)
+				{
+					PaletteIndex children[8];
+					uint solid_count{ 0 };
+
+					for (uint i = 0; i < 8; ++i)
+					{
+						if (const PaletteIndex child{ getSource(x * 2 + (i & 1), y * 2 + ((i >> 1) & 1), z * 2 + (i >> 2)) })
+						{
+							children[solid_count++] = child;
+						}
+					}
+
+					if (solid_count < _MIP_MAJORITY)
+					{
+						continue;
+					}
+
+					// Most common voxel. The earliest one wins a tie.
+					PaletteIndex voxel{ children[0] };
+					uint best_count{ 0 };
+					for (uint i = 0; i < solid_count; ++i)
+					{
+						const uint count{ static_cast<uint>(std::count(children, children + solid_count, children[i])) };
+						if (count > best_count)
+						{
+							best_count = count;
+							voxel = children[i];
+						}
+					}
+
+					mip._voxels[x + y * mip._size.x + z * mip._size.x * mip._size.y] = voxel;
+				}
+			}
+		}
+
+		source_size = mip._size;
+		_mips.push_back(std::move(mip));
+	}
+}
+
+
+// Grow the occupied bounds around a new solid voxel right away, so traversal never misses it.
+// A removed voxel only marks the bounds dirty. Loose bounds are still correct, they just skip less.
+void Cube::updateOccupiedBounds(const uint x, const uint y, const uint z, const uint old_voxel, const uint new_voxel)
+{
+	if (old_voxel && !new_voxel)
+	{
+		_is_occupied_bounds_dirty = true;
+		return;
+	}
+
+	if (old_voxel || !new_voxel)
+	{
+		return;
+	}
+
+	const uint3 position{ make_uint3(x, y, z) };
+
+	if (!_occupied_size.x)
+	{
+		setOccupiedBounds(position, make_uint3(1));
+		return;
+	}
+
+	const uint3 occupied_min{ min(_occupied_min, position) };
+	const uint3 occupied_max{ max(_occupied_min + _occupied_size, position + 1) };
+
+	setOccupiedBounds(occupied_min, occupied_max - occupied_min);
+}
+
+
+void Cube::setOccupiedBounds(const uint3& occupied_min, const uint3& occupied_size)
+{
+	_occupied_min = occupied_min;
+	_occupied_size = occupied_size;
+
+	_bounds[0] = make_float3(_occupied_min) * VOXELSIZE;
+	_bounds[1] = make_float3(_occupied_min + _occupied_size) * VOXELSIZE;
+}
+
+
+// Keep the solid voxel count of the brick holding (x, y, z) in sync with a voxel change.
+void Cube::updateBrick(const uint x, const uint y, const uint z, const uint old_voxel, const uint new_voxel)
+{
+	uint& brick{ _bricks[(x >> _BRICK_SHIFT) + (y >> _BRICK_SHIFT) * _brick_pitch + (z >> _BRICK_SHIFT) * _brick_slice] };
+
+	if (!old_voxel && new_voxel)
+	{
+		++brick;
+	}
+	else if (old_voxel && !new_voxel)
+	{
+		--brick;
+	}
+}
+
+
+// Keep the occupancy bit of (x, y, z) in sync with a voxel change.
+void Cube::updateOccupancy(const uint x, const uint y, const uint z, const uint new_voxel)
+{
+	uint64_t& block{ _occupancy[(x >> _BLOCK_SHIFT) + (y >> _BLOCK_SHIFT) * _block_pitch + (z >> _BLOCK_SHIFT) * _block_slice] };
+	const uint64_t bit{ 1ull << ((x & 3) | ((y & 3) << 2) | ((z & 3) << 4)) };
+
+	if (new_voxel)
+	{
+		block |= bit;
+	}
+	else
+	{
+		block &= ~bit;
+	}
 }
 
 
 // Use to find intersection of a ray with the cube, only for rays that originate OUTSIDE the cube.
 float Cube::intersect(const Ray& ray) const
+{
+	return intersectBounds(ray, _bounds);
+}
+
+
+// Test if position is inside the cube.
+bool Cube::contains(const float3& position) const
+{
+	return containsPoint(_bounds, position);
+}
+
+
+float Cube::intersectBounds(const Ray& ray, const float3 bounds[2])
 {	
 	const int sign_x = ray.rD.x < 0;
 	const int sign_y = ray.rD.y < 0;
 	const int sign_z = ray.rD.z < 0;
 
-	float t_min = (_bounds[sign_x].x - ray.O.x) * ray.rD.x;
-	float t_max = (_bounds[1 - sign_x].x - ray.O.x) * ray.rD.x;
+	float t_min = (bounds[sign_x].x - ray.O.x) * ray.rD.x;
+	float t_max = (bounds[1 - sign_x].x - ray.O.x) * ray.rD.x;
 
-	const float ty_min = (_bounds[sign_y].y - ray.O.y) * ray.rD.y;
-	const float ty_max = (_bounds[1 - sign_y].y - ray.O.y) * ray.rD.y;
+	const float ty_min = (bounds[sign_y].y - ray.O.y) * ray.rD.y;
+	const float ty_max = (bounds[1 - sign_y].y - ray.O.y) * ray.rD.y;
 
 	if (t_min > ty_max || ty_min > t_max)
 	{
@@ -57,8 +544,8 @@ float Cube::intersect(const Ray& ray) const
 
 	t_min = max(t_min, ty_min), t_max = min(t_max, ty_max);
 	
-	const float tz_min = (_bounds[sign_z].z - ray.O.z) * ray.rD.z;
-	const float tz_max = (_bounds[1 - sign_z].z - ray.O.z) * ray.rD.z;
+	const float tz_min = (bounds[sign_z].z - ray.O.z) * ray.rD.z;
+	const float tz_max = (bounds[1 - sign_z].z - ray.O.z) * ray.rD.z;
 	
 	if (t_min > tz_max || tz_min > t_max)
 	{
@@ -76,21 +563,32 @@ float Cube::intersect(const Ray& ray) const
 }
 
 
-// Test if position is inside the cube.
-bool Cube::contains(const float3& position) const
+bool Cube::containsPoint(const float3 bounds[2], const float3& position)
 {
-	return position.x >= _bounds[0].x && position.y >= _bounds[0].y && position.z >= _bounds[0].z 
-		&& position.x <= _bounds[1].x && position.y <= _bounds[1].y && position.z <= _bounds[1].z;
+	return position.x >= bounds[0].x && position.y >= bounds[0].y && position.z >= bounds[0].z 
+		&& position.x <= bounds[1].x && position.y <= bounds[1].y && position.z <= bounds[1].z;
 }
 
 
 bool Cube::setup3DDDA(const Ray& ray, DDAState& state) const
+{
+	return setupDDA(ray, state, _bounds, _occupied_min, _occupied_size);
+}
+
+
+bool Cube::setupDDA(const Ray& ray, DDAState& state, const float3 bounds[2], const uint3& occupied_min, const uint3& occupied_size)
 {
 	state.t = 0;
 
-	if (!contains(ray.O))
+	// Nothing to hit in an empty grid.
+	if (!occupied_size.x)
+	{
+		return false;
+	}
+
+	if (!containsPoint(bounds, ray.O))
 	{
-		state.t = intersect(ray);
+		state.t = intersectBounds(ray, bounds);
 
 		if (state.t >= Ray::t_max)
 		{
@@ -104,7 +602,7 @@ bool Cube::setup3DDDA(const Ray& ray, DDAState& state) const
 	const float3 position_in_grid = WORLDSIZE * (ray.O + (state.t + Ray::_epsilon_offset) * normalize(ray.D));
 
 	// Use this "real" position to find which cell the ray is starting in.
-	const int3 P = clamp(make_int3(position_in_grid), 0, make_int3(_size) - 1);
+	const int3 P = clamp(make_int3(position_in_grid), make_int3(occupied_min), make_int3(occupied_min + occupied_size) - 1);
 
 	state.X = P.x;
 	state.Y = P.y;
@@ -122,7 +620,8 @@ bool Cube::setup3DDDA(const Ray& ray, DDAState& state) const
 	// Increment tmax by tdelta after advancing.
 	// First (in case where the ray is starting inside a cell), find distance to start of cell
 	//  and initialize tmax with that offset from the cell boundary.
-	const float3 distance_from_boundary = (ceilf(position_in_grid) - ray.Dsign) * VOXELSIZE;
+	// Measured from the clamped cell, so a ray entering on a face it only just reached still leaves that cell at the right time.
+	const float3 distance_from_boundary = (make_float3(P) + 1.0f - ray.Dsign) * VOXELSIZE;
 	state.tmax = (distance_from_boundary - ray.O) * ray.rD;
 
 	// Begin traversal.
@@ -130,82 +629,472 @@ bool Cube::setup3DDDA(const Ray& ray, DDAState& state) const
 }
 
 
-void Cube::findNearest(Ray& ray) const
-{
-	// Setup Amanatides & Woo grid traversal
-	DDAState s;
-	if (!setup3DDDA(ray, s))
+bool Cube::stepDDA(DDAState& s) const
+{
+	return stepDDA(s, _occupied_min, _occupied_size);
+}
+
+
+// Advance the ray into the next cell. Returns false once the ray has left the occupied bounds.
+bool Cube::stepDDA(DDAState& s, const uint3& occupied_min, const uint3& occupied_size)
+{
+	if (s.tmax.x < s.tmax.y)
+	{
+		if (s.tmax.x < s.tmax.z)
+		{
+			s.t = s.tmax.x, s.X += s.step.x;
+
+			if (s.X - occupied_min.x >= occupied_size.x)
+			{
+				return false;
+			}
+
+			s.tmax.x += s.tdelta.x;
+		}
+		else
+		{
+			s.t = s.tmax.z, s.Z += s.step.z;
+
+			if (s.Z - occupied_min.z >= occupied_size.z)
+			{
+				return false;
+			}
+
+			s.tmax.z += s.tdelta.z;
+		}
+	}
+	else
+	{
+		if (s.tmax.y < s.tmax.z)
+		{
+			s.t = s.tmax.y, s.Y += s.step.y;
+
+			if (s.Y - occupied_min.y >= occupied_size.y)
+			{
+				return false;
+			}
+
+			s.tmax.y += s.tdelta.y;
+		}
+		else
+		{
+			s.t = s.tmax.z, s.Z += s.step.z;
+
+			if (s.Z - occupied_min.z >= occupied_size.z)
+			{
+				return false;
+			}
+
+			s.tmax.z += s.tdelta.z;
+		}
+	}
+
+	return true;
+}
+
+
+// Move the ray straight to the first cell outside of an empty box of cells (inclusive min/max).
+// Every axis advances by the number of cell boundaries it crosses before the ray leaves the box,
+//  so the state is identical to what cell-by-cell stepping would have produced.
+// Returns false once the ray has left the occupied bounds.
+bool Cube::skipEmptyRegion(DDAState& s, const uint3& region_min, const uint3& region_max) const
+{
+	return skipRegion(s, region_min, region_max, _occupied_min, _occupied_size);
+}
+
+
+bool Cube::skipRegion(DDAState& s, const uint3& region_min, const uint3& region_max, const uint3& occupied_box_min, const uint3& occupied_box_size)
+{
+	uint position[3]{ s.X, s.Y, s.Z };
+	const uint occupied_min[3]{ occupied_box_min.x, occupied_box_min.y, occupied_box_min.z };
+	const uint occupied_size[3]{ occupied_box_size.x, occupied_box_size.y, occupied_box_size.z };
+	const int step[3]{ s.step.x, s.step.y, s.step.z };
+	const uint lower[3]{ region_min.x, region_min.y, region_min.z };
+	const uint upper[3]{ region_max.x, region_max.y, region_max.z };
+	float tmax[3]{ s.tmax.x, s.tmax.y, s.tmax.z };
+	const float tdelta[3]{ s.tdelta.x, s.tdelta.y, s.tdelta.z };
+
+	// Find the axis through which the ray leaves the box, and when.
+	uint cells_left[3];
+	int exit_axis{ 0 };
+	float t_exit{ Ray::t_max };
+
+	for (int a = 0; a < 3; ++a)
+	{
+		cells_left[a] = step[a] > 0 ? upper[a] - position[a] : position[a] - lower[a];
+
+		// Avoid 0 * inf when the ray runs parallel to this axis.
+		const float t_leave{ cells_left[a] ? tmax[a] + static_cast<float>(cells_left[a]) * tdelta[a] : tmax[a] };
+
+		if (t_leave < t_exit)
+		{
+			t_exit = t_leave;
+			exit_axis = a;
+		}
+	}
+
+	// Advance each axis by the boundaries crossed before t_exit. The exit axis crosses out of the box.
+	// Boundaries within rounding distance of t_exit stay uncrossed: cell-by-cell stepping sums tmax differently,
+	//  and a corner the ray only grazes is better visited than skipped.
+	const float t_cross{ t_exit - t_exit * 1e-5f };
+
+	for (int a = 0; a < 3; ++a)
+	{
+		uint crossings{ 0 };
+
+		if (a == exit_axis)
+		{
+			crossings = cells_left[a] + 1;
+		}
+		else if (t_cross > tmax[a])
+		{
+			crossings = min(cells_left[a], static_cast<uint>(ceilf((t_cross - tmax[a]) / tdelta[a])));
+		}
+
+		if (crossings)
+		{
+			position[a] += step[a] * static_cast<int>(crossings);
+			tmax[a] += static_cast<float>(crossings) * tdelta[a];
+		}
+	}
+
+	s.t = t_exit;
+	s.X = position[0], s.Y = position[1], s.Z = position[2];
+	s.tmax = float3{ tmax[0], tmax[1], tmax[2] };
+
+	return position[exit_axis] - occupied_min[exit_axis] < occupied_size[exit_axis];
+}
+
+
+// Step over the whole brick the ray is currently in.
+bool Cube::skipEmptyBrick(DDAState& s) const
+{
+	const uint3 brick_min{ make_uint3(
+		(s.X >> _BRICK_SHIFT) << _BRICK_SHIFT,
+		(s.Y >> _BRICK_SHIFT) << _BRICK_SHIFT,
+		(s.Z >> _BRICK_SHIFT) << _BRICK_SHIFT
+	) };
+	
+	const uint3 brick_max{ make_uint3(
+		min(brick_min.x + _BRICK_SIZE, _size.x) - 1,
+		min(brick_min.y + _BRICK_SIZE, _size.y) - 1,
+		min(brick_min.z + _BRICK_SIZE, _size.z) - 1
+	) };
+
+	return skipEmptyRegion(s, brick_min, brick_max);
+}
+
+
+// Step over the whole 4x4x4 block the ray is currently in.
+bool Cube::skipEmptyBlock(DDAState& s) const
+{
+	const uint3 block_min{ make_uint3(
+		(s.X >> _BLOCK_SHIFT) << _BLOCK_SHIFT,
+		(s.Y >> _BLOCK_SHIFT) << _BLOCK_SHIFT,
+		(s.Z >> _BLOCK_SHIFT) << _BLOCK_SHIFT
+	) };
+
+	const uint3 block_max{ make_uint3(
+		min(block_min.x + _BLOCK_SIZE, _size.x) - 1,
+		min(block_min.y + _BLOCK_SIZE, _size.y) - 1,
+		min(block_min.z + _BLOCK_SIZE, _size.z) - 1
+	) };
+
+	return skipEmptyRegion(s, block_min, block_max);
+}
+
+
+// Every voxel closer than the distance to the nearest solid voxel is air, so step over that whole box.
+bool Cube::skipByDistance(DDAState& s, const uint distance) const
+{
+	const uint radius{ distance - 1 };
+
+	const uint3 region_min{ make_uint3(
+		s.X > radius ? s.X - radius : 0,
+		s.Y > radius ? s.Y - radius : 0,
+		s.Z > radius ? s.Z - radius : 0
+	) };
+
+	const uint3 region_max{ make_uint3(
+		min(s.X + radius, _size.x - 1),
+		min(s.Y + radius, _size.y - 1),
+		min(s.Z + radius, _size.z - 1)
+	) };
+
+	return skipEmptyRegion(s, region_min, region_max);
+}
+
+
+bool Cube::isBrickOccupied(const DDAState& s) const
+{
+	return _bricks[(s.X >> _BRICK_SHIFT) + (s.Y >> _BRICK_SHIFT) * _brick_pitch + (s.Z >> _BRICK_SHIFT) * _brick_slice] != 0;
+}
+
+
+uint64_t Cube::getBlock(const DDAState& s) const
+{
+	return _occupancy[(s.X >> _BLOCK_SHIFT) + (s.Y >> _BLOCK_SHIFT) * _block_pitch + (s.Z >> _BLOCK_SHIFT) * _block_slice];
+}
+
+
+bool Cube::isVoxelOccupied(const DDAState& s, const uint64_t block) const
+{
+	return (block >> ((s.X & 3) | ((s.Y & 3) << 2) | ((s.Z & 3) << 4))) & 1ull;
+}
+
+
+void Cube::findNearest(Ray& ray) const
+{
+	// Setup Amanatides & Woo grid traversal
+	DDAState s;
+	if (!setup3DDDA(ray, s))
+	{
+		return;
+	}
+
+	// Distant cubes can be traced at a coarser mip. A voxel right where the ray enters is an exact hit that needs no mip.
+	if (const uint level{ selectMip(ray, s.t) }; level && !isVoxelOccupied(s, getBlock(s)))
+	{
+		findNearestInMip(ray, s, level);
+		return;
+	}
+
+	// Start stepping.
+	while (s.t <= ray.t)
+	{
+		// Air-only bricks are crossed in a single step.
+		if (!isBrickOccupied(s))
+		{
+			if (!skipEmptyBrick(s))
+			{
+				break;
+			}
+
+			continue;
+		}
+
+		// Same for air-only 4x4x4 blocks, tested with a single word compare.
+		const uint64_t block{ getBlock(s) };
+		if (!block)
+		{
+			if (!skipEmptyBlock(s))
+			{
+				break;
+			}
+
+			continue;
+		}
+
+		// The full voxel is only read on a hit.
+		if (isVoxelOccupied(s, block))
+		{
+			if (s.t < ray.t)
+			{
+				ray.t = s.t;
+				ray._hit_data = _palette[_voxels[getVoxelIndex(s.X, s.Y, s.Z)]];
+				ray._id = _id;
+				ray.normal = ray.GetNormal(_size);
+			}
+			break;
+		}
+
+		// Far from any solid voxel, jump over the surrounding air.
+		const uint index{ s.X + s.Y * _pitch + s.Z * _slice };
+		if (_distance_field && _distance_field[index] > 1)
+		{
+			if (!skipByDistance(s, _distance_field[index]))
+			{
+				break;
+			}
+
+			continue;
+		}
+
+		if (!stepDDA(s))
+		{
+			break;
+		}
+	}
+}
+
+
+// Packet version of findNearest. Four coherent rays step through the grid together in SSE lanes.
+// Empty space skipping and hit tests run per lane, the DDA step itself runs for all lanes at once.
+void Cube::findNearest4(Ray* rays) const
+{
+	// Traversal state in SoA layout, so a single lane can still be handed to the scalar skip methods.
+	alignas(16) int X[4], Y[4], Z[4];
+	alignas(16) int step_x[4], step_y[4], step_z[4];
+	alignas(16) float t[4];
+	alignas(16) float tmax_x[4], tmax_y[4], tmax_z[4];
+	alignas(16) float tdelta_x[4], tdelta_y[4], tdelta_z[4];
+
+	auto loadLane = [&](const int i)
+	{
+		DDAState s;
+		s.X = X[i], s.Y = Y[i], s.Z = Z[i];
+		s.step = int3{ step_x[i], step_y[i], step_z[i] };
+		s.t = t[i];
+		s.tmax = float3{ tmax_x[i], tmax_y[i], tmax_z[i] };
+		s.tdelta = float3{ tdelta_x[i], tdelta_y[i], tdelta_z[i] };
+
+		return s;
+	};
+
+	auto storeLane = [&](const int i, const DDAState& s)
+	{
+		X[i] = s.X, Y[i] = s.Y, Z[i] = s.Z;
+		step_x[i] = s.step.x, step_y[i] = s.step.y, step_z[i] = s.step.z;
+		t[i] = s.t;
+		tmax_x[i] = s.tmax.x, tmax_y[i] = s.tmax.y, tmax_z[i] = s.tmax.z;
+		tdelta_x[i] = s.tdelta.x, tdelta_y[i] = s.tdelta.y, tdelta_z[i] = s.tdelta.z;
+	};
+
+	auto select = [](const __m128 mask, const __m128 a, const __m128 b)
+	{
+		return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+	};
+
+	// Lanes still traversing, one bit per ray.
+	int active{ 0 };
+
+	// Setup Amanatides & Woo grid traversal per ray. Missed lanes get dummy state and stay inactive.
+	for (int i = 0; i < 4; ++i)
 	{
-		return;
+		DDAState s;
+		if (setup3DDDA(rays[i], s))
+		{
+			active |= 1 << i;
+		}
+
+		storeLane(i, s);
 	}
 
-	// Start stepping.
-	while (s.t <= ray.t)
+	const __m128i lane_bits{ _mm_setr_epi32(1, 2, 4, 8) };
+	const __m128i first_x{ _mm_set1_epi32(static_cast<int>(_occupied_min.x)) };
+	const __m128i first_y{ _mm_set1_epi32(static_cast<int>(_occupied_min.y)) };
+	const __m128i first_z{ _mm_set1_epi32(static_cast<int>(_occupied_min.z)) };
+	const __m128i last_x{ _mm_set1_epi32(static_cast<int>(_occupied_min.x + _occupied_size.x) - 1) };
+	const __m128i last_y{ _mm_set1_epi32(static_cast<int>(_occupied_min.y + _occupied_size.y) - 1) };
+	const __m128i last_z{ _mm_set1_epi32(static_cast<int>(_occupied_min.z + _occupied_size.z) - 1) };
+
+	while (active)
 	{
-		const uint cell = _voxels[s.X + s.Y * _pitch + s.Z * _slice];
+		// Lanes that take a regular DDA step this iteration.
+		int stepping{ active };
 
-		if (cell)
+		for (int i = 0; i < 4; ++i)
 		{
-			if (s.t < ray.t)
+			const int lane{ 1 << i };
+			if (!(active & lane))
 			{
-				ray.t = s.t;
-				ray._hit_data = cell;
-				ray._id = _id;
-				ray.normal = ray.GetNormal(_size);
+				continue;
 			}
-			break;
-		}
 
-		if (s.tmax.x < s.tmax.y)
-		{
-			if (s.tmax.x < s.tmax.z)
+			Ray& ray{ rays[i] };
+			DDAState s{ loadLane(i) };
+
+			if (s.t > ray.t)
 			{
-				s.t = s.tmax.x, s.X += s.step.x;
+				active &= ~lane, stepping &= ~lane;
+				continue;
+			}
 
-				if (s.X >= _size.x)
-				{
-					break;
-				}
+			// Same order of tests as findNearest.
+			bool is_inside{ true };
+			const uint64_t block{ getBlock(s) };
 
-				s.tmax.x += s.tdelta.x;
+			if (!isBrickOccupied(s))
+			{
+				is_inside = skipEmptyBrick(s);
 			}
-			else
+			else if (!block)
 			{
-				s.t = s.tmax.z, s.Z += s.step.z;
-
-				if (s.Z >= _size.z)
-				{
-					break;
-				}
-
-				s.tmax.z += s.tdelta.z;
+				is_inside = skipEmptyBlock(s);
 			}
-		}
-		else
-		{
-			if (s.tmax.y < s.tmax.z)
+			else if (isVoxelOccupied(s, block))
 			{
-				s.t = s.tmax.y, s.Y += s.step.y;
-
-				if (s.Y >= _size.y)
+				if (s.t < ray.t)
 				{
-					break;
+					ray.t = s.t;
+					ray._hit_data = _palette[_voxels[getVoxelIndex(s.X, s.Y, s.Z)]];
+					ray._id = _id;
+					ray.normal = ray.GetNormal(_size);
 				}
 
-				s.tmax.y += s.tdelta.y;
+				is_inside = false;
+			}
+			else if (const uint index{ s.X + s.Y * _pitch + s.Z * _slice }; _distance_field && _distance_field[index] > 1)
+			{
+				is_inside = skipByDistance(s, _distance_field[index]);
 			}
 			else
 			{
-				s.t = s.tmax.z, s.Z += s.step.z;
+				continue;
+			}
 
-				if (s.Z >= _size.z)
-				{
-					break;
-				}
+			// The lane has been skipped ahead or has finished, so it sits out the step.
+			stepping &= ~lane;
 
-				s.tmax.z += s.tdelta.z;
+			if (is_inside)
+			{
+				storeLane(i, s);
+			}
+			else
+			{
+				active &= ~lane;
 			}
 		}
+
+		if (!stepping)
+		{
+			continue;
+		}
+
+		const __m128 lane_mask{ _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(stepping), lane_bits), lane_bits)) };
+
+		// Pick the axis with the smallest tmax, the same way stepDDA does.
+		const __m128 tx{ _mm_load_ps(tmax_x) };
+		const __m128 ty{ _mm_load_ps(tmax_y) };
+		const __m128 tz{ _mm_load_ps(tmax_z) };
+
+		const __m128 x_before_y{ _mm_cmplt_ps(tx, ty) };
+		const __m128 x_first{ _mm_and_ps(x_before_y, _mm_cmplt_ps(tx, tz)) };
+		const __m128 y_first{ _mm_andnot_ps(x_before_y, _mm_cmplt_ps(ty, tz)) };
+
+		const __m128 move_x{ _mm_and_ps(x_first, lane_mask) };
+		const __m128 move_y{ _mm_and_ps(y_first, lane_mask) };
+		const __m128 move_z{ _mm_andnot_ps(_mm_or_ps(x_first, y_first), lane_mask) };
+
+		// t becomes the tmax of the crossed axis.
+		__m128 t4{ _mm_load_ps(t) };
+		t4 = select(move_x, tx, t4);
+		t4 = select(move_y, ty, t4);
+		t4 = select(move_z, tz, t4);
+		_mm_store_ps(t, t4);
+
+		_mm_store_ps(tmax_x, _mm_add_ps(tx, _mm_and_ps(move_x, _mm_load_ps(tdelta_x))));
+		_mm_store_ps(tmax_y, _mm_add_ps(ty, _mm_and_ps(move_y, _mm_load_ps(tdelta_y))));
+		_mm_store_ps(tmax_z, _mm_add_ps(tz, _mm_and_ps(move_z, _mm_load_ps(tdelta_z))));
+
+		const __m128i x4{ _mm_add_epi32(_mm_load_si128(reinterpret_cast<const __m128i*>(X)), _mm_and_si128(_mm_castps_si128(move_x), _mm_load_si128(reinterpret_cast<const __m128i*>(step_x)))) };
+		const __m128i y4{ _mm_add_epi32(_mm_load_si128(reinterpret_cast<const __m128i*>(Y)), _mm_and_si128(_mm_castps_si128(move_y), _mm_load_si128(reinterpret_cast<const __m128i*>(step_y)))) };
+		const __m128i z4{ _mm_add_epi32(_mm_load_si128(reinterpret_cast<const __m128i*>(Z)), _mm_and_si128(_mm_castps_si128(move_z), _mm_load_si128(reinterpret_cast<const __m128i*>(step_z)))) };
+
+		_mm_store_si128(reinterpret_cast<__m128i*>(X), x4);
+		_mm_store_si128(reinterpret_cast<__m128i*>(Y), y4);
+		_mm_store_si128(reinterpret_cast<__m128i*>(Z), z4);
+
+		// Retire lanes that left the occupied bounds.
+		const __m128i outside{ _mm_or_si128(
+			_mm_or_si128(
+				_mm_or_si128(_mm_cmplt_epi32(x4, first_x), _mm_cmpgt_epi32(x4, last_x)),
+				_mm_or_si128(_mm_cmplt_epi32(y4, first_y), _mm_cmpgt_epi32(y4, last_y))
+			),
+			_mm_or_si128(_mm_cmplt_epi32(z4, first_z), _mm_cmpgt_epi32(z4, last_z))
+		) };
+
+		active &= ~_mm_movemask_ps(_mm_castsi128_ps(outside));
 	}
 }
 
@@ -219,14 +1108,57 @@ bool Cube::findOcclusion(const Ray& ray, TintData& tint_data) const
 		return false;
 	}
 
+	// Distant cubes can be traced at a coarser mip. A voxel right where the ray enters is an exact hit that needs no mip.
+	if (const uint level{ selectMip(ray, s.t) }; level && !isVoxelOccupied(s, getBlock(s)))
+	{
+		return findOcclusionInMip(ray, tint_data, s, level);
+	}
+
 	// Start stepping
 	while (s.t < ray.t)
 	{
-		const uint cell = _voxels[s.X + s.Y * _pitch + s.Z * _slice];
+		// Air-only bricks are crossed in a single step.
+		if (!isBrickOccupied(s))
+		{
+			if (!skipEmptyBrick(s))
+			{
+				break;
+			}
+
+			continue;
+		}
+
+		// Same for air-only 4x4x4 blocks, tested with a single word compare.
+		const uint64_t block{ getBlock(s) };
+		if (!block)
+		{
+			if (!skipEmptyBlock(s))
+			{
+				break;
+			}
 
-		// Air and glass do not occlude.		
+			continue;
+		}
+
+		if (!isVoxelOccupied(s, block))
+		{
+			// Far from any solid voxel (glass included), jump over the surrounding air.
+			const uint index{ s.X + s.Y * _pitch + s.Z * _slice };
+			if (_distance_field && _distance_field[index] > 1)
+			{
+				if (!skipByDistance(s, _distance_field[index]))
+				{
+					break;
+				}
+
+				continue;
+			}
+		}
+		else
 		{
-			// Glass tints the incoming light.
+			const uint cell = _palette[_voxels[getVoxelIndex(s.X, s.Y, s.Z)]];
+
+			// Glass does not occlude, but it tints the incoming light.
 			bool is_cell_glass{ MaterialList::GetType(cell) == MaterialType::GLASS };
 			if (is_cell_glass)
 			{
@@ -242,62 +1174,137 @@ bool Cube::findOcclusion(const Ray& ray, TintData& tint_data) const
 				}
 			}
 
-			if (!is_cell_glass && cell)
+			if (!is_cell_glass)
 			{
 				return s.t < ray.t;
 			}
 		}
 
-		if (s.tmax.x < s.tmax.y)
+		if (!stepDDA(s))
 		{
-			if (s.tmax.x < s.tmax.z)
-			{
-				s.t = s.tmax.x, s.X += s.step.x;
+			break;
+		}
+	}
 
-				if (s.X >= _size.x)
-				{
-					break;
-				}
+	return false;
+}
 
-				s.tmax.x += s.tdelta.x;
-			}
-			else
-			{
-				s.t = s.tmax.z, s.Z += s.step.z;
 
-				if (s.Z >= _size.z)
-				{
-					break;
-				}
+// Rays that enter the cube at least their LOD distance away trace mip 1, and every doubling of that distance goes one mip coarser.
+// Rays that start inside the cube (t_enter of 0) always trace full resolution, so they cannot get stuck in a coarse cell around their origin.
+uint Cube::selectMip(const Ray& ray, const float t_enter) const
+{
+	if (ray._lod_distance <= 0.0f || t_enter < ray._lod_distance || _mips.empty())
+	{
+		return 0;
+	}
+
+	uint level{ 1 };
+	for (float distance = ray._lod_distance * 2.0f; level < _mips.size() && t_enter >= distance; distance *= 2.0f)
+	{
+		++level;
+	}
+
+	return level;
+}
+
+
+// Continue a traversal that has just entered the grid in the mip holding its cell.
+// Each axis keeps its next boundary if that is also a mip cell boundary, and otherwise moves on to the next one that is.
+void Cube::setupMipDDA(const DDAState& s, DDAState& m, const uint level) const
+{
+	const uint position[3]{ s.X, s.Y, s.Z };
+	const int step[3]{ s.step.x, s.step.y, s.step.z };
+	const float tmax[3]{ s.tmax.x, s.tmax.y, s.tmax.z };
+	const float tdelta[3]{ s.tdelta.x, s.tdelta.y, s.tdelta.z };
+	uint mip_position[3];
+	float mip_tmax[3];
+
+	for (int a = 0; a < 3; ++a)
+	{
+		mip_position[a] = position[a] >> level;
+
+		const uint first_voxel{ mip_position[a] << level };
+		const uint crossings{ step[a] > 0 ? first_voxel + (1u << level) - 1 - position[a] : position[a] - first_voxel };
+
+		// Avoid 0 * inf when the ray runs parallel to this axis.
+		mip_tmax[a] = crossings ? tmax[a] + static_cast<float>(crossings) * tdelta[a] : tmax[a];
+	}
+
+	m = s;
+	m.X = mip_position[0], m.Y = mip_position[1], m.Z = mip_position[2];
+	m.tmax = float3{ mip_tmax[0], mip_tmax[1], mip_tmax[2] };
+	m.tdelta = s.tdelta * static_cast<float>(1u << level);
+}
+
+
+void Cube::findNearestInMip(Ray& ray, const DDAState& state, const uint level) const
+{
+	const MipLevel& mip{ _mips[level - 1] };
+	const uint pitch{ mip._size.x };
+	const uint slice{ mip._size.x * mip._size.y };
+
+	DDAState s;
+	setupMipDDA(state, s, level);
+
+	// Cells outside the occupied bounds are mostly air at this size, so the whole mip grid bounds the traversal.
+	while (s.t <= ray.t)
+	{
+		if (const PaletteIndex voxel{ mip._voxels[s.X + s.Y * pitch + s.Z * slice] })
+		{
+			if (s.t < ray.t)
+			{
+				ray.t = s.t;
+				ray._hit_data = _palette[voxel];
+				ray._id = _id;
 
-				s.tmax.z += s.tdelta.z;
+				// Mip cell faces are voxel faces as well.
+				ray.normal = ray.GetNormal(_size);
 			}
+			break;
 		}
-		else
+
+		if (!stepDDA(s, make_uint3(0), mip._size))
 		{
-			if (s.tmax.y < s.tmax.z)
-			{
-				s.t = s.tmax.y, s.Y += s.step.y;
+			break;
+		}
+	}
+}
 
-				if (s.Y >= _size.y)
-				{
-					break;
-				}
 
-				s.tmax.y += s.tdelta.y;
-			}
-			else
+bool Cube::findOcclusionInMip(const Ray& ray, TintData& tint_data, const DDAState& state, const uint level) const
+{
+	const MipLevel& mip{ _mips[level - 1] };
+	const uint pitch{ mip._size.x };
+	const uint slice{ mip._size.x * mip._size.y };
+
+	DDAState s;
+	setupMipDDA(state, s, level);
+
+	while (s.t < ray.t)
+	{
+		if (const PaletteIndex voxel{ mip._voxels[s.X + s.Y * pitch + s.Z * slice] })
+		{
+			const uint cell{ _palette[voxel] };
+
+			if (MaterialList::GetType(cell) != MaterialType::GLASS)
 			{
-				s.t = s.tmax.z, s.Z += s.step.z;
+				return true;
+			}
 
-				if (s.Z >= _size.z)
-				{
-					break;
-				}
+			// A glass cell stands in for 2^level voxels along the ray, see findOcclusion() for the approximation.
+			tint_data._distance += static_cast<float>(1u << level);
 
-				s.tmax.z += s.tdelta.z;
+			if (!tint_data._voxel)
+			{
+				tint_data._voxel = cell;
 			}
 		}
+
+		if (!stepDDA(s, make_uint3(0), mip._size))
+		{
+			break;
+		}
 	}
 
 	return false;
@@ -313,7 +1320,8 @@ void Cube::findMaterialExit(Ray& ray, const uint material_type) const
 	// Start stepping.
 	while (true)
 	{
-		const uint cell = _voxels[s.X + s.Y * _pitch + s.Z * _slice];
+		// An empty occupancy bit means the ray has reached air, so its voxel does not need to be read.
+		const uint cell = isVoxelOccupied(s, getBlock(s)) ? _palette[_voxels[getVoxelIndex(s.X, s.Y, s.Z)]] : 0;
 
 		if (MaterialList::GetType(cell) != material_type)
 		{
@@ -324,55 +1332,9 @@ void Cube::findMaterialExit(Ray& ray, const uint material_type) const
 			return;
 		}
 
-		if (s.tmax.x < s.tmax.y)
-		{
-			if (s.tmax.x < s.tmax.z)
-			{
-				s.t = s.tmax.x, s.X += s.step.x;
-
-				if (s.X >= _size.x)
-				{
-					break;
-				}
-
-				s.tmax.x += s.tdelta.x;
-			}
-			else
-			{
-				s.t = s.tmax.z, s.Z += s.step.z;
-
-				if (s.Z >= _size.z)
-				{
-					break;
-				}
-
-				s.tmax.z += s.tdelta.z;
-			}
-		}
-		else
+		if (!stepDDA(s))
 		{
-			if (s.tmax.y < s.tmax.z)
-			{
-				s.t = s.tmax.y, s.Y += s.step.y;
-
-				if (s.Y >= _size.y)
-				{
-					break;
-				}
-
-				s.tmax.y += s.tdelta.y;
-			}
-			else
-			{
-				s.t = s.tmax.z, s.Z += s.step.z;
-
-				if (s.Z >= _size.z)
-				{
-					break;
-				}
-
-				s.tmax.z += s.tdelta.z;
-			}
+			break;
 		}
 	}
 
@@ -398,91 +1360,126 @@ bool Cube::eraseVoxels(Ray& ray)
 	// Start stepping.
 	while (s.t <= ray.t)
 	{
-		uint index = s.X + s.Y * _pitch + s.Z * _slice;
-		uint& cell = _voxels[index];
+		// Nothing to erase in air-only bricks.
+		if (!isBrickOccupied(s))
+		{
+			if (!skipEmptyBrick(s))
+			{
+				break;
+			}
+
+			continue;
+		}
 
-		if (cell)
+		if (isVoxelOccupied(s, getBlock(s)))
 		{
+			PaletteIndex& cell = _voxels[getVoxelIndex(s.X, s.Y, s.Z)];
+
 			// Return that this cube was modified.
 			was_killed = true;
 			
 			// Store the voxel location and data.
-			addToVoxelMemory(index, cell);
+			addToVoxelMemory(s.X, s.Y, s.Z, cell);
 
 			// Temporarily "erase" voxel (make air).
+			updateBrick(s.X, s.Y, s.Z, cell, 0);
+			updateOccupancy(s.X, s.Y, s.Z, 0);
+			updateDistanceField(s.X, s.Y, s.Z, cell, 0);
+			updateOccupiedBounds(s.X, s.Y, s.Z, cell, 0);
 			cell = 0;
+			++_voxels_version;
 		}
 
-		if (s.tmax.x < s.tmax.y)
+		if (!stepDDA(s))
 		{
-			if (s.tmax.x < s.tmax.z)
-			{
-				s.t = s.tmax.x, s.X += s.step.x;
+			break;
+		}
+	}
 
-				if (s.X >= _size.x)
-				{
-					break;
-				}
+	return was_killed;
+}
 
-				s.tmax.x += s.tdelta.x;
-			}
-			else
-			{
-				s.t = s.tmax.z, s.Z += s.step.z;
 
-				if (s.Z >= _size.z)
-				{
-					break;
-				}
+void Cube::addToVoxelMemory(uint x, uint y, uint z, PaletteIndex voxel)
+{
+	_voxel_memory[_memory_index++] = VoxelMemory{ x, y, z, voxel };
+}
 
-				s.tmax.z += s.tdelta.z;
-			}
-		}
-		else
-		{
-			if (s.tmax.y < s.tmax.z)
-			{
-				s.t = s.tmax.y, s.Y += s.step.y;
 
-				if (s.Y >= _size.y)
-				{
-					break;
-				}
+void Cube::restoreVoxelMemory()
+{
+	for (uint i = 0; i < _memory_index; ++i)
+	{
+		auto [x, y, z, voxel] = _voxel_memory[i];
+		PaletteIndex& cell{ _voxels[getVoxelIndex(x, y, z)] };
+
+		updateBrick(x, y, z, cell, voxel);
+		updateOccupancy(x, y, z, voxel);
+		updateDistanceField(x, y, z, cell, voxel);
+		updateOccupiedBounds(x, y, z, cell, voxel);
+		cell = voxel;
+	}
 
-				s.tmax.y += s.tdelta.y;
-			}
-			else
-			{
-				s.t = s.tmax.z, s.Z += s.step.z;
+	_voxels_version += _memory_index;
+	_memory_index = 0;
+}
 
-				if (s.Z >= _size.z)
-				{
-					break;
-				}
 
-				s.tmax.z += s.tdelta.z;
-			}
+// Count the distinct cache lines a ray reads from the voxel grid under both layouts.
+// Steps cell by cell until the first solid voxel, like findNearest without any empty space skipping.
+void Cube::measureCacheLines(const Ray& ray, uint& linear_lines, uint& tiled_lines) const
+{
+	linear_lines = 0;
+	tiled_lines = 0;
+
+	DDAState s;
+	if (!setup3DDDA(ray, s))
+	{
+		return;
+	}
+
+	constexpr uint voxels_per_line{ 64 / sizeof(PaletteIndex) };
+
+	std::vector<uint> linear;
+	std::vector<uint> tiled;
+
+	while (s.t <= ray.t)
+	{
+		linear.push_back(getLinearIndex(s.X, s.Y, s.Z) / voxels_per_line);
+		tiled.push_back(getTiledIndex(s.X, s.Y, s.Z) / voxels_per_line);
+
+		if (_voxels[getVoxelIndex(s.X, s.Y, s.Z)] || !stepDDA(s))
+		{
+			break;
 		}
 	}
 
-	return was_killed;
+	std::sort(linear.begin(), linear.end());
+	std::sort(tiled.begin(), tiled.end());
+
+	linear_lines = static_cast<uint>(std::unique(linear.begin(), linear.end()) - linear.begin());
+	tiled_lines = static_cast<uint>(std::unique(tiled.begin(), tiled.end()) - tiled.begin());
 }
 
 
-void Cube::addToVoxelMemory(uint index, uint voxel)
+// Bytes held by the voxel grid and everything built over it.
+size_t Cube::getMemoryUsage() const
 {
-	_voxel_memory[_memory_index++] = VoxelMemory{index, voxel};
-}
+	const size_t brick_count{ static_cast<size_t>(_brick_slice) * _brick_grid_size.z };
+	const size_t block_count{ static_cast<size_t>(_block_slice) * _block_grid_size.z };
 
+	size_t bytes{ _voxel_count * sizeof(PaletteIndex) + _PALETTE_SIZE * sizeof(uint) };
+	bytes += brick_count * sizeof(uint) + block_count * sizeof(uint64_t);
 
-void Cube::restoreVoxelMemory()
-{
-	for (uint i = 0; i < _memory_index; ++i)
+	if (_distance_field)
 	{
-		auto [index, voxel] = _voxel_memory[i];
+		bytes += static_cast<size_t>(_slice) * _size.z * sizeof(uchar);
+	}
 
-		_voxels[index] = voxel;
+	for (const MipLevel& mip : _mips)
+	{
+		bytes += mip._voxels.size() * sizeof(PaletteIndex);
 	}
 
-	_memory_index = 0;
-}
\ No newline at end of file
+	return bytes;
+}
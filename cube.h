@@ -1,9 +1,23 @@
 #pragma once
 
+// Store voxels in 4x4x4 tiles instead of x-major rows.
+// Rays moving along Y or Z then stay in the same cache lines for several steps.
+// Grids are padded to whole tiles, so very thin cubes use more memory.
+#define TILED_VOXELS 1
+
+// Voxels store an index into a small per-cube palette of full material | color words.
+// 8 bits allows 255 distinct voxels per cube, 16 bits allows 65535. Index 0 is always air.
+#define VOXEL_PALETTE_BITS 8
 
 class Cube
 {
 public:
+#if VOXEL_PALETTE_BITS == 8
+	using PaletteIndex = unsigned char;
+#else
+	using PaletteIndex = unsigned short;
+#endif
+
 	struct DDAState
 	{
 		int3 step{ 0 };			// 16 bytes
@@ -17,11 +31,23 @@ public:
 		float dummy2{ 0 };		// 16 bytes, 64 bytes in total
 	};
 
+	// Coarser copy of the grid. Mip k has one cell per 2^k voxels along each side, so its cells line up with the voxels.
+	struct MipLevel
+	{
+		uint3 _size{ 0 };
+		std::vector<PaletteIndex> _voxels;
+	};
+
 	// Ctor.
 	Cube();
 	Cube(const uint3 size);
 
-	~Cube() = default;
+	// Owns its aligned buffers, so it cannot be copied.
+	Cube(const Cube&) = delete;
+	Cube& operator=(const Cube&) = delete;
+
+	// Dtor.
+	~Cube();
 
 	void initialize(const uint3& size);
 
@@ -31,6 +57,7 @@ public:
 
 	// Traversal methods.
 	void findNearest(Ray& ray) const;
+	void findNearest4(Ray* rays) const;
 	bool findOcclusion(const Ray& ray, TintData& tint_data) const;
 	void findMaterialExit(Ray& ray, const uint material_type) const;
 	bool eraseVoxels(Ray& ray);
@@ -38,9 +65,72 @@ public:
 
 	// Modify methods.
 	void set(uint x, uint y, uint z, uint material_data, uint voxel_color);
+
+	// Acceleration data.
+	void buildDistanceField();
+	void buildOccupiedBounds();
+	void buildMips();
+
+	// Level of detail.
+	uint selectMip(const Ray& ray, const float t_enter) const;
+
+	// Benchmarks.
+	void measureCacheLines(const Ray& ray, uint& linear_lines, uint& tiled_lines) const;
+	size_t getMemoryUsage() const;
+
+	// Grid traversal shared with SparseCube. Rays enter through bounds, and only visit cells in the occupied box
+	//  [occupied_min, occupied_min + occupied_size).
+	static float intersectBounds(const Ray& ray, const float3 bounds[2]);
+	static bool containsPoint(const float3 bounds[2], const float3& position);
+	static bool setupDDA(const Ray& ray, DDAState& state, const float3 bounds[2], const uint3& occupied_min, const uint3& occupied_size);
+	static bool stepDDA(DDAState& state, const uint3& occupied_min, const uint3& occupied_size);
+	static bool skipRegion(DDAState& state, const uint3& region_min, const uint3& region_max, const uint3& occupied_min, const uint3& occupied_size);
+
+	// Indexing.
+	inline uint getVoxelIndex(const uint x, const uint y, const uint z) const
+	{
+#if TILED_VOXELS
+		return getTiledIndex(x, y, z);
+#else
+		return getLinearIndex(x, y, z);
+#endif
+	}
+
+	inline uint getLinearIndex(const uint x, const uint y, const uint z) const
+	{
+		return x + y * _pitch + z * _slice;
+	}
+
+	// Same bit layout inside a tile as the occupancy mask.
+	inline uint getTiledIndex(const uint x, const uint y, const uint z) const
+	{
+		const uint tile{ (x >> _BLOCK_SHIFT) + (y >> _BLOCK_SHIFT) * _block_pitch + (z >> _BLOCK_SHIFT) * _block_slice };
+		return (tile << 6) | (x & 3) | ((y & 3) << 2) | ((z & 3) << 4);
+	}
+
+	// Brick layer. Each brick covers 8x8x8 voxels and counts how many of them are solid.
+	static constexpr uint _BRICK_SHIFT{ 3 };
+	static constexpr uint _BRICK_SIZE{ 1u << _BRICK_SHIFT };
+
+	// Occupancy mask. One bit per voxel, stored as a 64-bit word per 4x4x4 block.
+	static constexpr uint _BLOCK_SHIFT{ 2 };
+	static constexpr uint _BLOCK_SIZE{ 1u << _BLOCK_SHIFT };
+
+	// Palette.
+	static constexpr uint _PALETTE_SIZE{ 1u << VOXEL_PALETTE_BITS };
+
+	// Distance field. Chebyshev distance (in voxels) from each voxel to the nearest solid voxel, capped.
+	static constexpr uint _MAX_DISTANCE{ 8 };
+
+	// Mips. A cell is solid when at least half of the cells it covers one level down are.
+	static constexpr uint _MIP_LEVELS{ 3 };
+	static constexpr uint _MIP_MAJORITY{ 4 };
 	
 	// Properties.
 	uint _id{ 0 };
+
+	// Incremented whenever a voxel changes, so structures built from the voxels know when to rebuild.
+	uint _voxels_version{ 0 };
 	float3 _bounds[2]{ {0.0f}, {1.0f} };
 
 	uint _pitch{ 64 };
@@ -49,24 +139,77 @@ public:
 	uint _slice{ 64 };
 	uint3 _size{ 1 };
 
-	unsigned int* _voxels{ nullptr };
+	PaletteIndex* _voxels{ nullptr };
+	uint _voxel_count{ 0 };
+
+	uint* _palette{ nullptr };
+	uint _palette_size{ 1 };
+
+	uint _brick_pitch{ 8 };
+	uint _brick_slice{ 64 };
+	uint3 _brick_grid_size{ 1 };
+
+	uint* _bricks{ nullptr };
+
+	uint _block_pitch{ 16 };
+	uint _block_slice{ 256 };
+	uint3 _block_grid_size{ 1 };
+
+	uint64_t* _occupancy{ nullptr };
+
+	// Tight box of cells around the solid voxels. Rays enter and leave the grid through it, and _bounds follows it.
+	// Grows as voxels are added. Removed voxels only mark it dirty, it shrinks on the next buildOccupiedBounds().
+	uint3 _occupied_min{ 0 };
+	uint3 _occupied_size{ 0 };
+	bool _is_occupied_bounds_dirty{ false };
+
+	// Optional. Built on CubeBVH::build() when enabled.
+	bool _use_distance_field{ true };
+	bool _is_distance_field_dirty{ true };
+	uchar* _distance_field{ nullptr };
+
+	// Built on CubeBVH::build(), and rebuilt on update once voxels have changed. _mips[0] is mip level 1.
+	std::vector<MipLevel> _mips;
+	uint _mips_version{ ~0u };
 
 
 private:
 	struct VoxelMemory
 	{
 		VoxelMemory() = default;
-		VoxelMemory(uint index, uint voxel)
-			: _index{ index }
+		VoxelMemory(uint x, uint y, uint z, PaletteIndex voxel)
+			: _x{ x }
+			, _y{ y }
+			, _z{ z }
 			, _voxel{ voxel }
 		{	}
 
-		uint _index{ 0 };
-		uint _voxel{ 0 };
+		uint _x{ 0 };
+		uint _y{ 0 };
+		uint _z{ 0 };
+		PaletteIndex _voxel{ 0 };
 	};
 
+	void freeBuffers();
 	bool setup3DDDA(const Ray& ray, DDAState& state) const;
-	void addToVoxelMemory(uint index, uint voxel);
+	bool stepDDA(DDAState& state) const;
+	bool skipEmptyRegion(DDAState& state, const uint3& region_min, const uint3& region_max) const;
+	bool skipEmptyBrick(DDAState& state) const;
+	bool isBrickOccupied(const DDAState& state) const;
+	void updateBrick(uint x, uint y, uint z, uint old_voxel, uint new_voxel);
+	bool skipEmptyBlock(DDAState& state) const;
+	uint64_t getBlock(const DDAState& state) const;
+	bool isVoxelOccupied(const DDAState& state, uint64_t block) const;
+	void updateOccupancy(uint x, uint y, uint z, uint new_voxel);
+	bool skipByDistance(DDAState& state, uint distance) const;
+	void updateDistanceField(uint x, uint y, uint z, uint old_voxel, uint new_voxel);
+	void updateOccupiedBounds(uint x, uint y, uint z, uint old_voxel, uint new_voxel);
+	void setOccupiedBounds(const uint3& occupied_min, const uint3& occupied_size);
+	PaletteIndex findPaletteIndex(uint voxel);
+	void setupMipDDA(const DDAState& state, DDAState& mip_state, const uint level) const;
+	void findNearestInMip(Ray& ray, const DDAState& state, const uint level) const;
+	bool findOcclusionInMip(const Ray& ray, TintData& tint_data, const DDAState& state, const uint level) const;
+	void addToVoxelMemory(uint x, uint y, uint z, PaletteIndex voxel);
 
 	VoxelMemory _voxel_memory[1];
 	uint _memory_index{ 0 };
@@ -14,6 +14,7 @@ CubeBVH::~CubeBVH()
 {
 	delete[] _nodes;
 	delete[] _item_indicies;
+	delete _box_bvh;
 }
 
 
@@ -21,12 +22,39 @@ CubeBVH::~CubeBVH()
 
 void CubeBVH::intersectItemForNearest(Ray& transformed_ray, const uint) const
 {
+	if (_box_bvh)
+	{
+		_box_bvh->findNearestInCube(transformed_ray);
+		return;
+	}
+
 	_cube.findNearest(transformed_ray);
 }
 
 
+void CubeBVH::intersectItemForNearest4(Ray* transformed_rays, const uint) const
+{
+	if (_box_bvh)
+	{
+		for (int i = 0; i < 4; ++i)
+		{
+			_box_bvh->findNearestInCube(transformed_rays[i]);
+		}
+
+		return;
+	}
+
+	_cube.findNearest4(transformed_rays);
+}
+
+
 bool CubeBVH::intersectItemForOcclusion(Ray& transformed_ray, TintData& tint_data, const uint) const
 {
+	if (_box_bvh)
+	{
+		return _box_bvh->findOcclusionInCube(transformed_ray, tint_data);
+	}
+
 	return _cube.findOcclusion(transformed_ray, tint_data);
 }
 
@@ -43,18 +71,6 @@ void CubeBVH::interesectItemForMaterialExit(Ray& original_ray, const uint materi
 }
 
 
-void CubeBVH::intersectItemForNearestToPlayer(Ray& ray, const uint, const int source_id) const
-{
-	// Player models do not interact with rays they create.
-	if (source_id == _id)
-	{
-		return;
-	}
-
-	_cube.findNearest(ray);
-}
-
-
 void CubeBVH::intersectItemForVoxelErasure(Ray& ray, const uint, Cube*& modified_cube)
 {
 	// Player models do not interact with this ray check.
@@ -81,15 +97,7 @@ void CubeBVH::setTransform(const float3& scale, const float3& rotation, const fl
 	float3 to_pivot_translation{ -(make_float3(_cube._size) * VOXELSIZE * 0.5f)};
 
 	// Rotate around pivot point and return to original position.
-	_matrix = mat4::Identity();
-
-	_matrix = _matrix * mat4::Translate(_translate);
-	_matrix = _matrix * mat4::Translate(-to_pivot_translation);	
-	_matrix = _matrix * mat4::RotateY(_rotate.y) * mat4::RotateX(_rotate.x) * mat4::RotateZ(_rotate.z);
-	_matrix = _matrix * mat4::Scale(_scale);
-	_matrix = _matrix * mat4::Translate(to_pivot_translation);
-
-	_inverse_matrix = _matrix.Inverted();
+	composeTransform(-to_pivot_translation, mat4::RotateY(_rotate.y) * mat4::RotateX(_rotate.x) * mat4::RotateZ(_rotate.z));
 
 	setBounds();
 }
@@ -120,14 +128,71 @@ void CubeBVH::build()
 	root._significant_index = 0;
 	root._child_count = N;
 
+	// Rebuild the cube's distance field and shrink its bounds if voxels were removed since the last build.
+	_cube.buildDistanceField();
+	_cube.buildOccupiedBounds();
+	_cube.buildMips();
+	buildBoxBVH();
+
 	updateNodeBounds(0);
 	setBounds();
+	finishBuild();
+}
+
+
+void CubeBVH::update()
+{
+	// Removing voxels leaves the distance field stale and the occupied bounds loose. Any change leaves the mips and boxes stale.
+	_cube.buildDistanceField();
+	_cube.buildOccupiedBounds();
+	_cube.buildMips();
+
+	if (_box_bvh && _box_bvh->_voxels_version != _cube._voxels_version)
+	{
+		buildBoxBVH();
+	}
+
+	// Added or removed voxels may have moved the occupied bounds, so the TLAS leaf has to follow.
+	if (memcmp(&_nodes[0]._aabb_min, &_cube._bounds[0], sizeof(float3)) || memcmp(&_nodes[0]._aabb_max, &_cube._bounds[1], sizeof(float3)))
+	{
+		updateNodeBounds(0);
+#if USE_QBVH
+		refitQBVH();
+#endif
+		setBounds();
+	}
+}
+
+
+void CubeBVH::buildBoxBVH()
+{
+	delete _box_bvh;
+	_box_bvh = nullptr;
+
+	// An empty cube is left to the grid traversal, which rejects every ray straight away.
+	if (!_use_boxes || !_cube._occupied_size.x)
+	{
+		return;
+	}
+
+	// The box BLAS lives in the cube's object space, and is only traced through this BVH, which already transforms the rays.
+	_box_bvh = new BoxBVH(_cube);
+	_box_bvh->_id = _id;
+	_box_bvh->_use_compressed_nodes = _use_compressed_nodes;
+	_box_bvh->build();
+
+	// Noisy cubes barely merge, and stepping through their grid beats a box BLAS over nearly every voxel.
+	if (_box_bvh->_voxel_count < _box_bvh->_boxes.size() * _MIN_VOXELS_PER_BOX)
+	{
+		delete _box_bvh;
+		_box_bvh = nullptr;
+	}
 }
 
 
 void CubeBVH::updateNodeBounds(uint) const
 {
-	// BVH has same bounds as the only child / item.
+	// BVH has same bounds as the only child / item, which are the bounds of its solid voxels.
 	_nodes[0]._aabb_min = _cube._bounds[0];
 	_nodes[0]._aabb_max = _cube._bounds[1];
 }
@@ -152,6 +217,11 @@ void CubeBVH::setID(const int id)
 {
 	_id = id;
 	_cube._id = id;
+
+	if (_box_bvh)
+	{
+		_box_bvh->_id = id;
+	}
 }
 
 
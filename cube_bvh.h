@@ -4,7 +4,7 @@
 // [Credit] https://jacco.ompf2.com/2022/04/13/how-to-build-a-bvh-part-1-basics/
 
 
-class CubeBVH : public BVH
+class CubeBVH : public BVHTraversal<CubeBVH>
 {
 public:
 	CubeBVH();
@@ -18,13 +18,13 @@ public:
 	void intersectItemForNearest(Ray& transformed_ray, const uint) const override;
 
 
-	bool intersectItemForOcclusion(Ray& transformed_ray, TintData& tint_data, const uint) const override;
+	void intersectItemForNearest4(Ray* transformed_rays, const uint) const override;
 
 
-	void interesectItemForMaterialExit(Ray& original_ray, const uint material_type) const override;
+	bool intersectItemForOcclusion(Ray& transformed_ray, TintData& tint_data, const uint) const override;
 
 
-	void intersectItemForNearestToPlayer(Ray& ray, const uint, const int source_id) const override;
+	void interesectItemForMaterialExit(Ray& original_ray, const uint material_type) const override;
 
 
 	void intersectItemForVoxelErasure(Ray& ray, const uint, Cube*& modified_cube) override;
@@ -35,6 +35,13 @@ public:
 	void build() override;
 
 
+	void update() override;
+
+
+	// Merges the cube's voxels into a box BLAS when boxes are in use.
+	void buildBoxBVH();
+
+
 	void updateNodeBounds(uint node_index) const override;
 
 
@@ -61,4 +68,15 @@ public:
 	Cube _cube;
 
 	bool _is_player_cube{ false };
+
+	// Trace the cube as merged boxes of identical voxels instead of stepping through its grid. Takes effect on the next build().
+	bool _use_boxes{ false };
+
+
+private:
+	// Boxes only replace the grid traversal when they merge at least this many voxels on average.
+	static constexpr uint _MIN_VOXELS_PER_BOX{ 8 };
+
+	// Box BLAS over the cube's voxels, only present when boxes are in use and the cube holds voxels.
+	BoxBVH* _box_bvh{ nullptr };
 };
\ No newline at end of file
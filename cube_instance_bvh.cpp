@@ -38,18 +38,6 @@ void CubeInstanceBVH::interesectItemForMaterialExit(Ray& original_ray, const uin
 }
 
 
-void CubeInstanceBVH::intersectItemForNearestToPlayer(Ray& ray, const uint, const int source_id) const
-{
-	// Player models do not interact with rays they create.
-	if (source_id == _id)
-	{
-		return;
-	}
-		
-	_cube->findNearest(ray);
-}
-
-
 void CubeInstanceBVH::setTransform(float3& scale, float3& rotation, float3& translation)
 {
 	// Set new values.
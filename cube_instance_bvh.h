@@ -20,9 +20,6 @@ public:
 	void interesectItemForMaterialExit(Ray& original_ray, const uint material_type) const override;
 
 
-	void intersectItemForNearestToPlayer(Ray& ray, const uint, const int source_id) const override;
-
-
 	void setTransform(float3& scale, float3& rotation, float3& translation) override;
 
 
@@ -7,7 +7,7 @@
 // Stretch screen by the provided multiple. Ignored on 0.
 #define STRETCHWINDOW 4
 
-// Screen resolution.
+// Window size, and the render resolution the game starts with. Render resolution and tile size can change at runtime, see Renderer::setResolution().
 #define SCREENSIZE 0
 
 #if SCREENSIZE == 0			// ILO size
@@ -91,7 +91,7 @@ void Island::createLandBVH(Data& data, uint non_metal_id)
 			break;
 	}
 
-	_offset = _bvh._bounds.bmax3 * 0.5f;
+	_offset = make_float3(_bvh._cube._size) * VOXELSIZE * 0.5f;
 	_position = { data._position.x, y_position, data._position.y };
 
 	float3 translation{ _position - _offset };	
@@ -126,7 +126,7 @@ void Island::createPierBVH(Data& data, uint non_metal_id)
 	_pier._bvh.build();
 
 	// Place.
-	_pier._offset = _pier._bvh._bounds.bmax3 * 0.5f;
+	_pier._offset = make_float3(_pier._bvh._cube._size) * VOXELSIZE * 0.5f;
 
 	float up{ 0.0f };
 	switch (_location)
@@ -52,52 +52,67 @@ Light::Light(int id, LightType type, float3& color, float& intensity, float3& po
 
 
 float3 Light::getIllumination(const Ray& ray, const float3& surface_normal, const Scene* scene, TintData& tint_data) const
+{
+	LightSample light_sample;
+	if (!sample(ray, surface_normal, light_sample))
+	{
+		return { 0.0f };
+	}
+
+	// Get light.
+	if (isVisible(getShadowRay(ray.IntersectionPoint(), light_sample), tint_data, scene))
+	{
+		return light_sample._illumination;
+	}
+
+	return { 0.0f };
+}
+
+
+bool Light::sample(const Ray& ray, const float3& surface_normal, LightSample& light_sample) const
 {
 	switch (_type)
 	{
 	case LightType::DIRECTIONAL:
-		return getDirectionalIllumination(ray, surface_normal, scene, tint_data);
+		return sampleDirectional(ray, surface_normal, light_sample);
 	case LightType::POINT:
-		return getPointIllumination(ray, surface_normal, scene, tint_data);
+		return samplePoint(ray, surface_normal, light_sample);
 	case LightType::SPOT:
-		return getSpotIllumination(ray, surface_normal, scene, tint_data);	
+		return sampleSpot(ray, surface_normal, light_sample);
 	case LightType::AREA_RECT:
-		return getAreaRectIllumination(ray, surface_normal, scene, tint_data);
+		return sampleAreaRect(ray, surface_normal, light_sample);
 	case LightType::AREA_SPHERE:
-		return getAreaSphereIllumination(ray, surface_normal, scene, tint_data);
+		return sampleAreaSphere(ray, surface_normal, light_sample);
 	default:
 		assert(false && "Used light type enum that does not exist.");
-		return { 0.0f };
+		return false;
 	}
 }
 
 
-float3 Light::getDirectionalIllumination(const Ray& ray, const float3& surface_normal, const Scene* scene, TintData& tint_data) const
+bool Light::sampleDirectional(const Ray&, const float3& surface_normal, LightSample& light_sample) const
 {
 	// Prepare values.
-	const float3 intersection_point{ ray.IntersectionPoint() };
 	const float3 surface_to_light_normalized{ -_direction_to_world }; // direction_to_world is already normalized.
 
 	// Angle to light.
 	const float angle_of_incidence{ dot(surface_normal, surface_to_light_normalized) };
 	if (angle_of_incidence <= 0.0f)
 	{
-		return { 0.0f };
+		return false;
 	}
 
 	// Get light.
-	if (isVisible(intersection_point, -_direction_to_world, Ray::t_max, tint_data, scene))
-	{
-		float3 illumination{ _color * _intensity * angle_of_incidence };
-		clampIllumination(illumination);
-		return illumination;
-	}
-	
-	return { 0.0f };
+	light_sample._direction = surface_to_light_normalized;
+	light_sample._distance = Ray::t_max;
+	light_sample._illumination = _color * _intensity * angle_of_incidence;
+	clampIllumination(light_sample._illumination);
+
+	return true;
 }
 
 
-float3 Light::getPointIllumination(const Ray& ray, const float3& surface_normal, const Scene* scene, TintData& tint_data) const
+bool Light::samplePoint(const Ray& ray, const float3& surface_normal, LightSample& light_sample) const
 {
 	// Prepare values.
 	const float3 intersection_point{ ray.IntersectionPoint() };
@@ -109,22 +124,20 @@ float3 Light::getPointIllumination(const Ray& ray, const float3& surface_normal,
 	const float angle_of_incidence{ dot(surface_normal, surface_to_light_normalized) };
 	if (angle_of_incidence <= 0.0f)
 	{
-		return { 0.0f };
+		return false;
 	}
 
 	// Get light.
-	if (isVisible(intersection_point, surface_to_light_vector, surface_to_light_distance, tint_data, scene))
-	{
-		float3 illumination{ _color * _intensity * angle_of_incidence / (surface_to_light_distance * surface_to_light_distance) };
-		clampIllumination(illumination);
-		return illumination;
-	}
+	light_sample._direction = surface_to_light_vector;
+	light_sample._distance = surface_to_light_distance;
+	light_sample._illumination = _color * _intensity * angle_of_incidence / (surface_to_light_distance * surface_to_light_distance);
+	clampIllumination(light_sample._illumination);
 
-	return { 0.0f };
+	return true;
 }
 
 
-float3 Light::getSpotIllumination(const Ray& ray, const float3& surface_normal, const Scene* scene, TintData& tint_data) const
+bool Light::sampleSpot(const Ray& ray, const float3& surface_normal, LightSample& light_sample) const
 {
 	// Prepare values.
 	const float3 intersection_point{ ray.IntersectionPoint() };
@@ -136,36 +149,33 @@ float3 Light::getSpotIllumination(const Ray& ray, const float3& surface_normal,
 	const float angle_of_incidence{ dot(surface_normal, surface_to_light_normalized) };
 	if (angle_of_incidence <= 0.0f)
 	{
-		return { 0.0f };
+		return false;
 	}
 
 	// Angle to front of light.
 	const float angle_of_alignment{ dot(_direction_to_world, -surface_to_light_normalized) };	
 	if (angle_of_alignment < _cutoff_cos_theta)
 	{
-		return { 0.0f };
+		return false;
 	}
 
-	// Get light.
-	if (isVisible(intersection_point, surface_to_light_vector, surface_to_light_distance, tint_data, scene))
-	{		
-		// Convert a range between 2 arbitrary values into [0, 1].
-		// [Credit] OGLdev. https://ogldev.org/www/tutorial21/tutorial21.html
-		float fall_off_intensity = 1.0f - (1.0f - angle_of_alignment) * (1.0f / (1.0f - _cutoff_cos_theta));
-
-		float3 illumination{ _color * _intensity
-			* fall_off_intensity * (_falloff_factor * _falloff_factor) // how quickly light decreases from the center.
-			* angle_of_incidence / (surface_to_light_distance * surface_to_light_distance) // distance attenuation.
-		};
-		clampIllumination(illumination);
-		return illumination;
-	}
+	// Convert a range between 2 arbitrary values into [0, 1].
+	// [Credit] OGLdev. https://ogldev.org/www/tutorial21/tutorial21.html
+	float fall_off_intensity = 1.0f - (1.0f - angle_of_alignment) * (1.0f / (1.0f - _cutoff_cos_theta));
 
-	return { 0.0f };
+	// Get light.
+	light_sample._direction = surface_to_light_vector;
+	light_sample._distance = surface_to_light_distance;
+	light_sample._illumination = _color * _intensity
+		* fall_off_intensity * (_falloff_factor * _falloff_factor) // how quickly light decreases from the center.
+		* angle_of_incidence / (surface_to_light_distance * surface_to_light_distance); // distance attenuation.
+	clampIllumination(light_sample._illumination);
+
+	return true;
 }
 
 
-float3 Light::getAreaRectIllumination(const Ray& ray, const float3& surface_normal, const Scene* scene, TintData& tint_data) const
+bool Light::sampleAreaRect(const Ray& ray, const float3& surface_normal, LightSample& light_sample) const
 {
 	// Choose random point on the area light.
 	const float3 position_on_light{ _top_left + RandomFloat() * _u_vec + RandomFloat() * _v_vec };
@@ -180,25 +190,23 @@ float3 Light::getAreaRectIllumination(const Ray& ray, const float3& surface_norm
 	const float angle_of_incidence{ dot(surface_normal, surface_to_light_normalized) };
 	if (angle_of_incidence <= 0.0f)
 	{
-		return { 0.0f };
+		return false;
 	}
 
 	// Angle to front of light.
 	const float angle_of_alignment{ dot(_direction_to_world, -surface_to_light_normalized) };
 	if (angle_of_alignment <= 0.0f)
 	{
-		return { 0.0f };
+		return false;
 	}
 
 	// Get light.
-	if (isVisible(intersection_point, surface_to_light_vector, surface_to_light_distance, tint_data, scene))
-	{
-		float3 illumination{ _color * _intensity * angle_of_incidence / (surface_to_light_distance * surface_to_light_distance) };
-		clampIllumination(illumination);
-		return illumination;
-	}
-	
-	return { 0.0f };
+	light_sample._direction = surface_to_light_vector;
+	light_sample._distance = surface_to_light_distance;
+	light_sample._illumination = _color * _intensity * angle_of_incidence / (surface_to_light_distance * surface_to_light_distance);
+	clampIllumination(light_sample._illumination);
+
+	return true;
 }
 
 
@@ -220,7 +228,7 @@ void Light::calculateAreaRectOrientation()
 }
 
 
-float3 Light::getAreaSphereIllumination(const Ray& ray, const float3& surface_normal, const Scene* scene, TintData& tint_data) const
+bool Light::sampleAreaSphere(const Ray& ray, const float3& surface_normal, LightSample& light_sample) const
 {
 	// Choose random point on the area light.
 	const float3 position_on_light{ _position + _radius * randomUnitVector() };
@@ -235,24 +243,23 @@ float3 Light::getAreaSphereIllumination(const Ray& ray, const float3& surface_no
 	const float angle_of_incidence{ dot(surface_normal, surface_to_light_normalized) };
 	if (angle_of_incidence <= 0.0f)
 	{
-		return { 0.0f };
+		return false;
 	}
 
 	// Get light.
-	if (isVisible(intersection_point, surface_to_light_vector, surface_to_light_distance, tint_data, scene))
+	float attenuation{ angle_of_incidence / (surface_to_light_distance * surface_to_light_distance) };
+	//attenuation = _clamp_attenuation * fminf(attenuation, _max_attenuation) + !_clamp_attenuation * attenuation;
+	if (_clamp_attenuation)
 	{
-		float attenuation{ angle_of_incidence / (surface_to_light_distance * surface_to_light_distance) };
-		//attenuation = _clamp_attenuation * fminf(attenuation, _max_attenuation) + !_clamp_attenuation * attenuation;
-		if (_clamp_attenuation)
-		{
-			attenuation = fminf(attenuation, _max_attenuation);
-		}
-		float3 illumination{ _color * _intensity * attenuation };
-		clampIllumination(illumination);
-		return illumination;
+		attenuation = fminf(attenuation, _max_attenuation);
 	}
 
-	return { 0.0f };
+	light_sample._direction = surface_to_light_vector;
+	light_sample._distance = surface_to_light_distance;
+	light_sample._illumination = _color * _intensity * attenuation;
+	clampIllumination(light_sample._illumination);
+
+	return true;
 }
 
 
@@ -267,9 +274,16 @@ void Light::clampIllumination(float3& illumination) const
 	}
 }
 
-const bool Light::isVisible(const float3& shadow_ray_origin, const float3& shadow_ray_direction, const float shadow_ray_length, TintData& tint_data, const Scene* scene) const
+Ray Light::getShadowRay(const float3& surface_point, const LightSample& light_sample)
 {
-	Ray shadow_ray{ shadow_ray_origin, normalize(shadow_ray_direction), shadow_ray_length, true };
+	Ray shadow_ray{ surface_point, normalize(light_sample._direction), light_sample._distance, true };
+	shadow_ray._lod_distance = Ray::_secondary_lod_distance;
+
+	return shadow_ray;
+}
 
+
+const bool Light::isVisible(Ray shadow_ray, TintData& tint_data, const Scene* scene) const
+{
 	return !scene->isOccluded(shadow_ray, tint_data);
 }
\ No newline at end of file
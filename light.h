@@ -17,6 +17,15 @@ enum class LightType : uint
 };
 
 
+// Light arriving at a surface point if nothing blocks it, and where the shadow ray has to go to find out.
+struct LightSample
+{
+	float3 _direction{ 0.0f };			// Surface to light, not normalized.
+	float _distance{ 0.0f };
+	float3 _illumination{ 0.0f };
+};
+
+
 class Light
 {
 public:
@@ -31,11 +40,16 @@ public:
 	// Methods - all light types in 1 class.
 	float3 getIllumination(const Ray& ray, const float3& surface_normal, const Scene* scene, TintData& tint) const;
 
-	float3 getDirectionalIllumination(const Ray& ray, const float3& surface_normal, const Scene* scene, TintData& tint_data) const;
-	float3 getPointIllumination(const Ray& ray, const float3& surface_normal, const Scene* scene, TintData& tint_data) const;
-	float3 getSpotIllumination(const Ray& ray, const float3& surface_normal, const Scene* scene, TintData& tint_data) const;
-	float3 getAreaRectIllumination(const Ray& ray, const float3& surface_normal, const Scene* scene, TintData& tint_data) const;
-	float3 getAreaSphereIllumination(const Ray& ray, const float3& surface_normal, const Scene* scene, TintData& tint_data) const;
+	// Light at the ray's intersection point, before the shadow ray is traced. False when the light cannot reach the surface at all.
+	bool sample(const Ray& ray, const float3& surface_normal, LightSample& light_sample) const;
+
+	bool sampleDirectional(const Ray& ray, const float3& surface_normal, LightSample& light_sample) const;
+	bool samplePoint(const Ray& ray, const float3& surface_normal, LightSample& light_sample) const;
+	bool sampleSpot(const Ray& ray, const float3& surface_normal, LightSample& light_sample) const;
+	bool sampleAreaRect(const Ray& ray, const float3& surface_normal, LightSample& light_sample) const;
+	bool sampleAreaSphere(const Ray& ray, const float3& surface_normal, LightSample& light_sample) const;
+
+	static Ray getShadowRay(const float3& surface_point, const LightSample& light_sample);
 
 	void calculateAreaRectOrientation();
 
@@ -65,6 +79,6 @@ public:
 
 private:
 	void clampIllumination(float3& illumination) const;
-	const bool isVisible(const float3& shadow_ray_origin, const float3& shadow_ray_direction, const float shadow_ray_length, TintData& tint_data, const Scene* scene) const;
+	const bool isVisible(Ray shadow_ray, TintData& tint_data, const Scene* scene) const;
 };
 
@@ -33,6 +33,25 @@ float3 LightList::getIllumination(const Ray& ray, const float3& surface_normal,
 }
 
 
+bool LightList::sample(const Ray& ray, const float3& surface_normal, LightSample& light_sample) const
+{
+#ifdef _DEBUG
+	if (_max_range == 0) return false;
+#endif
+
+	size_t light_index{ static_cast<size_t>(RandomFloat() * _max_range) };
+
+	if (!_lights[light_index].sample(ray, surface_normal, light_sample))
+	{
+		return false;
+	}
+
+	light_sample._illumination *= _max_range;
+
+	return true;
+}
+
+
 Light* LightList::addDirectionalLight(float3 color, float intensity, float3 direction_to_world)
 {
 	float3 position{ 0.0f };
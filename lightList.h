@@ -19,6 +19,9 @@ public:
 	float3 getIllumination(const Ray& ray, const float3& surface_normal) const;
 	float3 getIllumination(const Ray& ray, const float3& surface_normal, TintData& tint_data) const;
 
+	// Same light choice as getIllumination(), with the shadow ray left to the caller.
+	bool sample(const Ray& ray, const float3& surface_normal, LightSample& light_sample) const;
+
 	Light* addDirectionalLight(float3 color, float intensity, float3 direction_to_world);
 	Light* addPointLight(float3 color, float intensity, float3 position);
 	Light* addSpotlight(float3 color, float intensity, float3 direction_to_world, float3 position, float falloff_factor = 0.5f, float cutoff_cos_theta = 0.8f);
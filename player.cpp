@@ -14,8 +14,8 @@ Player::Player(Observer* audio_event_observer, Camera& camera, const float water
 void Player::initialize()
 {
 	// Get offsets for transformations (rotate around center, not corner).
-	_ship._offset = _ship._bvh._bounds.bmax3 * 0.5f;
-	_avatar._offset = _avatar._bvh._bounds.bmax3 * 0.5f;
+	_ship._offset = make_float3(_ship._bvh._cube._size) * VOXELSIZE * 0.5f;
+	_avatar._offset = make_float3(_avatar._bvh._cube._size) * VOXELSIZE * 0.5f;
 
 	// Set ship's starting position and facing.
 	_ship._position = float3{ 3.55f, _waterline, 1.80f };
@@ -283,7 +283,8 @@ void Player::handleShipCollisions(Scene* scene)
 
 	// Check ahead.
 	Ray player_ray{ _ship._position + vertical_offset, _ahead + vertical_offset, 0, _ship._offset.x + _PHYSICS_RAY_EPSILON, false };
-	scene->findNearestToPlayer(player_ray, _ship._bvh._id);
+	player_ray._mask = _SHIP_RAY_MASK;
+	scene->findNearest(player_ray);
 
 	// If hit something ...
 	if (player_ray._hit_data)
@@ -604,7 +605,8 @@ void Player::handleAvatarCollisions(Scene* scene)
 
 	// Check ahead.
 	Ray player_ray{ _avatar._position + y_offset, _ahead, 0, collision_ray_length, false };
-	scene->findNearestToPlayer(player_ray, _avatar._bvh._id);
+	player_ray._mask = _AVATAR_RAY_MASK;
+	scene->findNearest(player_ray);
 	
 	// If hit something ...
 	if (player_ray._hit_data)
@@ -623,7 +625,8 @@ void Player::handleAvatarCollisions(Scene* scene)
 
 	// Check behind.
 	player_ray = Ray{ _avatar._position + y_offset, -_ahead, 0, collision_ray_length, false };
-	scene->findNearestToPlayer(player_ray, _avatar._bvh._id);
+	player_ray._mask = _AVATAR_RAY_MASK;
+	scene->findNearest(player_ray);
 	
 	// If hit something ...
 	if (player_ray._hit_data)
@@ -642,7 +645,8 @@ void Player::handleAvatarCollisions(Scene* scene)
 
 	// Check left.
 	player_ray = Ray{ _avatar._position + y_offset, -_right, 0, collision_ray_length, false };
-	scene->findNearestToPlayer(player_ray, _avatar._bvh._id);
+	player_ray._mask = _AVATAR_RAY_MASK;
+	scene->findNearest(player_ray);
 	
 	// If hit something ...
 	if (player_ray._hit_data)
@@ -661,7 +665,8 @@ void Player::handleAvatarCollisions(Scene* scene)
 
 	// Check right.
 	player_ray = Ray{ _avatar._position + y_offset, _right, 0, collision_ray_length, false };
-	scene->findNearestToPlayer(player_ray, _avatar._bvh._id);
+	player_ray._mask = _AVATAR_RAY_MASK;
+	scene->findNearest(player_ray);
 
 	// If hit something ...
 	if (player_ray._hit_data)
@@ -680,7 +685,8 @@ void Player::handleAvatarCollisions(Scene* scene)
 
 	// Check down.
 	player_ray = Ray{ _avatar._position, -_up, 0, collision_ray_length, false };
-	scene->findNearestToPlayer(player_ray, _avatar._bvh._id);
+	player_ray._mask = _AVATAR_RAY_MASK;
+	scene->findNearest(player_ray);
 
 	// If hit something ...
 	if (player_ray._hit_data)
@@ -708,7 +714,7 @@ void Player::handleAvatarCollisions(Scene* scene)
 		}
 
 		// Check if standing on pier.
-		_is_on_pier = player_ray._id == -9;		
+		_is_on_pier = (scene->getHitMask(player_ray) & BVH::_MASK_PIER) != 0;		
 
 		// Extract from object.
 		if (player_ray.t < minimum_ray_length)
@@ -126,6 +126,10 @@ public:
 
 	static constexpr float _PHYSICS_RAY_EPSILON{ 0.000001f };
 
+	// Physics rays pass through spheres and the model that cast them.
+	static constexpr uint _SHIP_RAY_MASK{ BVH::_MASK_ALL & ~(BVH::_MASK_SHIP | BVH::_MASK_SPHERES) };
+	static constexpr uint _AVATAR_RAY_MASK{ BVH::_MASK_ALL & ~(BVH::_MASK_AVATAR | BVH::_MASK_SPHERES) };
+
 private:
 	void findNearestStone(Scene* scene);
 	bool toggleTelescope(const KeyboardManager& km);
@@ -5,6 +5,7 @@
 // Static initializers.
 float Ray::_epsilon_offset{ 0.00001f };
 int Ray::_epsilon_denominator{ 4 };
+float Ray::_secondary_lod_distance{ 0.0f };
 
 
 Ray::Ray(const float3 origin, const float3 direction, const uint source_voxel, const bool apply_offset)
@@ -83,6 +84,24 @@ Ray::Ray(const __m128 origin, const __m128 direction, const Ray& other)
 #endif
 
 
+RayPacket4::RayPacket4(const Ray* rays)
+	: Ox{ _mm_setr_ps(rays[0].O.x, rays[1].O.x, rays[2].O.x, rays[3].O.x) }
+	, Oy{ _mm_setr_ps(rays[0].O.y, rays[1].O.y, rays[2].O.y, rays[3].O.y) }
+	, Oz{ _mm_setr_ps(rays[0].O.z, rays[1].O.z, rays[2].O.z, rays[3].O.z) }
+	, rDx{ _mm_setr_ps(rays[0].rD.x, rays[1].rD.x, rays[2].rD.x, rays[3].rD.x) }
+	, rDy{ _mm_setr_ps(rays[0].rD.y, rays[1].rD.y, rays[2].rD.y, rays[3].rD.y) }
+	, rDz{ _mm_setr_ps(rays[0].rD.z, rays[1].rD.z, rays[2].rD.z, rays[3].rD.z) }
+	, t{ _mm_setr_ps(rays[0].t, rays[1].t, rays[2].t, rays[3].t) }
+{	}
+
+
+// Pull in hits found by the leaves so later box tests cull against them.
+void RayPacket4::updateT(const Ray* rays)
+{
+	t = _mm_setr_ps(rays[0].t, rays[1].t, rays[2].t, rays[3].t);
+}
+
+
 void Ray::setEpsilon(const int epsilon_denominator)
 {
 	_epsilon_denominator = epsilon_denominator;
@@ -26,6 +26,9 @@ public:
 	static float _epsilon_offset;
 	static int _epsilon_denominator;
 
+	// Distance given to diffuse and shadow rays, past which they may trace coarser voxel mips. 0 keeps them at full resolution.
+	static float _secondary_lod_distance;
+
 	static constexpr float t_max = 20'000.0f;			// 1e34f;
 
 #if USE_SSE
@@ -76,6 +79,8 @@ public:
 
 	uint _dielectric_indicator{ 0 };
 	int _id{ std::numeric_limits<int>().min() };	// id of the last cube ray was in - used to find material exits 
+	uint _mask{ ~0u };								// instances the ray may enter, see BVH::_MASK_*
+	float _lod_distance{ 0.0f };					// cubes entered this far away are traced at a coarser mip, 0 for full resolution, see Cube::selectMip()
 
 	inline void calculateDSign()
 	{
@@ -115,3 +120,16 @@ private:
 	}
 };
 
+
+// Four coherent rays in SoA layout, used for packet traversal of the TLAS and BLAS's.
+// Only what the box tests need is stored. Hit data stays in the Ray array the packet was made from.
+struct RayPacket4
+{
+	RayPacket4(const Ray* rays);
+
+	void updateT(const Ray* rays);
+
+	__m128 Ox, Oy, Oz;
+	__m128 rDx, rDy, rDz;
+	__m128 t;
+};
@@ -21,9 +21,6 @@ void Renderer::Init()
 {                  
 	scene.generateScene(Scene::Stage::WORLD);
 
-	// Prevent camera from considering ship as obstacle.
-	_camera._ship_id = scene._player._ship._bvh._id;
-
 	// Must set to 1 lower and then back to normal. No idea why.
 	Ray::setEpsilon(2);
 	Ray::setEpsilon(5);
@@ -44,28 +41,29 @@ void Renderer::Init()
 		}
 	}
 
-	// Create buffers of aligned memory.
-	constexpr static size_t size_of_array3{ SCRWIDTH * SCRHEIGHT * sizeof(float3) };
-	constexpr static size_t size_of_array4{ SCRWIDTH * SCRHEIGHT * sizeof(float4) };
-	
-	_accumulator = static_cast<float3*>(MALLOC64(size_of_array3));
-	if (_accumulator) { memset(_accumulator, 0, size_of_array3); }
-	
-	_albedo_buffer = static_cast<float3*>(MALLOC64(size_of_array3));
-	if (_albedo_buffer) { memset(_albedo_buffer, 0, size_of_array3); }
-	
-	_pixel_new_buffer = static_cast<float3*>(MALLOC64(size_of_array3));
-	if (_pixel_new_buffer) { memset(_pixel_new_buffer, 0, size_of_array3); }
+	// Render resolution. SEA_RESOLUTION=<width>x<height>[x<tile size>] overrides game_config.h without recompiling.
+	{
+		int2 resolution{ SCRWIDTH, SCRHEIGHT };
+		int tile_size{ TILE_SIZE };
 
-	_pixel_reprojected_buffer = static_cast<float3*>(MALLOC64(size_of_array3));
-	if (_pixel_reprojected_buffer) { memset(_pixel_reprojected_buffer, 0, size_of_array3); }
-	
-	_pixel_history_buffer = static_cast<float3*>(MALLOC64(size_of_array3));
-	if (_pixel_history_buffer) { memset(_pixel_history_buffer, 0, size_of_array3); }
-	
-	_ray_buffer = new Ray[SCRWIDTH * SCRHEIGHT];
-	memset(_ray_buffer, 0, SCRWIDTH * SCRHEIGHT * sizeof(Ray));
+		if (const char* resolution_setting{ getenv("SEA_RESOLUTION") })
+		{
+			int2 requested_resolution{ 0, 0 };
+			int requested_tile_size{ tile_size };
 
+			if (sscanf(resolution_setting, "%dx%dx%d", &requested_resolution.x, &requested_resolution.y, &requested_tile_size) >= 2)
+			{
+				resolution = requested_resolution;
+				tile_size = requested_tile_size;
+			}
+			else
+			{
+				printf("SEA_RESOLUTION \"%s\" is not <width>x<height>[x<tile size>]. Using %i x %i.\n", resolution_setting, resolution.x, resolution.y);
+			}
+		}
+
+		setResolution(resolution, tile_size);
+	}
 
 	// Try to load a camera.
 	if (false)
@@ -88,14 +86,24 @@ void Renderer::Init()
 // -----------------------------------------------------------
 void Renderer::Tick(float delta_time)
 {
-	// Starting material and screen midpoints as int and float.
-	static uint air_material{ 0 };
-	static int2 midscreeni{ SCRWIDTH >> 1, SCRHEIGHT >> 1 };
-	static float2 midscreenf{ static_cast<float2>(midscreeni) };
+	// Resolution changes wait for the start of a frame, when nothing reads the old buffers.
+	if (_is_resolution_requested)
+	{
+		_render_scale = 1.0f;
+		setResolution(_requested_resolution, _requested_tile_size);
+		_is_resolution_requested = false;
+	}
+	else if (_use_dynamic_resolution)
+	{
+		updateDynamicResolution();
+	}
 
 	// Pixel loop
 	Timer t;
 
+	// Swap in the TLAS refit during the previous frame before gameplay moves anything.
+	scene.endRefitAS();
+
 	// Update keyboard.
 	_km.update();
 
@@ -120,14 +128,21 @@ void Renderer::Tick(float delta_time)
 	_frame_count = _frame_count + 1.0f;
 	float inverse_accumulated_frames{ 1.0f / _frame_count };
 
-	// Refit/Rebuild TLAS & BLAS.
-	scene.refitAS();
+	// Refit/Rebuild TLAS & BLAS. When overlapped, the TLAS refit runs while this frame is traced and is swapped in next frame.
+	if (_use_async_as_update)
+	{
+		scene.beginRefitAS();
+	}
+	else
+	{
+		scene.refitAS();
+	}
 
 	// Remove obstructing voxels.
 	{
-		static int2 mid{ SCRWIDTH >> 1, SCRHEIGHT >> 1 }; // midscreen
+		const int2 mid{ _resolution >> 1 }; // midscreen
 		static int o{ 10 };	 // offset
-		static float2 erasure_ray_coordinates[21]{
+		float2 erasure_ray_coordinates[21]{
 			make_float2(mid.x - o * 2, mid.y - o),	make_float2(mid.x - o, mid.y - o),		make_float2(mid.x, mid.y - o),		make_float2(mid.x + o, mid.y - o),		make_float2(mid.x + o * 2, mid.y - o),
 			make_float2(mid.x - o * 2, mid.y),		make_float2(mid.x - o, mid.y),			make_float2(mid.x, mid.y),			make_float2(mid.x + o, mid.y),			make_float2(mid.x + o * 2, mid.y),
 			make_float2(mid.x - o * 2, mid.y + o),	make_float2(mid.x - o, mid.y + o),		make_float2(mid.x, mid.y + o),		make_float2(mid.x + o, mid.y + o),		make_float2(mid.x + o * 2, mid.y + o),
@@ -138,76 +153,95 @@ void Renderer::Tick(float delta_time)
 		//shootErasureRays(erasure_ray_coordinates);
 	}
 
-	// Primary ray generation.
-	shootPrimaryRays();
-
-	// Reprojection.
-	if (_use_reprojection)
-	{
-		applyReprojection();		
-	}
-	else // Transfer from ray data to bilinear interpolation data.
+#if MULTI_THREADED
+	if (_use_tile_pipeline)
 	{
-		memcpy(_pixel_reprojected_buffer, _pixel_new_buffer, SCRWIDTH * SCRHEIGHT * sizeof(float3));
-	}
+		Timer pipeline_timer;
 
-	// Denoising.
-	if (_use_denoiser)
-	{
-		applyDenoising();
+		// The wavefront tracer needs the whole frame at once. The pipeline then starts each tile from its traced pixels.
+		// Otherwise tracing overlaps with the other stages and has no time of its own.
+		_trace_time = 0.0f;
+		if (_use_wavefront)
+		{
+			traceWavefront();
+			_trace_time = pipeline_timer.elapsed();
+		}
+
+		runTilePipeline(inverse_accumulated_frames);
+
+		_pipeline_time = pipeline_timer.elapsed();
 	}
-	else // Transfer from bilinear interpolation data to pixel history data.
+	else
+#endif
 	{
-		memcpy(_pixel_history_buffer, _pixel_reprojected_buffer, SCRWIDTH * SCRHEIGHT * sizeof(float3));
-	}
+		// Primary ray generation.
+		{
+			Timer trace_timer;
 
-	// Draw to screen.
-	{
+			if (_use_wavefront)
+			{
+				traceWavefront();
+			}
+			else
+			{
+				shootPrimaryRays();
+			}
+
+			_trace_time = trace_timer.elapsed();
+		}
+
+		// Reprojection.
+		if (_use_reprojection)
+		{
+			applyReprojection();		
+		}
+		else // Transfer from ray data to bilinear interpolation data.
+		{
+			memcpy(_pixel_reprojected_buffer, _pixel_new_buffer, _pixel_count * sizeof(float3));
+		}
+
+		// Denoising.
+		if (_use_denoiser)
+		{
+			applyDenoising();
+		}
+		else // Transfer from bilinear interpolation data to pixel history data.
+		{
+			memcpy(_pixel_history_buffer, _pixel_reprojected_buffer, _pixel_count * sizeof(float3));
+		}
+
+		// Draw to screen.
+		{
 #if MULTI_THREADED
 #pragma omp parallel for schedule(dynamic)
 #endif
-		for (int y = 0; y < SCRHEIGHT; ++y)
-		{
-			const uint pitch{ static_cast<uint>(y * SCRWIDTH) };
+			for (int y = 0; y < _resolution.y; ++y)
 			{
-				switch (_use_accumulator)
+				const uint pitch{ static_cast<uint>(y * _resolution.x) };
+
+				for (int x = 0; x < _resolution.x; ++x)
 				{
-					case true:
-					{
-						for (int x = 0; x < SCRWIDTH; ++x)
-						{
-							const uint pixel_index{ x + pitch };
-
-							_accumulator[pixel_index] += _albedo_buffer[pixel_index] * _pixel_history_buffer[pixel_index];
-
-							float3 final_pixel = _accumulator[pixel_index] * inverse_accumulated_frames;
-							float3 tonemapped_pixel{ tonemap(final_pixel) };
-							screen->pixels[pixel_index] = float3_to_uint(tonemapped_pixel);
-						}
-
-
-						break;
-					}
-					case false:
-					{
-						for (int x = 0; x < SCRWIDTH; ++x)
-						{
-							const uint pixel_index{ x + pitch };
-
-							float3 final_pixel;
-							final_pixel = _albedo_buffer[pixel_index] * _pixel_history_buffer[pixel_index];
-
-							float3 tonemapped_pixel{ tonemap(final_pixel) };
-							screen->pixels[pixel_index] = float3_to_uint(tonemapped_pixel);
-						}
-
-						break;
-					}
-					
+					drawPixel(x + pitch, inverse_accumulated_frames);
 				}
 			}
 		}
+
+		// Upscale to the screen.
+		if (_use_upscaling)
+		{
+			applyUpscaling();
+		}
+	}
+
+	// This frame's history is what next frame reprojects from.
+	std::swap(_pixel_history_buffer, _pixel_previous_history_buffer);
+	_history_resolution = _resolution;
+
+	if (_use_upscaling)
+	{
+		std::swap(_upscale_history_buffer, _upscale_previous_history_buffer);
 	}
+	_is_upscale_history_valid = _use_upscaling;
 
 	// Display audio card.
 	showAudioCard(delta_time);
@@ -217,28 +251,212 @@ void Renderer::Tick(float delta_time)
 
 #ifdef _DEBUG
 	// Mark middle of screen with box.
-	screen->Box(_focal_point.x - 1, _focal_point.y - 1, _focal_point.x + 1, _focal_point.y + 1, 0xFFFFFF);
+	const int2 screen_focal_point{ make_int2(make_float2(_focal_point) * _output_per_trace) };
+	screen->Box(screen_focal_point.x - 1, screen_focal_point.y - 1, screen_focal_point.x + 1, screen_focal_point.y + 1, 0xFFFFFF);
 #endif
 
 	// Performance report - running average - ms, MRays/s
-	static float avg{ 10 };
-	static float alpha{ 1 };
-	avg = (1.0f - alpha) * avg + alpha * t.elapsed() * 1000.0f;
-	if (alpha > 0.05f)
+	_frame_time_average = (1.0f - _frame_time_alpha) * _frame_time_average + _frame_time_alpha * t.elapsed() * 1000.0f;
+	if (_frame_time_alpha > 0.05f)
 	{
-		alpha *= 0.5f;
+		_frame_time_alpha *= 0.5f;
 	}
 
-	float fps{ 1000.0f / avg };
-	float rps{ (SCRWIDTH * SCRHEIGHT) / avg };
-	printf("%5.2fms (%.1ffps) - %.1fMrays/s\n", avg, fps, rps / 1000);
+	float fps{ 1000.0f / _frame_time_average };
+	float rps{ _pixel_count / _frame_time_average };
+	printf("%5.2fms (%.1ffps) - %.1fMrays/s\n", _frame_time_average, fps, rps / 1000);
 }
 
 
 void Renderer::resetAccumulator()
 {
-	memset(_accumulator, 0, SCRWIDTH * SCRHEIGHT * sizeof(float3));
+	memset(_accumulator, 0, _pixel_count * sizeof(float3));
+	_frame_count = 0.0f;
+}
+
+
+// Reallocate every per-pixel buffer, the screen surface and the tile pipeline. Not safe while a frame is being traced.
+// The trace resolution is the requested one scaled by the render scale, and by the upscale ratio while upscaling.
+void Renderer::setResolution(const int2 resolution, const int tile_size)
+{
+	// Tiles are traced in 2x2 quads.
+	_tile_size = clamp(tile_size, _MIN_TILE_SIZE, _MAX_TILE_SIZE) & ~1;
+	_base_resolution = make_int2(clamp(resolution.x, _tile_size, _MAX_RESOLUTION), clamp(resolution.y, _tile_size, _MAX_RESOLUTION));
+
+	// Trace buffers are sized for a render scale of 1, so dynamic resolution only changes how much of them is used.
+	const int2 full_resolution{ getTraceResolution(_base_resolution, _tile_size, 1.0f) };
+	_pixel_capacity = full_resolution.x * full_resolution.y;
+
+	// Create buffers of aligned memory. Every frame writes to them, so running out of memory is fatal.
+	freeFrameBuffers();
+
+	const auto allocate_buffer{ [](const size_t size)
+	{
+		float3* buffer{ static_cast<float3*>(MALLOC64(size)) };
+		FATALERROR_IF(size > 0 && !buffer, "Could not allocate a frame buffer of %zu bytes.", size);
+
+		if (buffer) { memset(buffer, 0, size); }
+		return buffer;
+	} };
+
+	const size_t size_of_array3{ _pixel_capacity * sizeof(float3) };
+
+	_accumulator = allocate_buffer(size_of_array3);
+	_albedo_buffer = allocate_buffer(size_of_array3);
+	_pixel_new_buffer = allocate_buffer(size_of_array3);
+	_pixel_reprojected_buffer = allocate_buffer(size_of_array3);
+	_pixel_history_buffer = allocate_buffer(size_of_array3);
+	_pixel_previous_history_buffer = allocate_buffer(size_of_array3);
+
+	// Upscaling buffers are only allocated while upscaling. The upscaler outputs at the requested resolution.
+	const size_t size_of_output_array3{ _use_upscaling ? _base_resolution.x * _base_resolution.y * sizeof(float3) : 0 };
+
+	_pixel_color_buffer = allocate_buffer(_use_upscaling ? size_of_array3 : 0);
+	_upscale_history_buffer = allocate_buffer(size_of_output_array3);
+	_upscale_previous_history_buffer = allocate_buffer(size_of_output_array3);
+
+	_is_upscale_history_valid = false;
+	
+	_ray_buffer = new Ray[_pixel_capacity];
+	memset(_ray_buffer, 0, _pixel_capacity * sizeof(Ray));
+
 	_frame_count = 0.0f;
+
+	setTraceResolution(getTraceResolution(_base_resolution, _tile_size, _render_scale));
+
+	// The cleared history is as good at any resolution.
+	_history_resolution = _resolution;
+}
+
+
+// Change the trace resolution within the buffers of setResolution(), cheap enough for every dynamic resolution step.
+// Reprojection reads the history at the resolution it was written at, and accumulated frames are resampled, so neither starts over.
+// The upscale history keeps going as long as the output resolution stays the same.
+void Renderer::setTraceResolution(const int2 resolution)
+{
+	assert(resolution.x * resolution.y <= _pixel_capacity && "Trace resolution does not fit the frame buffers.");
+
+	const int2 previous_resolution{ _resolution };
+
+	_resolution = resolution;
+	_pixel_count = _resolution.x * _resolution.y;
+
+	// Upscaling outputs at the requested resolution. Otherwise the screen is traced as is, and the window stretches it.
+	_output_resolution = _use_upscaling ? _base_resolution : _resolution;
+	_output_pixel_count = _output_resolution.x * _output_resolution.y;
+	_output_per_trace = make_float2(_output_resolution) / make_float2(_resolution);
+	_trace_per_output = make_float2(_resolution) / make_float2(_output_resolution);
+
+	_screenf = make_float2(_resolution);
+	_midscreenf = _screenf * 0.5f;
+	_focal_point = _resolution >> 1;
+
+	// Trace resolutions are rounded to whole tiles on each axis, so their aspect drifts from step to step.
+	// The frustum takes the aspect of the image that is shown: the upscaled output while upscaling, the base resolution otherwise.
+	// Only the pixel grid follows the trace resolution.
+	const int2 frustum_resolution{ _use_upscaling ? _output_resolution : _base_resolution };
+	const float aspect_ratio{ static_cast<float>(frustum_resolution.x) / static_cast<float>(frustum_resolution.y) };
+	_camera.setResolution(_resolution, aspect_ratio);
+	_retired_camera.setResolution(_resolution, aspect_ratio);
+
+	// Nearest sampled, since the accumulator holds sums rather than colors.
+	if (_frame_count > 0.0f)
+	{
+		const std::vector<float3> previous_accumulator(_accumulator, _accumulator + previous_resolution.x * previous_resolution.y);
+
+		for (int y = 0; y < _resolution.y; ++y)
+		{
+			const int previous_y{ y * previous_resolution.y / _resolution.y };
+
+			for (int x = 0; x < _resolution.x; ++x)
+			{
+				const int previous_x{ x * previous_resolution.x / _resolution.x };
+				_accumulator[x + y * _resolution.x] = previous_accumulator[previous_x + previous_y * previous_resolution.x];
+			}
+		}
+	}
+
+	// The template picks up the new size and resizes its render target to match. The window stays the same size.
+	if (screen->width != _output_resolution.x || screen->height != _output_resolution.y)
+	{
+		delete screen;
+		screen = new Surface(_output_resolution.x, _output_resolution.y);
+	}
+
+	// Pipeline tiles are several tiles wide, so scheduling stays cheap next to the work of a task.
+	// Edge tiles are cut off by the screen.
+	_pipeline_tile_size = _tile_size * ((16 + _tile_size - 1) / _tile_size);
+	_pipeline_tiles.x = (_resolution.x + _pipeline_tile_size - 1) / _pipeline_tile_size;
+	_pipeline_tiles.y = (_resolution.y + _pipeline_tile_size - 1) / _pipeline_tile_size;
+	_pipeline_tile_count = _pipeline_tiles.x * _pipeline_tiles.y;
+
+	// Every tile starts the pipeline at the trace stage.
+	_tile_dependencies = std::make_unique<std::atomic<int>[]>((_TILE_STAGE_COUNT - 1) * _pipeline_tile_count);
+	_pipeline_tasks.resize(_pipeline_tile_count);
+	for (int tile = 0; tile < _pipeline_tile_count; ++tile)
+	{
+		_pipeline_tasks[tile] = static_cast<uint>(tile * _TILE_STAGE_COUNT) + static_cast<uint>(TileStage::TRACE);
+	}
+
+	// The old average measured the old resolution.
+	_frame_time_alpha = 1.0f;
+}
+
+
+// Frame time is roughly proportional to the pixel count, so the scale moves by the square root of how far off budget the average is.
+void Renderer::updateDynamicResolution()
+{
+	// Wait until the average has settled since the last change. Otherwise every change chases the spike of the one before.
+	if (_frame_time_alpha > 0.05f)
+	{
+		return;
+	}
+
+	// Dead band around the target, so the resolution does not hop back and forth across it.
+	const float budget_ratio{ _target_frame_time / _frame_time_average };
+	if (budget_ratio > 0.95f && budget_ratio < 1.25f)
+	{
+		return;
+	}
+
+	const float render_scale{ clamp(_render_scale * sqrtf(budget_ratio), _min_render_scale, 1.0f) };
+
+	// Clamped, or too small a step to change the number of tiles.
+	const int2 resolution{ getTraceResolution(_base_resolution, _tile_size, render_scale) };
+	if (resolution.x == _resolution.x && resolution.y == _resolution.y)
+	{
+		return;
+	}
+
+	_render_scale = render_scale;
+	setTraceResolution(resolution);
+}
+
+
+// Whole tiles, so the screen can be traced tile by tile. The aspect may differ slightly from the output's, see setTraceResolution().
+int2 Renderer::getTraceResolution(const int2 output_resolution, const int tile_size, const float render_scale) const
+{
+	const float trace_scale{ render_scale * (_use_upscaling ? _upscale_ratio : 1.0f) };
+	const int2 resolution{ make_int2(make_float2(output_resolution) * trace_scale) };
+
+	return make_int2(max(tile_size, resolution.x - resolution.x % tile_size), max(tile_size, resolution.y - resolution.y % tile_size));
+}
+
+
+void Renderer::freeFrameBuffers()
+{
+	FREE64(_accumulator);
+	FREE64(_albedo_buffer);
+	FREE64(_pixel_new_buffer);
+	FREE64(_pixel_reprojected_buffer);
+	FREE64(_pixel_history_buffer);
+	FREE64(_pixel_previous_history_buffer);
+	FREE64(_pixel_color_buffer);
+	FREE64(_upscale_history_buffer);
+	FREE64(_upscale_previous_history_buffer);
+
+	delete[] _ray_buffer;
+	_ray_buffer = nullptr;
 }
 
 
@@ -260,18 +478,12 @@ void Renderer::shootErasureRays(float2 coordinates[])
 
 void Renderer::shootPrimaryRays()
 {
-	static uint air_material{ 0 };
-
-	// Get subpixel position for this frame.
-	float2 subpixel_offset{ 0.0f, 0.0f };
-	if (_use_antialiasing)
-	{
-		subpixel_offset = _subpixel_positions[_offset_index];
-		_offset_index = (_offset_index + 1) % _HALTON_SAMPLE_SIZE;
-	}
+	const float2 subpixel_offset{ getSubpixelOffset() };
 
 #if _DEBUG
-	int pixel_index{ _focal_point.x + _focal_point.y * SCRWIDTH };
+	static uint air_material{ 0 };
+
+	int pixel_index{ _focal_point.x + _focal_point.y * _resolution.x };
 
 	Ray debug_ray = _camera.getPickingRay(make_float2(_focal_point), air_material);
 
@@ -285,132 +497,803 @@ void Renderer::shootPrimaryRays()
 #if MULTI_THREADED
 #pragma omp parallel for schedule(dynamic)
 #endif
-	for (int y = 0; y < SCRHEIGHT; y += TILE_SIZE)
+	for (int y = 0; y < _resolution.y; y += _tile_size)
+	{
+		for (int x = 0; x < _resolution.x; x += _tile_size)
+		{
+			traceTile(x, y, subpixel_offset);
+		}
+	}
+#endif
+}
+
+
+void Renderer::traceTile(const int x, const int y, const float2& subpixel_offset)
+{
+	static uint air_material{ 0 };
+
+	// Tiles are traced in 2x2 quads, so neighboring rays can travel the TLAS/BLAS's as a packet.
+	for (int v = 0; v < _tile_size; v += 2)
 	{
-		for (int x = 0; x < SCRWIDTH; x += TILE_SIZE)
+		for (int u = 0; u < _tile_size; u += 2)
 		{
-			for (int v = 0; v < TILE_SIZE; ++v)
+			Ray rays[4];
+			uint pixel_indices[4];
+
+			for (int i = 0; i < 4; ++i)
 			{
-				const int py{ y + v };
-				const uint pitch{ static_cast<uint>(py * SCRWIDTH) };
+				const int px{ x + u + (i & 1) };
+				const int py{ y + v + (i >> 1) };
 
-				for (int u = 0; u < TILE_SIZE; ++u)
-				{
-					const int px{ x + u };
-					uint pixel_index{ px + pitch };
+				pixel_indices[i] = static_cast<uint>(px + py * _resolution.x);
+				rays[i] = _camera.getPrimaryRay(make_float2(px + subpixel_offset.x, py + subpixel_offset.y), air_material);
+			}
 
-					Ray ray{ _camera.getPrimaryRay(make_float2(px + subpixel_offset.x, py + subpixel_offset.y), air_material) };
-					TraceRecord record{ trace(ray, _max_depth) };
+			if (_use_packets)
+			{
+				scene.findNearest4(rays);
+			}
 
-					//if (ray._distance_underwater > 0.0f)
-					{
-						// Apply Beer's Law. Use distance underwater to determine absorption amount.
-						float3 beers_absorbance{ getAbsorption(scene._triangles[0]._data, ray._distance_underwater) };
+			for (int i = 0; i < 4; ++i)
+			{
+				Ray& ray{ rays[i] };
+				TraceRecord record{ _use_packets ? shade(ray, _max_depth) : trace(ray, _max_depth) };
 
-						record._light = record._light * beers_absorbance;
-					}
+				//if (ray._distance_underwater > 0.0f)
+				{
+					// Apply Beer's Law. Use distance underwater to determine absorption amount.
+					float3 beers_absorbance{ getAbsorption(scene._triangles[0]._data, ray._distance_underwater) };
 
-					_albedo_buffer[pixel_index] = record._albedo;
-					_ray_buffer[pixel_index] = ray;
-					_pixel_new_buffer[pixel_index] = record._light;
+					record._light = record._light * beers_absorbance;
 				}
+
+				_albedo_buffer[pixel_indices[i]] = record._albedo;
+				_ray_buffer[pixel_indices[i]] = ray;
+				_pixel_new_buffer[pixel_indices[i]] = record._light;
 			}
 		}
 	}
-#endif
 }
 
 
-void Renderer::applyReprojection()
+float2 Renderer::getSubpixelOffset()
 {
-#if MULTI_THREADED
-#pragma omp parallel for schedule(dynamic)
-#endif
+	// Get subpixel position for this frame. The upscaler needs the jitter to see between trace pixels.
+	float2 subpixel_offset{ 0.0f, 0.0f };
+	if (_use_antialiasing || _use_upscaling)
+	{
+		subpixel_offset = _subpixel_positions[_offset_index];
+		_offset_index = (_offset_index + 1) % _HALTON_SAMPLE_SIZE;
+	}
 
-#ifdef _DEBUG
-#define EARLYOUT return
+	// Kept for the upscaler, which weighs each sample by where in its pixel it was traced.
+	_frame_subpixel_offset = subpixel_offset;
+
+	return subpixel_offset;
+}
+
+
+// -----------------------------------------------------------
+// Wavefront path tracing
+// Generate -> extend -> sort by material -> shade -> trace shadow rays and connect -> retire.
+// Each stage runs over all live paths before the next one starts.
+// -----------------------------------------------------------
+void Renderer::traceWavefront()
+{
+	if (_paths.empty())
 	{
-		{
-			int y{ _focal_point.y };
-			int x{ _focal_point.x };
-			const int pixel_index{ x + y * SCRWIDTH };
-#else
-#define EARLYOUT continue
-	for (int y = 0; y < SCRHEIGHT; ++y)
+		_paths.resize(_WAVEFRONT_CAPACITY);
+		_path_bins.resize(_WAVEFRONT_CAPACITY);
+		_path_queue.resize(_WAVEFRONT_CAPACITY);
+		_sorted_path_queue.resize(_WAVEFRONT_CAPACITY);
+		_shadow_queue.resize(_WAVEFRONT_CAPACITY);
+	}
+
+	const float2 subpixel_offset{ getSubpixelOffset() };
+
+	// Every split can double the paths of a pixel, so a batch only takes as many tiles as fit when all of them split.
+	// Splits are counted up to what still fits one tile. Beyond that, reservePath() turns the splits that do not fit into stochastic choices.
+	static_assert(_MAX_TILE_SIZE * _MAX_TILE_SIZE <= _WAVEFRONT_CAPACITY, "A tile must fit the path pool.");
+
+	const int paths_per_tile{ _tile_size * _tile_size };
+	const int tile_count{ (_resolution.x / _tile_size) * (_resolution.y / _tile_size) };
+
+	int split_count{ _split_on_first_hit ? min(_parallel_depth, _max_depth) : 0 };
+	while (split_count > 0 && (paths_per_tile << split_count) > _WAVEFRONT_CAPACITY)
+	{
+		--split_count;
+	}
+
+	const int tiles_per_batch{ _WAVEFRONT_CAPACITY / (paths_per_tile << split_count) };
+
+	for (int first_tile = 0; first_tile < tile_count; first_tile += tiles_per_batch)
 	{
-		const int pitch{ y * SCRWIDTH };
+		int queue_size{ generatePaths(first_tile, min(tiles_per_batch, tile_count - first_tile), subpixel_offset) };
 
-		for (int x = 0; x < SCRWIDTH; ++x)
+		for (bool is_primary = true; queue_size > 0; is_primary = false)
 		{
-			const int pixel_index{ x + pitch };
+			extendPaths(queue_size, is_primary);
+			sortPaths(queue_size);
+
+			const uint first_spawned_path{ _path_count };
+			shadePaths(queue_size);
+			connectShadowRays();
+
+			queue_size = retirePaths(queue_size, first_spawned_path);
+		}
+	}
+}
+
+
+int Renderer::generatePaths(const int first_tile, const int tile_count, const float2& subpixel_offset)
+{
+	static uint air_material{ 0 };
+
+	const int tiles_per_row{ _resolution.x / _tile_size };
+	const int paths_per_tile{ _tile_size * _tile_size };
+
+#if MULTI_THREADED
+#pragma omp parallel for schedule(dynamic)
 #endif
-			float3& new_sample{ _pixel_new_buffer[pixel_index] };
-			Ray& new_ray{ _ray_buffer[pixel_index] };
+	for (int tile = 0; tile < tile_count; ++tile)
+	{
+		const int x{ ((first_tile + tile) % tiles_per_row) * _tile_size };
+		const int y{ ((first_tile + tile) / tiles_per_row) * _tile_size };
+		uint path_index{ static_cast<uint>(tile * paths_per_tile) };
 
-			// Get pixel position last frame (in UV coordinates).
-			float2 old_uv;
+		// Same 2x2 quads as shootPrimaryRays(), so extendPaths() can trace them as packets.
+		for (int v = 0; v < _tile_size; v += 2)
+		{
+			for (int u = 0; u < _tile_size; u += 2)
 			{
-				// First, determine if the point has history.
-				float3 new_point{ new_ray.IntersectionPoint() };
-				
-				float3 old_camera_to_new_point{ new_point - _retired_camera._position };
-				static float safe_zone_padding{ 0.001f }; // We do not want the ray to collide with the point in question.
-				Ray old_ray{ _retired_camera._position, old_camera_to_new_point, length(old_camera_to_new_point) - safe_zone_padding, false };
-				
-				if (new_ray.t == Ray::t_max) // || scene.isOccluded(old_ray))
+				for (int i = 0; i < 4; ++i, ++path_index)
 				{
-					// This is the skydome, or we did not see this point last frame - discard history and start fresh.
-					_pixel_reprojected_buffer[pixel_index] = new_sample;
-					EARLYOUT;
+					const int px{ x + u + (i & 1) };
+					const int py{ y + v + (i >> 1) };
+
+					PathState& path{ _paths[path_index] };
+					path = PathState{};
+					path._ray = _camera.getPrimaryRay(make_float2(px + subpixel_offset.x, py + subpixel_offset.y), air_material);
+					path._pixel_index = static_cast<uint>(px + py * _resolution.x);
+					path._depth = _max_depth;
+
+					// The whole pixel goes through Beer's law for the distance its path travels underwater, see shootPrimaryRays().
+					path._absorber = scene._triangles[0]._data;
+
+					_path_queue[path_index] = path_index;
+					_pixel_new_buffer[path._pixel_index] = 0.0f;
 				}
+			}
+		}
+	}
+
+	const int path_count{ tile_count * paths_per_tile };
+	_path_count = path_count;
+
+	return path_count;
+}
+
+
+void Renderer::extendPaths(const int queue_size, const bool is_primary)
+{
+	// Primary paths are still in quad order.
+	if (is_primary && _use_packets)
+	{
+#if MULTI_THREADED
+#pragma omp parallel for schedule(dynamic, 16)
+#endif
+		for (int i = 0; i < queue_size; i += 4)
+		{
+			Ray rays[4];
+			for (int j = 0; j < 4; ++j)
+			{
+				rays[j] = _paths[i + j]._ray;
+			}
+
+			scene.findNearest4(rays);
+
+			for (int j = 0; j < 4; ++j)
+			{
+				_paths[i + j]._ray = rays[j];
+			}
+		}
+	}
+	else
+	{
+#if MULTI_THREADED
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+		for (int i = 0; i < queue_size; ++i)
+		{
+			scene.findNearest(_paths[_path_queue[i]]._ray);
+		}
+	}
+
+	// Rays that left the world get a bin of their own.
+#if MULTI_THREADED
+#pragma omp parallel for schedule(static)
+#endif
+	for (int i = 0; i < queue_size; ++i)
+	{
+		const Ray& ray{ _paths[_path_queue[i]]._ray };
+		_path_bins[i] = static_cast<uchar>(ray.t < Ray::t_max ? MaterialList::GetType(ray._hit_data) : MaterialType::COUNT);
+	}
+}
+
+
+// Counting sort on material type, so paths running the same shader are shaded one after another.
+void Renderer::sortPaths(const int queue_size)
+{
+	uint bin_offsets[MaterialType::COUNT + 1]{};
+
+	for (int i = 0; i < queue_size; ++i)
+	{
+		++bin_offsets[_path_bins[i]];
+	}
+
+	uint offset{ 0 };
+	for (uint& bin_offset : bin_offsets)
+	{
+		const uint bin_size{ bin_offset };
+		bin_offset = offset;
+		offset += bin_size;
+	}
+
+	for (int i = 0; i < queue_size; ++i)
+	{
+		_sorted_path_queue[bin_offsets[_path_bins[i]]++] = _path_queue[i];
+	}
+}
+
+
+void Renderer::shadePaths(const int queue_size)
+{
+	_shadow_count = 0;
+
+#if MULTI_THREADED
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+	for (int i = 0; i < queue_size; ++i)
+	{
+		shadePath(_sorted_path_queue[i]);
+	}
+}
+
+
+void Renderer::connectShadowRays()
+{
+	const int shadow_count{ min(static_cast<int>(_shadow_count), _WAVEFRONT_CAPACITY) };
+
+#if MULTI_THREADED
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+	for (int i = 0; i < shadow_count; ++i)
+	{
+		const ShadowRequest& request{ _shadow_queue[i] };
+		PathState& path{ _paths[request._path_index] };
+
+		TintData tint_data{};
+		Ray shadow_ray{ Light::getShadowRay(request._origin, request._light_sample) };
+		const bool is_visible{ !scene.isOccluded(shadow_ray, tint_data) };
+
+		// Tint light using absorbance (Beer's Law). Like getNonMetalIntersectionResult(), the tint also covers the light further along the path.
+		if (tint_data._voxel)
+		{
+			path._throughput *= getAbsorption(tint_data._voxel, tint_data._distance);
+		}
+
+		if (is_visible)
+		{
+			path._pending_light += path._throughput * request._light_sample._illumination;
+		}
+	}
+}
+
+
+// Hand the light of finished paths to their pixels and queue the rest for the next bounce.
+int Renderer::retirePaths(const int queue_size, const uint first_spawned_path)
+{
+	// Paths split off during this bounce follow the sorted queue.
+	const int processed_count{ queue_size + static_cast<int>(_path_count - first_spawned_path) };
+	auto getPathIndex = [this, queue_size, first_spawned_path](const int i)
+	{
+		return i < queue_size ? _sorted_path_queue[i] : first_spawned_path + static_cast<uint>(i - queue_size);
+	};
+
+#if MULTI_THREADED
+#pragma omp parallel for schedule(dynamic, 64)
+#endif
+	for (int i = 0; i < processed_count; ++i)
+	{
+		PathState& path{ _paths[getPathIndex(i)] };
+
+		if (path._is_finished)
+		{
+			absorbPendingLight(path);
+		}
+	}
+
+	// Serial, since split paths of the same pixel can finish during the same bounce.
+	int next_queue_size{ 0 };
+	for (int i = 0; i < processed_count; ++i)
+	{
+		const uint path_index{ getPathIndex(i) };
+		const PathState& path{ _paths[path_index] };
+
+		if (path._is_finished)
+		{
+			_pixel_new_buffer[path._pixel_index] += path._light;
+		}
+		else
+		{
+			_path_queue[next_queue_size++] = path_index;
+		}
+	}
+
+	return next_queue_size;
+}
+
+
+void Renderer::shadePath(const uint path_index)
+{
+	PathState& path{ _paths[path_index] };
+	const bool is_primary{ path._depth == _max_depth };
+
+	// Shaders replace the path's ray with the next one, so they get a copy of the ray that hit.
+	Ray incident_ray{ path._ray };
+
+	if (incident_ray.t < Ray::t_max)
+	{
+		switch (MaterialList::GetType(incident_ray._hit_data))
+		{
+		case MaterialType::NON_METAL:
+			shadeNonMetalPath(path_index, incident_ray);
+			break;
+		case MaterialType::METAL:
+			shadeMetalPath(path_index, incident_ray);
+			break;
+		case MaterialType::GLASS:
+			shadeDielectricPath(path_index, incident_ray);
+			break;
+		case MaterialType::WATER:
+			shadeWaterPath(path_index, incident_ray);
+			break;
+		case MaterialType::EMISSIVE:
+			addSegmentUnderwater(path, incident_ray);
+			applyAlbedo(path, Ray::getAlbedo(incident_ray._hit_data));
+			path._pending_light += path._throughput * scene._material_list[MaterialList::GetIndex(incident_ray._hit_data)]._emissive_intensity;
+			path._is_finished = true;
+			break;
+		default:
+			addSegmentUnderwater(path, incident_ray);
+			applyAlbedo(path, 0.0f);
+			path._is_finished = true;
+			break;
+		}
+	}
+	// If no material found (meaning outside of world), add the sky color.
+	else
+	{
+		addSegmentUnderwater(path, incident_ray);
+		applyAlbedo(path, 1.0f * _world_side_modifier);
+		path._pending_light += path._throughput * scene._skydome.GetColor(incident_ray);
+		path._is_finished = true;
+	}
+
+	// Reprojection and denoising read the primary hit.
+	if (is_primary)
+	{
+		_ray_buffer[path._pixel_index] = incident_ray;
+	}
+}
+
+
+void Renderer::shadeNonMetalPath(const uint path_index, Ray& incident_ray)
+{
+	PathState& path{ _paths[path_index] };
+	addSegmentUnderwater(path, incident_ray);
+
+	float3 ray_dir_normalized{ normalize(incident_ray.D) };
+
+	float cos_theta{ min(dot(-ray_dir_normalized, incident_ray.normal), 1.0f) };
+	float reflect_chance{ getFresnelReflectance(cos_theta) };
+
+	uint split_index;
+	if (_split_on_first_hit && (_max_depth - path._depth + 1) <= _parallel_depth && reservePath(split_index))
+	{
+		applyAlbedo(path, 1.0f);
+
+		// This path takes the reflected ray, the split off path the scattered ray and the direct illumination.
+		const uint scattered_index{ splitPath(path, split_index) };
+		PathState& scattered_path{ _paths[scattered_index] };
+
+		path._throughput *= reflect_chance;
+		continuePath(path, getReflectedRay(incident_ray, incident_ray.normal));
+
+		scattered_path._throughput *= Ray::getAlbedo(incident_ray._hit_data) * (1.0f - reflect_chance);
+		continuePath(scattered_path, getScatteredRay(incident_ray, incident_ray.normal));
+		requestShadowRay(scattered_index, incident_ray);
+	}
+	else
+	{
+		applyAlbedo(path, Ray::getAlbedo(incident_ray._hit_data));
+
+		// Determine reflectance using Schlick Approximation (Fresnel).
+		if (reflect_chance > RandomFloat())
+		{
+			Ray reflected_ray{ getReflectedRay(incident_ray, incident_ray.normal) };
+			reflected_ray._dielectric_indicator = incident_ray._dielectric_indicator;
+
+			path._throughput *= reflect_chance;
+			continuePath(path, reflected_ray);
+		}
+		else
+		{
+			Ray scattered_ray{ getScatteredRay(incident_ray, incident_ray.normal) };
+			scattered_ray._dielectric_indicator = incident_ray._dielectric_indicator;
+
+			path._throughput *= 1.0f - reflect_chance;
+			continuePath(path, scattered_ray);
+			requestShadowRay(path_index, incident_ray);
+		}
+	}
+}
+
+
+void Renderer::shadeMetalPath(const uint path_index, Ray& incident_ray)
+{
+	PathState& path{ _paths[path_index] };
+	addSegmentUnderwater(path, incident_ray);
+	applyAlbedo(path, Ray::getAlbedo(incident_ray._hit_data));
+
+	Ray reflected_ray{ getReflectedRay(incident_ray, incident_ray.normal) };
+	reflected_ray._dielectric_indicator = incident_ray._dielectric_indicator;
+	continuePath(path, reflected_ray);
+}
+
+
+void Renderer::shadeDielectricPath(const uint path_index, Ray& incident_ray)
+{
+	PathState& path{ _paths[path_index] };
+	bool is_exiting_material{ static_cast<bool>(incident_ray.getGlassIndicator()) };
+
+	// Find the exit if inside material, see getDielectricIntersectionResult().
+	if (is_exiting_material)
+	{
+		scene.findMaterialExit(incident_ray, MaterialList::GetType(incident_ray._src_data));
+
+		static uint underwater_hit_data{ scene._triangles[0]._data };
+		incident_ray._hit_data = underwater_hit_data * (incident_ray.IntersectionPoint().y < scene._WATERLINE);
+	}
+
+	// Counted after the exit is found. trace()'s caller reads the ray's length once the whole ray is resolved.
+	addSegmentUnderwater(path, incident_ray);
+
+	// Index of refraction based on the material the ray started in and the new material that was hit.
+	float ior_ratio{ scene._material_list[MaterialList::GetIndex(incident_ray._src_data)]._index_of_refraction
+		/ scene._material_list[MaterialList::GetIndex(incident_ray._hit_data)]._index_of_refraction };
+
+	// Angle of intersection between the ray and hit material.
+	float3 ray_dir_normalized{ normalize(incident_ray.D) };
+	float cos_theta = fminf(dot(-ray_dir_normalized, incident_ray.normal), 1.0f);
+
+	float reflect_chance{ getFresnelReflectance(cos_theta, ior_ratio) };
+
+	// USE BOTH RAY RESULTS IN SAME FRAME.
+	uint split_index;
+	if (_split_on_first_hit && (_max_depth - path._depth + 1) <= _parallel_depth && reservePath(split_index))
+	{
+		applyAlbedo(path, Ray::getAlbedo(incident_ray._hit_data) * reflect_chance + (1.0f - reflect_chance));
+
+		const uint refracted_index{ splitPath(path, split_index) };
+		PathState& refracted_path{ _paths[refracted_index] };
+
+		Ray reflected_ray{ getReflectedRay(incident_ray, incident_ray.normal) };
+		reflected_ray._dielectric_indicator = incident_ray._dielectric_indicator;
+
+		path._throughput *= reflect_chance;
+		continuePath(path, reflected_ray);
+
+		Ray refracted_ray{ getRefractedRay(incident_ray, incident_ray.normal, ior_ratio, cos_theta) };
+		refracted_ray.setWaterIndicator(refracted_ray.O.y < scene._WATERLINE);
+		refracted_ray.setGlassIndicator(!is_exiting_material);
+
+		refracted_path._throughput *= (1.0f - reflect_chance) * (is_exiting_material ? getAbsorption(incident_ray._src_data, incident_ray.t) : 1.0f);
+		continuePath(refracted_path, refracted_ray);
+	}
+
+	// USE ONLY 1 RAY RESULT (STOCHASTIC SELECTION) FOR THE FRAME.
+	else
+	{
+		applyAlbedo(path, 1.0f);
+
+		// Reflect.
+		if (cannotRefract(cos_theta, ior_ratio) || reflect_chance > RandomFloat())
+		{
+			Ray reflected_ray{ getReflectedRay(incident_ray, incident_ray.normal) };
+			reflected_ray._dielectric_indicator = incident_ray._dielectric_indicator;
+			continuePath(path, reflected_ray);
+		}
+
+		// Refract.
+		else
+		{
+			Ray refracted_ray{ getRefractedRay(incident_ray, incident_ray.normal, ior_ratio, cos_theta) };
+
+			// Leaving. Beer's Law over the distance travelled inside the material.
+			if (is_exiting_material)
+			{
+				refracted_ray.setWaterIndicator(refracted_ray.O.y < scene._WATERLINE);
+				refracted_ray.setGlassIndicator(false);
+				path._throughput *= getAbsorption(incident_ray._src_data, incident_ray.t);
+			}
+
+			// Entering.
+			else
+			{
+				refracted_ray.setWaterIndicator(false);
+				refracted_ray.setGlassIndicator(true);
+			}
+
+			continuePath(path, refracted_ray);
+		}
+	}
+}
+
+
+void Renderer::shadeWaterPath(const uint path_index, Ray& incident_ray)
+{
+	PathState& path{ _paths[path_index] };
+	addSegmentUnderwater(path, incident_ray);
+
+	// Index of refraction based on the material the ray started in and the new material that was hit.
+	float ior_ratio{ scene._material_list[MaterialList::GetIndex(incident_ray._src_data)]._index_of_refraction
+		/ scene._material_list[MaterialList::GetIndex(incident_ray._hit_data)]._index_of_refraction };
+
+	// Angle of intersection between the ray and hit material.
+	float3 ray_dir_normalized{ normalize(incident_ray.D) };
+	float cos_theta = fminf(dot(-ray_dir_normalized, incident_ray.normal), 1.0f);
+
+	// Chance of Fresnel refleaction.
+	float reflect_chance{ getFresnelReflectance(cos_theta, ior_ratio) };
+
+	// USE BOTH RAY RESULTS IN SAME FRAME.
+	uint split_index;
+	if (_split_on_first_hit && (_max_depth - path._depth + 1) <= _parallel_depth && reservePath(split_index))
+	{
+		applyAlbedo(path, Ray::getAlbedo(incident_ray._hit_data) * reflect_chance + (1.0f - reflect_chance));
+
+		const uint refracted_index{ splitPath(path, split_index) };
+		PathState& refracted_path{ _paths[refracted_index] };
+
+		Ray reflected_ray{ getReflectedRay(incident_ray, incident_ray.normal) };
+		reflected_ray._dielectric_indicator = incident_ray._dielectric_indicator;
+
+		path._throughput *= reflect_chance;
+		continuePath(path, reflected_ray);
+
+		Ray refracted_ray{ getRefractedRay(incident_ray, incident_ray.normal, ior_ratio, cos_theta) };
+		refracted_ray.setWaterIndicator(true);
+
+		// Coming from above, the refracted light goes through Beer's law for its own distance underwater.
+		// getWaterIntersectionResult() adds the reflected ray's distance as well, which is left out here since the paths no longer meet.
+		refracted_path._throughput *= 1.0f - reflect_chance;
+		refracted_path._absorber = incident_ray.getWaterIndicator() == 0 ? incident_ray._hit_data : 0;
+		continuePath(refracted_path, refracted_ray);
+
+		return;
+	}
+
+	applyAlbedo(path, 1.0f);
+
+	// Reflect.
+	if (cannotRefract(cos_theta, ior_ratio) || reflect_chance > RandomFloat())
+	{
+		Ray reflected_ray{ getReflectedRay(incident_ray, incident_ray.normal) };
+		reflected_ray._dielectric_indicator = incident_ray._dielectric_indicator;
+		continuePath(path, reflected_ray);
+	}
+
+	// Enter/Exit material via refraction.
+	else
+	{
+		Ray refracted_ray{ getRefractedRay(incident_ray, incident_ray.normal, ior_ratio, cos_theta) };
+
+		// Leaving water.
+		if (incident_ray.getWaterIndicator())
+		{
+			refracted_ray.setWaterIndicator(false);
+		}
+
+		// Entering water. Everything the refracted ray goes on to find goes through Beer's law for the distance it travels underwater.
+		else
+		{
+			refracted_ray.setWaterIndicator(true);
+
+			absorbPendingLight(path);
+			path._absorber = incident_ray._hit_data;
+		}
+
+		continuePath(path, refracted_ray);
+	}
+}
+
+
+// The primary hit's albedo goes to the albedo buffer. Further along, it scales the light like TraceRecord::getResult() does.
+void Renderer::applyAlbedo(PathState& path, const float3& albedo)
+{
+	if (path._depth == _max_depth)
+	{
+		_albedo_buffer[path._pixel_index] = albedo;
+	}
+	else
+	{
+		path._throughput *= albedo;
+	}
+}
+
+
+// Same sum the recursive shaders build in Ray::_distance_underwater. Every ray after the primary one adds its length underwater, at most 1.
+void Renderer::addSegmentUnderwater(PathState& path, Ray& ray)
+{
+	if (path._depth < _max_depth)
+	{
+		path._distance_underwater += min(1.0f, ray.t * ray.getWaterIndicator());
+	}
+}
+
+
+// End the current stretch underwater. Its Beer's law applies to the light gathered during it, and to all light found after it.
+void Renderer::absorbPendingLight(PathState& path)
+{
+	if (path._absorber && path._distance_underwater > 0.0f)
+	{
+		const float3 beers_absorbance{ getAbsorption(path._absorber, path._distance_underwater) };
+
+		path._pending_light *= beers_absorbance;
+		path._throughput *= beers_absorbance;
+	}
+
+	path._light += path._pending_light;
+	path._pending_light = 0.0f;
+	path._distance_underwater = 0.0f;
+	path._absorber = 0;
+}
+
+
+// Give the path its next ray, as trace(ray, depth - 1) would get it.
+void Renderer::continuePath(PathState& path, const Ray& ray)
+{
+	path._ray = ray;
+	--path._depth;
+
+	// trace() returns nothing at depth 0, and the untraced ray keeps t_max.
+	if (path._depth == 0)
+	{
+		addSegmentUnderwater(path, path._ray);
+		path._is_finished = true;
+	}
+}
+
+
+// Claim a slot for a split path. False once the pool is full, and the shader takes its stochastic branch instead.
+bool Renderer::reservePath(uint& path_index)
+{
+	path_index = _path_count;
+	do
+	{
+		if (path_index >= _WAVEFRONT_CAPACITY)
+		{
+			return false;
+		}
+	} while (!_path_count.compare_exchange_weak(path_index, path_index + 1));
+
+	return true;
+}
+
+
+// Copy the path for the second ray of a split into a slot from reservePath(). From here on both are traced on their own, and add up in the pixel.
+// The recursive shaders do not hand distance underwater back up through a split, so the current stretch ends here.
+uint Renderer::splitPath(PathState& path, const uint split_index)
+{
+	absorbPendingLight(path);
+
+	PathState& split_path{ _paths[split_index] };
+	split_path = path;
+	split_path._light = 0.0f;
+
+	return split_index;
+}
+
+
+void Renderer::requestShadowRay(const uint path_index, const Ray& incident_ray)
+{
+	LightSample light_sample;
+	if (scene._light_list.sample(incident_ray, incident_ray.normal, light_sample))
+	{
+		// Every shaded path asks for one shadow ray at most, so the queue only fills up if that changes.
+		const uint shadow_index{ _shadow_count++ };
+		if (shadow_index < _WAVEFRONT_CAPACITY)
+		{
+			_shadow_queue[shadow_index] = ShadowRequest{ incident_ray.IntersectionPoint(), path_index, light_sample };
+		}
+	}
+}
+
+
+void Renderer::applyReprojection()
+{
+#ifdef _DEBUG
+	reprojectPixel(_focal_point.x, _focal_point.y);
+#else
+
+#if MULTI_THREADED
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int y = 0; y < _resolution.y; ++y)
+	{
+		for (int x = 0; x < _resolution.x; ++x)
+		{
+			reprojectPixel(x, y);
+		}
+	}
+#endif
+}
 
-				// Second, get the pixel's old UV position.
-				float3 old_ray_direction_normalized{ normalize(old_ray.D) };
 
-				const float distance_from_top{ dot(old_ray_direction_normalized, _retired_camera._top_normal) };
-				const float distance_from_left{ dot(old_ray_direction_normalized, _retired_camera._left_normal) };
-				const float distance_from_right{ dot(old_ray_direction_normalized, _retired_camera._right_normal) };
-				const float distance_from_bottom{ dot(old_ray_direction_normalized, _retired_camera._bottom_normal) };
+void Renderer::reprojectPixel(const int x, const int y)
+{
+	const int pixel_index{ x + y * _resolution.x };
 
-				old_uv.x = distance_from_left / (distance_from_left + distance_from_right);
-				old_uv.y = distance_from_top / (distance_from_top + distance_from_bottom);
+	float3& new_sample{ _pixel_new_buffer[pixel_index] };
+	Ray& new_ray{ _ray_buffer[pixel_index] };
 
-				if (old_uv.x < 0 || old_uv.x >= 1.0f || old_uv.y < 0 || old_uv.y >= 1.0f)
-				{
-					// Old position was not in view frustrum last frame - it has no history.
-					_pixel_reprojected_buffer[pixel_index] = new_sample;
-					EARLYOUT;
-				}
-			}
+	// Get pixel position last frame (in UV coordinates).
+	float2 old_uv;
+	{
+		// First, determine if the point has history.
+		if (new_ray.t == Ray::t_max) // || scene.isOccluded(old_ray))
+		{
+			// This is the skydome, or we did not see this point last frame - discard history and start fresh.
+			_pixel_reprojected_buffer[pixel_index] = new_sample;
+			return;
+		}
 
-			// Must do weird rounding to prevent "pixel drift" where then wrong history pixel is sampled.
-			float2 history_pixel_position{ ((old_uv.x * SCRWIDTH) + 0.5f), ((old_uv.y * SCRHEIGHT) + 0.5f) };
-			
-			// Get the history sample (after appling bilinear interpolation to it).
-			float3 history_sample{ getHistorySample(history_pixel_position)};			
+		// Second, get the pixel's old UV position.
+		if (!findPreviousUV(new_ray.IntersectionPoint() - _retired_camera._position, old_uv))
+		{
+			// Old position was not in view frustrum last frame - it has no history.
+			_pixel_reprojected_buffer[pixel_index] = new_sample;
+			return;
+		}
+	}
 
-			// Clamp sample.
-			applyColorClamping(history_sample, new_sample, { x, y });
+	// Must do weird rounding to prevent "pixel drift" where then wrong history pixel is sampled.
+	float2 history_pixel_position{ ((old_uv.x * _history_resolution.x) + 0.5f), ((old_uv.y * _history_resolution.y) + 0.5f) };
+	
+	// Get the history sample (after appling bilinear interpolation to it).
+	float3 history_sample{ getHistorySample(history_pixel_position, _pixel_previous_history_buffer, _history_resolution) };
 
-			// Mix new sample and history sample.
-			// [Credit] Lynn-inspired.
-			float history_weight{ 0.9f };
-			switch (MaterialList::GetType(new_ray._hit_data))
-			{
-			case MaterialType::GLASS:
-			case MaterialType::WATER:
-				history_weight = 0.1f;
-				break;
-			case MaterialType::NON_METAL:
-				history_weight = 0.99f;
-				break;
-			default:
-				break;
-			}
+	// Clamp sample.
+	applyColorClamping(history_sample, new_sample, { x, y }, _pixel_new_buffer);
 
-			_pixel_reprojected_buffer[pixel_index] = lerp(new_sample, history_sample, history_weight);
-		}
+	// Mix new sample and history sample.
+	// [Credit] Lynn-inspired.
+	float history_weight{ 0.9f };
+	switch (MaterialList::GetType(new_ray._hit_data))
+	{
+	case MaterialType::GLASS:
+	case MaterialType::WATER:
+		history_weight = 0.1f;
+		break;
+	case MaterialType::NON_METAL:
+		history_weight = 0.99f;
+		break;
+	default:
+		break;
 	}
+
+	_pixel_reprojected_buffer[pixel_index] = lerp(new_sample, history_sample, history_weight);
 }
 
 
@@ -457,7 +1340,24 @@ bool Renderer::findPreviousPixelPosition(const uint current_pixel_index, float2&
 }
 
 
-float3 Renderer::getHistorySample(const float2& history_pixel_position) const
+// UV of a direction from the retired camera on its virtual screen. False when it was outside its frustum.
+bool Renderer::findPreviousUV(const float3& direction_from_retired_camera, float2& previous_uv) const
+{
+	const float3 direction_normalized{ normalize(direction_from_retired_camera) };
+
+	const float distance_from_top{ dot(direction_normalized, _retired_camera._top_normal) };
+	const float distance_from_left{ dot(direction_normalized, _retired_camera._left_normal) };
+	const float distance_from_right{ dot(direction_normalized, _retired_camera._right_normal) };
+	const float distance_from_bottom{ dot(direction_normalized, _retired_camera._bottom_normal) };
+
+	previous_uv.x = distance_from_left / (distance_from_left + distance_from_right);
+	previous_uv.y = distance_from_top / (distance_from_top + distance_from_bottom);
+
+	return previous_uv.x >= 0.0f && previous_uv.x < 1.0f && previous_uv.y >= 0.0f && previous_uv.y < 1.0f;
+}
+
+
+float3 Renderer::getHistorySample(const float2& history_pixel_position, const float3* history_buffer, const int2 history_resolution) const
 {
 	// Find top-left corner of sampling square and identify the other pixels in the sampling square.
 	const float2 sampling_square_top_left_f{ history_pixel_position - 0.5f };
@@ -496,7 +1396,7 @@ float3 Renderer::getHistorySample(const float2& history_pixel_position) const
 	{
 		const int2& sample{ samples[i] };
 
-		if (sample.x < 0 || sample.x >= SCRWIDTH || sample.y < 0 || sample.y >= SCRHEIGHT)
+		if (sample.x < 0 || sample.x >= history_resolution.x || sample.y < 0 || sample.y >= history_resolution.y)
 		{
 			// Offscreen, no weight.
 			weights[i] = 0.0f;
@@ -514,7 +1414,7 @@ float3 Renderer::getHistorySample(const float2& history_pixel_position) const
 
 		if (weights[i] > 0.0f) // TODO: Remove this check. 0 weight will math itself out.
 		{
-			float3 history_pixel{ _pixel_history_buffer[sample.x + sample.y * SCRWIDTH] };
+			float3 history_pixel{ history_buffer[sample.x + sample.y * history_resolution.x] };
 			history_sample += history_pixel * weights[i] * inverse_total_weight;
 		}
 	}
@@ -552,7 +1452,7 @@ float3 Renderer::YCoCg_to_RGB(float3 YCoCg)
 }
 
 
-void Renderer::applyColorClamping(float3& color_to_clamp, float3 reference_color, int2 reference_color_position) const
+void Renderer::applyColorClamping(float3& color_to_clamp, float3 reference_color, int2 reference_color_position, const float3* neighbourhood_buffer) const
 {
 	const static int offset_count{ 8 };
 
@@ -573,12 +1473,12 @@ void Renderer::applyColorClamping(float3& color_to_clamp, float3 reference_color
 	{
 		int2 offset_position{ reference_color_position + offset};
 
-		if (offset_position.x < 0 || offset_position.x >= SCRWIDTH || offset_position.y < 0 || offset_position.y >= SCRHEIGHT)
+		if (offset_position.x < 0 || offset_position.x >= _resolution.x || offset_position.y < 0 || offset_position.y >= _resolution.y)
 		{
 			continue;
 		}
 
-		float3 staged_YCoCg_color = RGB_to_YCoCg(_pixel_new_buffer[offset_position.x + (offset_position.y * SCRWIDTH)]);
+		float3 staged_YCoCg_color = RGB_to_YCoCg(neighbourhood_buffer[offset_position.x + (offset_position.y * _resolution.x)]);
 		color_average += staged_YCoCg_color;
 		color_variance += staged_YCoCg_color * staged_YCoCg_color;
 		++sample_count;
@@ -611,10 +1511,10 @@ void Renderer::applyColorClamping(float3& color_to_clamp, float3 reference_color
 
 void Renderer::applyDenoising()
 {
-	static int range{ 2 };
+	constexpr int range{ _DENOISE_RANGE };
 
 #ifdef _DEBUG
-	const int pixel_index{ _focal_point.x + _focal_point.y * SCRWIDTH };
+	const int pixel_index{ _focal_point.x + _focal_point.y * _resolution.x };
 
 	applySeperableBilinearFiltering(pixel_index, _focal_point, range, { 1, 0 }, _pixel_reprojected_buffer, _pixel_denoise_buffer);
 	applySeperableBilinearFiltering(pixel_index, _focal_point, range, { 0, 1 }, _pixel_denoise_buffer, _pixel_history_buffer);
@@ -623,11 +1523,11 @@ void Renderer::applyDenoising()
 #if MULTI_THREADED
 #pragma omp parallel for schedule(dynamic)
 #endif
-	for (int y = 0; y < SCRHEIGHT; ++y)
+	for (int y = 0; y < _resolution.y; ++y)
 	{
-		const int pitch{ y * SCRWIDTH };
+		const int pitch{ y * _resolution.x };
 
-		for (int x = 0; x < SCRWIDTH; ++x)
+		for (int x = 0; x < _resolution.x; ++x)
 		{
 			const int pixel_index{ x + pitch };
 
@@ -638,11 +1538,11 @@ void Renderer::applyDenoising()
 #if MULTI_THREADED
 #pragma omp parallel for schedule(dynamic)
 #endif
-	for (int x = 0; x < SCRWIDTH; ++x)
+	for (int x = 0; x < _resolution.x; ++x)
 	{
-		for (int y = 0; y < SCRHEIGHT; ++y)
+		for (int y = 0; y < _resolution.y; ++y)
 		{
-			const int pixel_index{ x + (y * SCRWIDTH) };
+			const int pixel_index{ x + (y * _resolution.x) };
 
 			applySeperableBilinearFiltering(pixel_index, { x, y }, range, { 0, 1 }, _pixel_denoise_buffer, _pixel_history_buffer);
 		}
@@ -651,6 +1551,308 @@ void Renderer::applyDenoising()
 }
 
 
+void Renderer::drawPixel(const uint pixel_index, const float inverse_accumulated_frames)
+{
+	float3 final_pixel{ _albedo_buffer[pixel_index] * _pixel_history_buffer[pixel_index] };
+
+	if (_use_accumulator)
+	{
+		_accumulator[pixel_index] += final_pixel;
+		final_pixel = _accumulator[pixel_index] * inverse_accumulated_frames;
+	}
+
+	// Tonemapped after upscaling.
+	if (_use_upscaling)
+	{
+		_pixel_color_buffer[pixel_index] = final_pixel;
+		return;
+	}
+
+	float3 tonemapped_pixel{ tonemap(final_pixel) };
+	screen->pixels[pixel_index] = float3_to_uint(tonemapped_pixel);
+}
+
+
+// -----------------------------------------------------------
+// Temporal upscaling
+// Every frame traces a jittered, lower resolution image. Each output pixel resolves the samples that landed near it this frame,
+// and blends them into its reprojected, color clamped history at the output resolution.
+// -----------------------------------------------------------
+void Renderer::applyUpscaling()
+{
+#if MULTI_THREADED
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (int y = 0; y < _output_resolution.y; ++y)
+	{
+		for (int x = 0; x < _output_resolution.x; ++x)
+		{
+			upscalePixel(x, y);
+		}
+	}
+}
+
+
+// Output pixels whose centre lies over the trace pixels of the tile, so neighbouring tiles cover the screen exactly once.
+void Renderer::upscaleTile(const int x_start, const int y_start, const int x_end, const int y_end)
+{
+	const auto first_output_pixel{ [](const int trace_pixel, const float output_per_trace) { return static_cast<int>(ceilf(trace_pixel * output_per_trace - 0.5f)); } };
+
+	const int output_x_start{ first_output_pixel(x_start, _output_per_trace.x) };
+	const int output_y_start{ first_output_pixel(y_start, _output_per_trace.y) };
+	const int output_x_end{ x_end == _resolution.x ? _output_resolution.x : first_output_pixel(x_end, _output_per_trace.x) };
+	const int output_y_end{ y_end == _resolution.y ? _output_resolution.y : first_output_pixel(y_end, _output_per_trace.y) };
+
+	for (int y = output_y_start; y < output_y_end; ++y)
+	{
+		for (int x = output_x_start; x < output_x_end; ++x)
+		{
+			upscalePixel(x, y);
+		}
+	}
+}
+
+
+void Renderer::upscalePixel(const int x, const int y)
+{
+	const int output_index{ x + y * _output_resolution.x };
+
+	// Output pixel centre in trace pixels. Trace pixel p was sampled at p + this frame's subpixel offset.
+	// Both grids span the same frustum (see setTraceResolution()), so the mapping is linear per axis even when their aspects differ.
+	const float2 trace_position{ (x + 0.5f) * _trace_per_output.x, (y + 0.5f) * _trace_per_output.y };
+	const int2 trace_pixel{ min(static_cast<int>(trace_position.x), _resolution.x - 1), min(static_cast<int>(trace_position.y), _resolution.y - 1) };
+
+	// Resolve the 3x3 samples around it, weighted by their distance in output pixels (Gaussian fit of a Blackman-Harris window).
+	float3 current_color{ 0.0f };
+	float total_weight{ 0.0f };
+	float closest_weight{ 0.0f };
+	int2 closest_pixel{ trace_pixel };
+
+	for (int v = -1; v <= 1; ++v)
+	{
+		for (int u = -1; u <= 1; ++u)
+		{
+			const int2 sample_pixel{ trace_pixel.x + u, trace_pixel.y + v };
+
+			if (sample_pixel.x < 0 || sample_pixel.x >= _resolution.x || sample_pixel.y < 0 || sample_pixel.y >= _resolution.y)
+			{
+				continue;
+			}
+
+			const float2 offset{ (make_float2(sample_pixel) + _frame_subpixel_offset - trace_position) * _output_per_trace };
+			const float weight{ expf(-2.29f * dot(offset, offset)) };
+
+			current_color += _pixel_color_buffer[sample_pixel.x + sample_pixel.y * _resolution.x] * weight;
+			total_weight += weight;
+
+			if (weight > closest_weight)
+			{
+				closest_weight = weight;
+				closest_pixel = sample_pixel;
+			}
+		}
+	}
+
+	current_color *= 1.0f / total_weight;
+
+	float3 upscaled_color{ current_color };
+
+	// Reproject with the motion of the closest sample. The skydome only moves with the camera's rotation.
+	const int closest_index{ closest_pixel.x + closest_pixel.y * _resolution.x };
+	const Ray& closest_ray{ _ray_buffer[closest_index] };
+	const float3 direction_from_retired_camera{ closest_ray.t == Ray::t_max ? closest_ray.D : closest_ray.IntersectionPoint() - _retired_camera._position };
+
+	float2 previous_uv;
+	if (_is_upscale_history_valid && findPreviousUV(direction_from_retired_camera, previous_uv))
+	{
+		const float2 inverse_resolution{ 1.0f / make_float2(_resolution) };
+		const float2 sample_uv{ (make_float2(closest_pixel) + _frame_subpixel_offset) * inverse_resolution };
+		const float2 output_uv{ trace_position * inverse_resolution };
+
+		// Pixel centres are at +0.5 in the output history.
+		const float2 history_pixel_position{ (output_uv + previous_uv - sample_uv) * make_float2(_output_resolution) };
+
+		float3 history_sample{ getHistorySample(history_pixel_position, _upscale_previous_history_buffer, _output_resolution) };
+		applyColorClamping(history_sample, _pixel_color_buffer[closest_index], closest_pixel, _pixel_color_buffer);
+
+		// A sample right on the output pixel replaces more of its history than one that landed a pixel away.
+		const float blend{ _UPSCALE_MIN_BLEND + (_UPSCALE_MAX_BLEND - _UPSCALE_MIN_BLEND) * closest_weight };
+		upscaled_color = lerp(history_sample, current_color, blend);
+	}
+
+	_upscale_history_buffer[output_index] = upscaled_color;
+	screen->pixels[output_index] = float3_to_uint(tonemap(upscaled_color));
+}
+
+
+// -----------------------------------------------------------
+// Tile pipeline
+// Trace -> reproject -> denoise horizontally -> denoise vertically and draw -> upscale, per tile on the TileScheduler.
+// A tile's stage waits only for the 3x3 tiles around it to finish the stage before:
+// - reprojection clamps against the new samples 1 pixel around it,
+// - the horizontal pass reads reprojected colors _DENOISE_RANGE pixels around it, and overwrites new samples (same buffer),
+// - the vertical pass reads horizontal results _DENOISE_RANGE pixels around it,
+// - upscaling reads final colors up to 2 pixels around it. It only runs while upscaling.
+// -----------------------------------------------------------
+void Renderer::runTilePipeline(const float inverse_accumulated_frames)
+{
+	assert(_pipeline_tile_size >= _DENOISE_RANGE && "Filters may only reach into the next tile.");
+
+	// The wavefront tracer has already used this frame's offset.
+	const float2 subpixel_offset{ _use_wavefront ? float2{ 0.0f, 0.0f } : getSubpixelOffset() };
+
+	for (int tile = 0; tile < _pipeline_tile_count; ++tile)
+	{
+		const int tile_x{ tile % _pipeline_tiles.x };
+		const int tile_y{ tile / _pipeline_tiles.x };
+		const int neighbour_count{ (min(tile_x + 1, _pipeline_tiles.x - 1) - max(tile_x - 1, 0) + 1) * (min(tile_y + 1, _pipeline_tiles.y - 1) - max(tile_y - 1, 0) + 1) };
+
+		for (int stage = 0; stage < _TILE_STAGE_COUNT - 1; ++stage)
+		{
+			_tile_dependencies[stage * _pipeline_tile_count + tile] = neighbour_count;
+		}
+	}
+
+	const TileScheduler::TaskFunction run_task{ [this, &subpixel_offset, inverse_accumulated_frames](const uint task, const int worker_index)
+	{
+		const int tile_index{ static_cast<int>(task / _TILE_STAGE_COUNT) };
+		const TileStage stage{ static_cast<TileStage>(task % _TILE_STAGE_COUNT) };
+
+		runTileStage(tile_index, stage, subpixel_offset, inverse_accumulated_frames);
+		releaseTileNeighbours(tile_index, stage, worker_index);
+	} };
+
+	_tile_scheduler.run(_pipeline_tasks, run_task);
+}
+
+
+void Renderer::runTileStage(const int tile_index, const TileStage stage, const float2& subpixel_offset, const float inverse_accumulated_frames)
+{
+	const int x_start{ (tile_index % _pipeline_tiles.x) * _pipeline_tile_size };
+	const int y_start{ (tile_index / _pipeline_tiles.x) * _pipeline_tile_size };
+	const int x_end{ min(x_start + _pipeline_tile_size, _resolution.x) };
+	const int y_end{ min(y_start + _pipeline_tile_size, _resolution.y) };
+
+	switch (stage)
+	{
+	case TileStage::TRACE:
+	{
+		// Already traced by the wavefront tracer.
+		if (_use_wavefront)
+		{
+			break;
+		}
+
+		for (int y = y_start; y < y_end; y += _tile_size)
+		{
+			for (int x = x_start; x < x_end; x += _tile_size)
+			{
+				traceTile(x, y, subpixel_offset);
+			}
+		}
+
+		break;
+	}
+	case TileStage::REPROJECT:
+	{
+		for (int y = y_start; y < y_end; ++y)
+		{
+			for (int x = x_start; x < x_end; ++x)
+			{
+				if (_use_reprojection)
+				{
+					reprojectPixel(x, y);
+				}
+				else // Transfer from ray data to bilinear interpolation data.
+				{
+					_pixel_reprojected_buffer[x + y * _resolution.x] = _pixel_new_buffer[x + y * _resolution.x];
+				}
+			}
+		}
+
+		break;
+	}
+	case TileStage::DENOISE_HORIZONTAL:
+	{
+		if (!_use_denoiser)
+		{
+			break;
+		}
+
+		for (int y = y_start; y < y_end; ++y)
+		{
+			for (int x = x_start; x < x_end; ++x)
+			{
+				applySeperableBilinearFiltering(x + y * _resolution.x, { x, y }, _DENOISE_RANGE, { 1, 0 }, _pixel_reprojected_buffer, _pixel_denoise_buffer);
+			}
+		}
+
+		break;
+	}
+	case TileStage::DENOISE_VERTICAL_AND_DRAW:
+	{
+		for (int y = y_start; y < y_end; ++y)
+		{
+			for (int x = x_start; x < x_end; ++x)
+			{
+				const int pixel_index{ x + y * _resolution.x };
+
+				if (_use_denoiser)
+				{
+					applySeperableBilinearFiltering(pixel_index, { x, y }, _DENOISE_RANGE, { 0, 1 }, _pixel_denoise_buffer, _pixel_history_buffer);
+				}
+				else // Transfer from bilinear interpolation data to pixel history data.
+				{
+					_pixel_history_buffer[pixel_index] = _pixel_reprojected_buffer[pixel_index];
+				}
+
+				drawPixel(pixel_index, inverse_accumulated_frames);
+			}
+		}
+
+		break;
+	}
+	case TileStage::UPSCALE:
+	{
+		upscaleTile(x_start, y_start, x_end, y_end);
+
+		break;
+	}
+	default:
+		assert(false && "Used tile stage enum that does not exist.");
+		break;
+	}
+}
+
+
+// Count the finished stage off every tile around this one. Tiles with nothing left to wait for move on to the next stage.
+void Renderer::releaseTileNeighbours(const int tile_index, const TileStage finished_stage, const int worker_index)
+{
+	const int next_stage{ static_cast<int>(finished_stage) + 1 };
+	if (next_stage == _TILE_STAGE_COUNT || (next_stage == static_cast<int>(TileStage::UPSCALE) && !_use_upscaling))
+	{
+		return;
+	}
+
+	const int tile_x{ tile_index % _pipeline_tiles.x };
+	const int tile_y{ tile_index / _pipeline_tiles.x };
+	std::atomic<int>* stage_dependencies{ &_tile_dependencies[(next_stage - 1) * _pipeline_tile_count] };
+
+	for (int y = max(tile_y - 1, 0); y <= min(tile_y + 1, _pipeline_tiles.y - 1); ++y)
+	{
+		for (int x = max(tile_x - 1, 0); x <= min(tile_x + 1, _pipeline_tiles.x - 1); ++x)
+		{
+			const int neighbour_index{ x + y * _pipeline_tiles.x };
+
+			if (--stage_dependencies[neighbour_index] == 0)
+			{
+				_tile_scheduler.push(worker_index, static_cast<uint>(neighbour_index * _TILE_STAGE_COUNT + next_stage));
+			}
+		}
+	}
+}
+
+
 void Renderer::applySeperableBilinearFiltering(const int current_pixel_index, const int2 current_pixel_origin, const int range, const int2 axis, float3* read_from, float3* write_to)
 {
 	#ifndef NDEBUG
@@ -683,14 +1885,14 @@ void Renderer::applySeperableBilinearFiltering(const int current_pixel_index, co
 
 			// Confirm position is on screen.
 			// TODO: could remove this check by adding range_min, range_max parameters and using valid ranges based on known x position of origin.
-			if (sample_position.x < 0 || sample_position.x >= SCRWIDTH || sample_position.y < 0 || sample_position.y >= SCRHEIGHT)
+			if (sample_position.x < 0 || sample_position.x >= _resolution.x || sample_position.y < 0 || sample_position.y >= _resolution.y)
 			{
 				continue;
 			}
 
 			// Clamp color.
 			static float squared_max_illumination_magnitude{ powf(5.0f, 2.0f) };
-			float3 read_color{ read_from[sample_position.x + (sample_position.y * SCRWIDTH)] };
+			float3 read_color{ read_from[sample_position.x + (sample_position.y * _resolution.x)] };
 			{
 				const float squared_magnitude{ sqrLength(read_color) };
 
@@ -705,7 +1907,7 @@ void Renderer::applySeperableBilinearFiltering(const int current_pixel_index, co
 				weight > 0.0f)
 			{
 				// Add color to average.
-				average_color += read_from[sample_position.x + (sample_position.y * SCRWIDTH)] * weight;
+				average_color += read_from[sample_position.x + (sample_position.y * _resolution.x)] * weight;
 				total_weight += weight;
 			}
 			else { break; }
@@ -741,7 +1943,7 @@ float Renderer::getCommonPropertiesWeighting(const Ray& main_ray, const int2& ot
 	}
 
 	// Get the other ray. Used in the next 3 comparisons.
-	const Ray other_ray{ _ray_buffer[other_position.x + other_position.y * SCRWIDTH] };
+	const Ray other_ray{ _ray_buffer[other_position.x + other_position.y * _resolution.x] };
 
 	// If material indexes are different, do not include in average.
 	if (MaterialList::GetIndex(main_ray._hit_data) != MaterialList::GetIndex(other_ray._hit_data))
@@ -811,7 +2013,17 @@ TraceRecord Renderer::trace(Ray& incident_ray, int depth)
 	}
 
 	// Traverse voxel world until we hit non-air material.
-	if (scene.findNearest(incident_ray))
+	scene.findNearest(incident_ray);
+
+	return shade(incident_ray, depth);
+}
+
+
+// Resolve the material of a ray that has already been traversed.
+TraceRecord Renderer::shade(Ray& incident_ray, int depth)
+{
+	// If t is less than max t, an intersection was found.
+	if (incident_ray.t < Ray::t_max)
 	{
 		switch (MaterialList::GetType(incident_ray._hit_data))
 		{
@@ -1219,7 +2431,11 @@ Ray Renderer::getScatteredRay(const Ray& incident_ray, const float3& ray_normal)
 {
 	float3 scatter_direction{ weightedRandomOnHemisphere(ray_normal) };
 	
-	return { incident_ray.IntersectionPoint(), scatter_direction, incident_ray._hit_data, true };
+	// Diffuse bounces only need approximate geometry far away.
+	Ray scattered_ray{ incident_ray.IntersectionPoint(), scatter_direction, incident_ray._hit_data, true };
+	scattered_ray._lod_distance = Ray::_secondary_lod_distance;
+
+	return scattered_ray;
 }
 
 
@@ -1348,13 +2564,84 @@ void Renderer::UI()
 	{
 		ImGui::Text("Position: %.2f, %.2f, %.2f", _camera._position.x, _camera._position.y, _camera._position.z);
 		ImGui::Text("   Ahead: %.4f, %.4f, %.4f", _camera._ahead.x, _camera._ahead.y, _camera._ahead.z);
-		
+
+		ImGui::Spacing();
+
+		// Sizes of the old SCREENSIZE presets.
+		static const int2 resolution_presets[]{ { 256, 212 }, { 512, 320 }, { 768, 480 }, { 1024, 640 } };
+
+		ImGui::Text("Resolution: %i x %i, tile size %i, output %i x %i", _resolution.x, _resolution.y, _tile_size, _output_resolution.x, _output_resolution.y);
+		for (const int2& preset : resolution_presets)
+		{
+			const std::string label{ std::to_string(preset.x) + "x" + std::to_string(preset.y) };
+			if (ImGui::Button(label.c_str()))
+			{
+				_requested_resolution = preset;
+				_requested_tile_size = _tile_size;
+				_is_resolution_requested = true;
+			}
+			ImGui::SameLine();
+		}
+		ImGui::NewLine();
+
+		static int tile_size{ _tile_size };
+		if (ImGui::SliderInt("Tile size", &tile_size, _MIN_TILE_SIZE, _MAX_TILE_SIZE))
+		{
+			_requested_resolution = _base_resolution;
+			_requested_tile_size = tile_size;
+			_is_resolution_requested = true;
+		}
+
+		ImGui::Spacing();
+
+		// The trace resolution follows both, so the buffers are reallocated next frame.
+		const bool is_upscaling_changed{ ImGui::Checkbox("Temporal upscaling", &_use_upscaling) };
+		if (ImGui::SliderFloat("Upscale ratio", &_upscale_ratio, 0.5f, 1.0f) || is_upscaling_changed)
+		{
+			_requested_resolution = _base_resolution;
+			_requested_tile_size = _tile_size;
+			_is_resolution_requested = true;
+		}
+
+		ImGui::Checkbox("Dynamic resolution", &_use_dynamic_resolution);
+		ImGui::SliderFloat("Target frame time (ms)", &_target_frame_time, 4.0f, 50.0f);
+		ImGui::SliderFloat("Min render scale", &_min_render_scale, 0.25f, 1.0f);
+		ImGui::Text("Render scale: %.2f, frame time %.2f ms", _render_scale, _frame_time_average);
+
 		ImGui::EndTabItem();
 	}
 			
 	if (ImGui::BeginTabItem("Rays"))
 	{
 		ImGui::SliderInt("Max Depth", &_max_depth, 1, 20);
+
+		ImGui::Checkbox("Wavefront path tracing", &_use_wavefront);
+		ImGui::Text("Trace time: %.2f ms", _trace_time * 1000.0f);
+
+		ImGui::Checkbox("Tile pipeline (release builds)", &_use_tile_pipeline);
+		ImGui::Text("Pipeline time: %.2f ms", _pipeline_time * 1000.0f);
+		if (ImGui::TreeNode("Worker busy / idle time"))
+		{
+			for (int i = 0; i < _tile_scheduler.getWorkerCount(); ++i)
+			{
+				const TileScheduler::WorkerStats& stats{ _tile_scheduler.getWorkerStats(i) };
+				ImGui::Text("%2i: %6.2f / %6.2f ms - %i tasks, %i stolen", i, stats._busy_time * 1000.0f, stats._idle_time * 1000.0f, stats._tasks_run, stats._tasks_stolen);
+			}
+
+			ImGui::TreePop();
+		}
+
+		ImGui::Checkbox("Packet traversal (primary rays)", &_use_packets);
+		ImGui::Checkbox("Overlap TLAS refit with rendering", &_use_async_as_update);
+		if (ImGui::Checkbox("Compressed BVH nodes", &_use_compressed_nodes))
+		{
+			scene.setCompressedNodes(_use_compressed_nodes);
+		}
+		if (ImGui::Checkbox("Trace walls, piers and islands as boxes", &_use_box_blas))
+		{
+			scene.setBoxBLAS(_use_box_blas);
+		}
+		ImGui::Text("Sphere BVH build: %.2f ms, sea BVH build: %.2f ms", scene._sphere_bvh._build_time * 1000.0f, scene._triangle_bvh._build_time * 1000.0f);
 		
 		ImGui::Spacing();
 
@@ -1371,6 +2658,32 @@ void Renderer::UI()
 		}
 		ImGui::SliderInt("Split count", &_parallel_depth, 0, 10);
 
+		ImGui::Spacing();
+
+		// Bitwise or, so both widgets are drawn.
+		if (ImGui::Checkbox("Voxel LOD for diffuse and shadow rays", &_use_voxel_lod) | ImGui::SliderFloat("LOD distance", &_lod_distance, 0.1f, 8.0f))
+		{
+			Ray::_secondary_lod_distance = _use_voxel_lod ? _lod_distance : 0.0f;
+		}
+
+		ImGui::Spacing();
+
+		ImGui::Text("Voxel layout: %s", TILED_VOXELS ? "tiled 4x4x4" : "linear");
+		if (ImGui::Button("Benchmark voxel layout"))
+		{
+			_voxel_layout_stats = scene.benchmarkVoxelLayout();
+		}
+		ImGui::Text("Cache lines per ray: linear %.2f, tiled %.2f", _voxel_layout_stats._linear_lines_per_ray, _voxel_layout_stats._tiled_lines_per_ray);
+		ImGui::Text("Time per ray: %.3f us", _voxel_layout_stats._microseconds_per_ray);
+
+		if (ImGui::Button("Benchmark sparse voxels"))
+		{
+			_sparse_voxel_stats = scene.benchmarkSparseVoxels();
+		}
+		ImGui::Text("Memory: dense %.1f KB, sparse %.1f KB", _sparse_voxel_stats._dense_bytes / 1024.0f, _sparse_voxel_stats._sparse_bytes / 1024.0f);
+		ImGui::Text("Time per ray: dense %.3f us, sparse %.3f us", _sparse_voxel_stats._dense_microseconds_per_ray, _sparse_voxel_stats._sparse_microseconds_per_ray);
+		ImGui::Text("Mismatched hits: %u", _sparse_voxel_stats._mismatches);
+
 		ImGui::EndTabItem();
 	}
 
@@ -1644,11 +2957,7 @@ void Renderer::MouseDown(int) {}
 // -----------------------------------------------------------
 void Renderer::Shutdown()
 {
-	FREE64(_albedo_buffer);
-	FREE64(_pixel_new_buffer);
-	FREE64(_pixel_reprojected_buffer);
-	FREE64(_pixel_history_buffer);
+	freeFrameBuffers();
 
-	delete[] _ray_buffer;
 	delete screen;
 }
\ No newline at end of file
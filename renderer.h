@@ -26,6 +26,46 @@ namespace Tmpl8
 	};
 
 
+	// One path of the wavefront tracer. Holds what the recursive trace() keeps on its call stack.
+	struct PathState
+	{
+		Ray _ray;
+		float3 _throughput{ 1.0f };			// Scales all light found further along the path.
+		float3 _light{ 0.0f };				// Light gathered so far, final once the path finishes.
+
+		// Light gathered since the path last started counting distance underwater.
+		// Beer's law for that distance is only known once the stretch ends, see absorbPendingLight().
+		float3 _pending_light{ 0.0f };
+		float _distance_underwater{ 0.0f };
+		uint _absorber{ 0 };				// Water the stretch is absorbed by, 0 where trace() drops the distance.
+
+		uint _pixel_index{ 0 };
+		int _depth{ 0 };					// Depth trace() would be called with for _ray.
+		bool _is_finished{ false };
+	};
+
+
+	// Shadow ray of a path, traced after all paths are shaded.
+	struct ShadowRequest
+	{
+		float3 _origin{ 0.0f };
+		uint _path_index{ 0 };
+		LightSample _light_sample{};
+	};
+
+
+	// Stages a tile goes through on the TileScheduler, in order.
+	enum class TileStage : uint
+	{
+		TRACE,
+		REPROJECT,
+		DENOISE_HORIZONTAL,
+		DENOISE_VERTICAL_AND_DRAW,
+		UPSCALE,
+		COUNT,
+	};
+
+
 	class Renderer : public TheApp
 	{
 	public:
@@ -50,12 +90,32 @@ namespace Tmpl8
 		// Main methods.
 		void shootErasureRays(float2 coordinates[]);
 		void shootPrimaryRays();		
+		void traceTile(const int x, const int y, const float2& subpixel_offset);
+		float2 getSubpixelOffset();
 		void applyReprojection();
+		void reprojectPixel(const int x, const int y);
 		void applyDenoising();
+		void drawPixel(const uint pixel_index, const float inverse_accumulated_frames);
 		void resetAccumulator();
+		void setResolution(const int2 resolution, const int tile_size);
+		void setTraceResolution(const int2 resolution);
+		void freeFrameBuffers();
+		void updateDynamicResolution();
+		int2 getTraceResolution(const int2 output_resolution, const int tile_size, const float render_scale) const;
+
+		// Temporal upscaling from the trace resolution to the output resolution.
+		void applyUpscaling();
+		void upscalePixel(const int x, const int y);
+		void upscaleTile(const int x_start, const int y_start, const int x_end, const int y_end);
+
+		// Tile pipeline. Every stage after tracing runs per tile as soon as the tiles around it are ready, without a frame-wide barrier.
+		void runTilePipeline(const float inverse_accumulated_frames);
+		void runTileStage(const int tile_index, const TileStage stage, const float2& subpixel_offset, const float inverse_accumulated_frames);
+		void releaseTileNeighbours(const int tile_index, const TileStage finished_stage, const int worker_index);
 
 		// Ray interaction logic.
 		TraceRecord trace(Ray& ray, int depth);
+		TraceRecord shade(Ray& ray, int depth);
 		TraceRecord getSkydomeIntersectionResult(Ray& incident_ray) const;
 		TraceRecord getNonMetalIntersectionResult(Ray& incident_ray, int depth);
 		TraceRecord getMetalIntersectionResult(Ray& incident_ray, int depth);
@@ -63,6 +123,31 @@ namespace Tmpl8
 		TraceRecord getWaterIntersectionResult(Ray& incident_ray, int depth);
 		TraceRecord getEmissiveIntersectionResult(Ray& incident_ray, int depth);
 
+		// Wavefront path tracing. Same light transport as trace(), but run stage by stage over all paths at once.
+		void traceWavefront();
+		int generatePaths(const int first_tile, const int tile_count, const float2& subpixel_offset);
+		void extendPaths(const int queue_size, const bool is_primary);
+		void sortPaths(const int queue_size);
+		void shadePaths(const int queue_size);
+		void connectShadowRays();
+		int retirePaths(const int queue_size, const uint first_spawned_path);
+
+		// Wavefront shading, one step of the matching recursive method.
+		void shadePath(const uint path_index);
+		void shadeNonMetalPath(const uint path_index, Ray& incident_ray);
+		void shadeMetalPath(const uint path_index, Ray& incident_ray);
+		void shadeDielectricPath(const uint path_index, Ray& incident_ray);
+		void shadeWaterPath(const uint path_index, Ray& incident_ray);
+
+		// Wavefront shading helpers.
+		void applyAlbedo(PathState& path, const float3& albedo);
+		void addSegmentUnderwater(PathState& path, Ray& ray);
+		void absorbPendingLight(PathState& path);
+		void continuePath(PathState& path, const Ray& ray);
+		bool reservePath(uint& path_index);
+		uint splitPath(PathState& path, const uint split_index);
+		void requestShadowRay(const uint path_index, const Ray& incident_ray);
+
 		// Ray interaction logic helpers.
 		float3 getAbsorption(const uint dielectric_data, const float distance_traveled);
 		static bool cannotRefract(const float cos_theta, const float ior_ratio);
@@ -81,8 +166,9 @@ namespace Tmpl8
 
 		// Reprojection
 		bool findPreviousPixelPosition(const uint current_pixel_index, float2& previous_pixel) const;
-		float3 getHistorySample(const float2& history_pixel_position) const;
-		void applyColorClamping(float3& color_to_clamp, float3 reference_color, int2 reference_color_position) const;
+		bool findPreviousUV(const float3& direction_from_retired_camera, float2& previous_uv) const;
+		float3 getHistorySample(const float2& history_pixel_position, const float3* history_buffer, const int2 history_resolution) const;
+		void applyColorClamping(float3& color_to_clamp, float3 reference_color, int2 reference_color_position, const float3* neighbourhood_buffer) const;
 		static float3 RGB_to_YCoCg(float3 rgb);
 		static float3 YCoCg_to_RGB(float3 rgb);
 
@@ -108,6 +194,41 @@ namespace Tmpl8
 		
 		float d1{ 0.0f };
 
+		// Trace resolution and tile size, set by setResolution(). game_config.h only gives the window size and the starting resolution.
+		int2 _resolution{ SCRWIDTH, SCRHEIGHT };
+		int _tile_size{ TILE_SIZE };
+		int _pixel_count{ SCRWIDTH * SCRHEIGHT };
+		int _pixel_capacity{ 0 };					// Pixels the frame buffers hold, at a render scale of 1.
+		int2 _history_resolution{ SCRWIDTH, SCRHEIGHT };	// Resolution _pixel_previous_history_buffer was written at.
+
+		// Size of the screen surface. Only differs from the trace resolution while upscaling.
+		int2 _output_resolution{ SCRWIDTH, SCRHEIGHT };
+		int _output_pixel_count{ SCRWIDTH * SCRHEIGHT };
+		float2 _output_per_trace{ 1.0f, 1.0f };
+		float2 _trace_per_output{ 1.0f, 1.0f };
+
+		// Bounds for requested resolutions and tile sizes, whether they come from the UI or SEA_RESOLUTION.
+		static constexpr int _MIN_TILE_SIZE{ 2 };
+		static constexpr int _MAX_TILE_SIZE{ 16 };
+		static constexpr int _MAX_RESOLUTION{ 4096 };
+
+		// Applied at the start of the next frame.
+		int2 _requested_resolution{ SCRWIDTH, SCRHEIGHT };
+		int _requested_tile_size{ TILE_SIZE };
+		bool _is_resolution_requested{ false };
+
+		// Dynamic resolution. Scales the trace resolution down to hold the frame time budget; the upscaler or the window stretches whatever comes out.
+		// The base resolution is the last one requested from setResolution().
+		int2 _base_resolution{ SCRWIDTH, SCRHEIGHT };
+		bool _use_dynamic_resolution{ false };
+		float _target_frame_time{ 16.6f };
+		float _min_render_scale{ 0.5f };
+		float _render_scale{ 1.0f };
+
+		// Running average of the frame time in ms. Restarts whenever the resolution changes.
+		float _frame_time_average{ 10.0f };
+		float _frame_time_alpha{ 1.0f };
+
 		float2 _screenf{ static_cast<float>(SCRWIDTH), static_cast<float>(SCRHEIGHT) };		
 		float2 _midscreenf{ static_cast<float>(SCRWIDTH >> 1), static_cast<float>(SCRHEIGHT >> 1) };
 		float2 _subpixel_positions[256];
@@ -117,20 +238,68 @@ namespace Tmpl8
 		float3* _albedo_buffer{ nullptr };
 		float3* _pixel_reprojected_buffer{ nullptr };
 		float3* _pixel_history_buffer{ nullptr };
+		float3* _pixel_previous_history_buffer{ nullptr };	// Read by reprojection while this frame's history is written. Swapped every frame.
 		float3* _accumulator{ nullptr };
 		union
 		{
 			float3* _pixel_new_buffer{ nullptr };
 			float3* _pixel_denoise_buffer;			
 		};
+
+		// Temporal upscaling. Final colors are drawn at the trace resolution, then resolved into the output history with this frame's jitter.
+		float3* _pixel_color_buffer{ nullptr };
+		float3* _upscale_history_buffer{ nullptr };
+		float3* _upscale_previous_history_buffer{ nullptr };	// Output resolution, swapped every frame like the pixel history.
+		bool _use_upscaling{ false };
+		bool _is_upscale_history_valid{ false };
+		float _upscale_ratio{ 0.67f };
+		float2 _frame_subpixel_offset{ 0.0f, 0.0f };
+
+		// Weight of this frame's samples in the upscale history, for a sample right on / far from the output pixel.
+		static constexpr float _UPSCALE_MAX_BLEND{ 0.2f };
+		static constexpr float _UPSCALE_MIN_BLEND{ 0.04f };
 		
 		// Halton samples used for subpixel locations.
 		static constexpr int _HALTON_SAMPLE_SIZE{ 256 };
 		int _offset_index{ 0 };	
 
+		// Radius of the denoising filter, in pixels.
+		static constexpr int _DENOISE_RANGE{ 2 };
+
+		// Pipeline tiles, sized by setResolution().
+		int _pipeline_tile_size{ 16 };
+		int2 _pipeline_tiles{ 0, 0 };
+		int _pipeline_tile_count{ 0 };
+		static constexpr int _TILE_STAGE_COUNT{ static_cast<int>(TileStage::COUNT) };
+
+		TileScheduler _tile_scheduler{};
+		std::vector<uint> _pipeline_tasks;
+		std::unique_ptr<std::atomic<int>[]> _tile_dependencies;	// Per stage after TRACE, per tile: neighbours still to finish the stage before.
+		
 		// Precompute the float of the worldsize.
 		float _world_float{ static_cast<float>(WORLDSIZE) };		
 
+		// Wavefront buffers, allocated the first time the mode is used.
+		// Paths are never reused within a batch, so the pool must hold every split path of the batch.
+		static constexpr int _WAVEFRONT_CAPACITY{ 1 << 17 };
+		std::vector<PathState> _paths;
+		std::vector<uchar> _path_bins;
+		std::vector<uint> _path_queue;
+		std::vector<uint> _sorted_path_queue;
+		std::vector<ShadowRequest> _shadow_queue;
+		std::atomic<uint> _path_count{ 0 };
+		std::atomic<uint> _shadow_count{ 0 };
+
+		bool _use_wavefront{ false };
+		bool _use_tile_pipeline{ true };
+		float _trace_time{ 0.0f };
+		float _pipeline_time{ 0.0f };
+		bool _use_packets{ true };
+		bool _use_async_as_update{ true };
+		bool _use_compressed_nodes{ false };
+		bool _use_box_blas{ false };
+		bool _use_voxel_lod{ false };
+		float _lod_distance{ 1.0f };
 		bool _split_on_first_hit{ true };
 		int _parallel_depth{ 1 };
 		float _sigma{0.2f};
@@ -143,6 +312,8 @@ namespace Tmpl8
 		bool _use_accumulator{ false };
 		bool _use_antialiasing{ false };
 		float _frame_count{ 0.0f };
+		Scene::VoxelLayoutStats _voxel_layout_stats{};
+		Scene::SparseVoxelStats _sparse_voxel_stats{};
 	};
 
 } // namespace Tmpl8
@@ -6,6 +6,9 @@ SingleSphereBVH::SingleSphereBVH(float3 position, float radius)
 	: _sphere{ position, radius }
 {
 	_id = -2;
+
+	// Spheres are not an object that will hinder the player's movement.
+	_mask = _MASK_SPHERES;
 }
 
 
@@ -97,12 +100,6 @@ bool SingleSphereBVH::intersectItemForOcclusion(Ray& transformed_ray, TintData&
 }
 
 
-void SingleSphereBVH::intersectItemForNearestToPlayer(Ray&, const uint, const int) const
-{
-	return; // Spheres are not an object that will hinder the player's movement.
-}
-
-
 // BUILD METHODS //
 
 void SingleSphereBVH::build()
@@ -131,6 +128,7 @@ void SingleSphereBVH::build()
 	updateNodeBounds(0);
 	//subdivide(0);
 	setBounds();
+	finishBuild();
 }
 
 
@@ -4,7 +4,7 @@
 // [Credit] https://jacco.ompf2.com/2022/04/13/how-to-build-a-bvh-part-1-basics/
 
 
-class SingleSphereBVH : public BVH
+class SingleSphereBVH : public BVHTraversal<SingleSphereBVH>
 {
 public:
 	SingleSphereBVH(float3 position, float radius);
@@ -21,9 +21,6 @@ public:
 	bool intersectItemForOcclusion(Ray& transformed_ray, TintData& tint_data, const uint item_index) const override;
 
 
-	void intersectItemForNearestToPlayer(Ray& ray, const uint, const int) const override;
-
-
 	// BUILD METHODS //
 
 	void build() override;
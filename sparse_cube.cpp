@@ -0,0 +1,356 @@
+#include "precomp.h"
+#include "sparse_cube.h"
+
+
+void SparseCube::build(const Cube& cube)
+{
+	std::vector<Voxel> voxels;
+
+	// Only the occupied part of the grid holds voxels.
+	const uint3 lower{ cube._occupied_min };
+	const uint3 upper{ cube._occupied_min + cube._occupied_size };
+
+	for (uint z = lower.z; z < upper.z; ++z)
+	{
+		for (uint y = lower.y; y < upper.y; ++y)
+		{
+			for (uint x = lower.x; x < upper.x; ++x)
+			{
+				if (const PaletteIndex voxel{ cube._voxels[cube.getVoxelIndex(x, y, z)] })
+				{
+					voxels.push_back(Voxel{ make_uint3(x, y, z), cube._palette[voxel] });
+				}
+			}
+		}
+	}
+
+	build(cube._size, voxels);
+}
+
+
+void SparseCube::build(const uint3& size, std::vector<Voxel>& voxels)
+{
+	_size = size;
+	_nodes.clear();
+	_voxels.clear();
+	_palette.assign(1, 0);
+
+	// Smallest tree whose root covers the grid.
+	const uint largest_side{ max(max(_size.x, _size.y), _size.z) };
+	_depth = 1;
+	while ((1u << (_depth * 2)) < largest_side)
+	{
+		++_depth;
+	}
+
+	if (_depth > _MAX_DEPTH)
+	{
+		FATALERROR("Sparse cube of %u voxels per side is too large.", largest_side);
+	}
+
+	// Air is not stored.
+	voxels.erase(std::remove_if(voxels.begin(), voxels.end(), [](const Voxel& voxel) { return !voxel._voxel; }), voxels.end());
+
+	// Sort into tree order. The key holds the child bit of every level, the root's in the highest bits.
+	auto getKey = [this](const Voxel& voxel)
+	{
+		uint64_t key{ 0 };
+		for (uint level = _depth; level > 0; --level)
+		{
+			key = (key << 6) | getChildBit(voxel._position.x, voxel._position.y, voxel._position.z, level);
+		}
+
+		return key;
+	};
+
+	std::vector<std::pair<uint64_t, uint>> sorted;
+	sorted.reserve(voxels.size());
+	for (uint i = 0; i < voxels.size(); ++i)
+	{
+		sorted.emplace_back(getKey(voxels[i]), i);
+	}
+
+	// A voxel set twice keeps the value set last, like it would in a dense cube.
+	std::stable_sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+	std::vector<uint64_t> keys;
+	std::vector<PaletteIndex> palette_indices;
+	keys.reserve(sorted.size());
+	palette_indices.reserve(sorted.size());
+
+	std::unordered_map<uint, PaletteIndex> palette_lookup;
+	uint3 occupied_min{ _size };
+	uint3 occupied_max{ make_uint3(0) };
+
+	for (size_t i = 0; i < sorted.size(); ++i)
+	{
+		if (i + 1 < sorted.size() && sorted[i + 1].first == sorted[i].first)
+		{
+			continue;
+		}
+
+		const Voxel& voxel{ voxels[sorted[i].second] };
+
+		auto [entry, is_new] = palette_lookup.try_emplace(voxel._voxel, static_cast<PaletteIndex>(_palette.size()));
+		if (is_new)
+		{
+			if (_palette.size() == Cube::_PALETTE_SIZE)
+			{
+				FATALERROR("Sparse cube palette is full (%u entries). Raise VOXEL_PALETTE_BITS.", Cube::_PALETTE_SIZE - 1);
+			}
+
+			_palette.push_back(voxel._voxel);
+		}
+
+		keys.push_back(sorted[i].first);
+		palette_indices.push_back(entry->second);
+
+		occupied_min = min(occupied_min, voxel._position);
+		occupied_max = max(occupied_max, voxel._position + 1);
+	}
+
+	// Set bounds.
+	if (keys.empty())
+	{
+		_occupied_min = make_uint3(0);
+		_occupied_size = make_uint3(0);
+	}
+	else
+	{
+		_occupied_min = occupied_min;
+		_occupied_size = occupied_max - occupied_min;
+	}
+
+	_bounds[0] = make_float3(_occupied_min) * VOXELSIZE;
+	_bounds[1] = make_float3(_occupied_min + _occupied_size) * VOXELSIZE;
+
+	// Build the tree top down.
+	_nodes.resize(1);
+	buildNode(0, _depth, keys, palette_indices, 0, keys.size());
+}
+
+
+// Link up the children of a node over the sorted voxels [first, last) inside it.
+// Children of one node are allocated together, so they are contiguous.
+void SparseCube::buildNode(const uint node_index, const uint level, const std::vector<uint64_t>& keys, const std::vector<PaletteIndex>& voxels, const size_t first, const size_t last)
+{
+	const uint shift{ (level - 1) * 6 };
+	auto getBit = [&keys, shift](const size_t i) { return static_cast<uint>((keys[i] >> shift) & 63); };
+
+	uint64_t child_mask{ 0 };
+	for (size_t i = first; i < last; ++i)
+	{
+		child_mask |= 1ull << getBit(i);
+	}
+
+	_nodes[node_index]._child_mask = child_mask;
+
+	// Blocks store one voxel per set bit, in bit order.
+	if (level == 1)
+	{
+		_nodes[node_index]._first_child = static_cast<uint>(_voxels.size());
+		_voxels.insert(_voxels.end(), voxels.begin() + first, voxels.begin() + last);
+
+		return;
+	}
+
+	const uint first_child{ static_cast<uint>(_nodes.size()) };
+	_nodes[node_index]._first_child = first_child;
+	_nodes.resize(_nodes.size() + _mm_popcnt_u64(child_mask));
+
+	// Voxels of each child follow each other in key order.
+	uint child{ first_child };
+	for (size_t child_first = first; child_first < last; ++child)
+	{
+		size_t child_last{ child_first + 1 };
+		while (child_last < last && getBit(child_last) == getBit(child_first))
+		{
+			++child_last;
+		}
+
+		buildNode(child, level - 1, keys, voxels, child_first, child_last);
+		child_first = child_last;
+	}
+}
+
+
+// Walk down to the cell, stopping at the first level that has no solid child there.
+SparseCube::Cell SparseCube::getCell(const uint x, const uint y, const uint z) const
+{
+	uint node_index{ 0 };
+
+	for (uint level = _depth; level > 1; --level)
+	{
+		const Node& node{ _nodes[node_index] };
+		const uint bit{ getChildBit(x, y, z, level) };
+
+		if (!((node._child_mask >> bit) & 1ull))
+		{
+			return Cell{ 0, 1u << ((level - 1) * 2) };
+		}
+
+		node_index = node._first_child + getChildRank(node._child_mask, bit);
+	}
+
+	const Node& block{ _nodes[node_index] };
+	const uint bit{ getChildBit(x, y, z, 1) };
+
+	if (!((block._child_mask >> bit) & 1ull))
+	{
+		return Cell{};
+	}
+
+	return Cell{ _voxels[block._first_child + getChildRank(block._child_mask, bit)] };
+}
+
+
+// Step over the whole empty node the ray is currently in.
+bool SparseCube::skipEmptyCell(Cube::DDAState& s, const uint empty_size) const
+{
+	const uint3 region_min{ make_uint3(s.X & ~(empty_size - 1), s.Y & ~(empty_size - 1), s.Z & ~(empty_size - 1)) };
+
+	const uint3 region_max{ make_uint3(
+		min(region_min.x + empty_size, _size.x) - 1,
+		min(region_min.y + empty_size, _size.y) - 1,
+		min(region_min.z + empty_size, _size.z) - 1
+	) };
+
+	return Cube::skipRegion(s, region_min, region_max, _occupied_min, _occupied_size);
+}
+
+
+void SparseCube::findNearest(Ray& ray) const
+{
+	// Setup Amanatides & Woo grid traversal
+	Cube::DDAState s;
+	if (!Cube::setupDDA(ray, s, _bounds, _occupied_min, _occupied_size))
+	{
+		return;
+	}
+
+	// Start stepping.
+	while (s.t <= ray.t)
+	{
+		const Cell cell{ getCell(s.X, s.Y, s.Z) };
+
+		// Empty nodes are crossed in a single step, whatever their level.
+		if (cell._empty_size)
+		{
+			if (!skipEmptyCell(s, cell._empty_size))
+			{
+				break;
+			}
+
+			continue;
+		}
+
+		if (cell._voxel)
+		{
+			if (s.t < ray.t)
+			{
+				ray.t = s.t;
+				ray._hit_data = _palette[cell._voxel];
+				ray._id = _id;
+				ray.normal = ray.GetNormal(_size);
+			}
+			break;
+		}
+
+		if (!Cube::stepDDA(s, _occupied_min, _occupied_size))
+		{
+			break;
+		}
+	}
+}
+
+
+bool SparseCube::findOcclusion(const Ray& ray, TintData& tint_data) const
+{
+	// Setup Amanatides & Woo grid traversal
+	Cube::DDAState s;
+	if (!Cube::setupDDA(ray, s, _bounds, _occupied_min, _occupied_size))
+	{
+		return false;
+	}
+
+	// Start stepping
+	while (s.t < ray.t)
+	{
+		const Cell cell{ getCell(s.X, s.Y, s.Z) };
+
+		if (cell._empty_size)
+		{
+			if (!skipEmptyCell(s, cell._empty_size))
+			{
+				break;
+			}
+
+			continue;
+		}
+
+		if (cell._voxel)
+		{
+			const uint voxel{ _palette[cell._voxel] };
+
+			// Glass does not occlude, but it tints the incoming light. Same approximation as Cube::findOcclusion().
+			if (MaterialList::GetType(voxel) != MaterialType::GLASS)
+			{
+				return s.t < ray.t;
+			}
+
+			tint_data._distance += 1.0f;
+
+			if (!tint_data._voxel)
+			{
+				tint_data._voxel = voxel;
+			}
+		}
+
+		if (!Cube::stepDDA(s, _occupied_min, _occupied_size))
+		{
+			break;
+		}
+	}
+
+	return false;
+}
+
+
+void SparseCube::findMaterialExit(Ray& ray, const uint material_type) const
+{
+	// Setup Amanatides & Woo grid traversal
+	Cube::DDAState s;
+	Cube::setupDDA(ray, s, _bounds, _occupied_min, _occupied_size);
+
+	// Start stepping.
+	while (true)
+	{
+		const uint cell{ _palette[getCell(s.X, s.Y, s.Z)._voxel] };
+
+		if (MaterialList::GetType(cell) != material_type)
+		{
+			ray.t = s.t;
+			ray._hit_data = cell;
+			ray.normal = ray.GetNormal(_size);
+
+			return;
+		}
+
+		if (!Cube::stepDDA(s, _occupied_min, _occupied_size))
+		{
+			break;
+		}
+	}
+
+	// If no exit found, then ray reached end of voxel volume.
+	// We will assume there is air on the outside.
+	ray.t = s.t;
+	ray._hit_data = 0;
+	ray.normal = ray.GetNormal(_size);
+}
+
+
+size_t SparseCube::getMemoryUsage() const
+{
+	return _nodes.size() * sizeof(Node) + _voxels.size() * sizeof(PaletteIndex) + _palette.size() * sizeof(uint);
+}
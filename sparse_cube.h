@@ -0,0 +1,95 @@
+#pragma once
+
+// Voxel grid stored as a sparse 64-tree.
+// Every node splits its region into 4x4x4 children, so its child mask has the same bit layout as Cube's occupancy words.
+// Only solid children are stored. They sit next to each other and are found by counting the mask bits below them.
+// Nodes one level above the voxels are the 4x4x4 blocks, their children are palette indices.
+// Memory grows with the surface of a model instead of its volume, so grids far larger than WORLDSIZE stay affordable.
+class SparseCube
+{
+public:
+	using PaletteIndex = Cube::PaletteIndex;
+
+	struct Node
+	{
+		uint64_t _child_mask{ 0 };		// 8 bytes
+		uint _first_child{ 0 };			// Index of the first child node, or of the first voxel for blocks.
+		uint _dummy{ 0 };				// 16 bytes
+	};
+
+	// Solid voxel handed to build(). Holds the full material | color word.
+	struct Voxel
+	{
+		uint3 _position{ 0 };
+		uint _voxel{ 0 };
+	};
+
+	SparseCube() = default;
+
+	~SparseCube() = default;
+
+	// Convert the voxels of a dense cube.
+	void build(const Cube& cube);
+
+	// Build straight from a voxel list, for models too large to hold as a dense cube. Reorders the list.
+	void build(const uint3& size, std::vector<Voxel>& voxels);
+
+	// Traversal methods.
+	void findNearest(Ray& ray) const;
+	bool findOcclusion(const Ray& ray, TintData& tint_data) const;
+	void findMaterialExit(Ray& ray, const uint material_type) const;
+
+	// Benchmarks.
+	size_t getMemoryUsage() const;
+
+	// Levels below the root. Level 1 nodes are the 4x4x4 blocks.
+	static constexpr uint _MAX_DEPTH{ 10 };
+
+	// Properties.
+	uint _id{ 0 };
+
+	float3 _bounds[2]{ {0.0f}, {1.0f} };
+
+	uint3 _size{ 1 };
+	uint _depth{ 1 };
+
+	// Same meaning as in Cube.
+	uint3 _occupied_min{ 0 };
+	uint3 _occupied_size{ 0 };
+
+	// Root is node 0.
+	std::vector<Node> _nodes;
+
+	// Palette index per set mask bit, in node order.
+	std::vector<PaletteIndex> _voxels;
+	std::vector<uint> _palette;
+
+
+private:
+	// Outcome of looking up the cell a ray is in.
+	struct Cell
+	{
+		// Palette index, 0 for air.
+		uint _voxel{ 0 };
+
+		// Side of the aligned empty region around the cell, 0 inside a block. The ray can cross that region in one go.
+		uint _empty_size{ 0 };
+	};
+
+	void buildNode(const uint node_index, const uint level, const std::vector<uint64_t>& keys, const std::vector<PaletteIndex>& voxels, const size_t first, const size_t last);
+	Cell getCell(const uint x, const uint y, const uint z) const;
+	bool skipEmptyCell(Cube::DDAState& state, const uint empty_size) const;
+
+	// Child index of the cell within a node at level, in occupancy bit layout.
+	static uint getChildBit(const uint x, const uint y, const uint z, const uint level)
+	{
+		const uint shift{ (level - 1) * 2 };
+		return ((x >> shift) & 3) | (((y >> shift) & 3) << 2) | (((z >> shift) & 3) << 4);
+	}
+
+	// Number of solid children before bit.
+	static uint getChildRank(const uint64_t child_mask, const uint bit)
+	{
+		return static_cast<uint>(_mm_popcnt_u64(child_mask & ((1ull << bit) - 1)));
+	}
+};
@@ -0,0 +1,61 @@
+#pragma once
+
+// ALL TLAS/BLAS CODE HEAVILY INSPIRED (OR OUTRIGHT COPIED) FROM JACCO'S SERIES ON BVH CREATION
+// [Credit] https://jacco.ompf2.com/2022/04/13/how-to-build-a-bvh-part-1-basics/
+
+
+// Same role as CubeBVH, for a voxel model stored as a SparseCube.
+class SparseCubeBVH : public BVHTraversal<SparseCubeBVH>
+{
+public:
+	SparseCubeBVH();
+
+	~SparseCubeBVH() override;
+
+
+	// INTERSECT ITEM METHODS //
+
+	void intersectItemForNearest(Ray& transformed_ray, const uint) const override;
+
+
+	bool intersectItemForOcclusion(Ray& transformed_ray, TintData& tint_data, const uint) const override;
+
+
+	void interesectItemForMaterialExit(Ray& original_ray, const uint material_type) const override;
+
+
+	// Sparse cubes refuse erasure. Scene::restoreVoxels() can only undo erasures in dense cubes.
+	void intersectItemForVoxelErasure(Ray&, const uint, Cube*&) override {}
+
+
+	// BUILD METHODS //
+
+	void build() override;
+
+
+	void updateNodeBounds(uint node_index) const override;
+
+
+	void subdivide(const uint node_index);
+
+
+	float findBestSplitPlane(BVHNode& node, int& best_axis, float& best_position) const;
+
+
+	// TRANSFORMS //
+
+	void setTransform(const float3& scale, const float3& rotation, const float3& translation) override;
+
+
+	// CUBE API //
+
+	void setID(const int id) override;
+
+
+	// Convert a dense cube and build over it.
+	void setCube(const Cube& cube);
+
+
+	// Properties.
+	SparseCube _cube;
+};
@@ -64,7 +64,7 @@ void Stone::createBVH(Model& land)
 	// Place.
 	float random_angle{ 2.0f * PI * RandomFloat() };
 	
-	_offset = _bvh._bounds.bmax3 * 0.5f;
+	_offset = make_float3(_bvh._cube._size) * VOXELSIZE * 0.5f;
 	_position = float3{
 		land._position.x + (land._offset.x - VOXELSIZE * 2.0f) * cosf(random_angle),
 		_surface + getYOffset() * _up,
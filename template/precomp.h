@@ -6,8 +6,16 @@
 #include <fstream>
 #include <vector>
 #include <list>
+#include <unordered_map>
 #include <string>
 #include <thread>
+#include <future>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <math.h>
 #include <algorithm>
 #include <assert.h>
@@ -413,6 +421,7 @@ public:
 #include "triangle.h"
 #include "sphere.h"
 #include "cube.h"
+#include "sparse_cube.h"
 
 // Acceleration structures.
 #include "bvh.h"
@@ -420,7 +429,9 @@ public:
 //#include "singleTriangleBVH.h"
 #include "sphere_bvh.h"
 #include "single_sphere_bvh.h"
+#include "box_bvh.h"
 #include "cube_bvh.h"
+#include "sparse_cube_bvh.h"
 //#include "cube_instance_bvh.h"
 #include "tlas.h"
 
@@ -444,6 +455,7 @@ public:
 #include "scene.h"
 
 // Engine.
+#include "tile_scheduler.h"
 #include "renderer.h"
 
 
@@ -240,14 +240,20 @@ void Scene::generateWorld(uint non_metal_id, uint emissive_id, uint glass_id)
 		_bvh_list[i]->setID(static_cast<int>(i));
 	}
 
-	// Give all piers same id for identification.
+	// Mask instances that some rays pass through or need to identify.
 	for (size_t i = 0; i < _piers.size(); ++i)
 	{
-		_piers[i]->setID(-9);
+		_piers[i]->setMask(BVH::_MASK_PIER);
 	}
+
+	_triangle_bvh.setMask(BVH::_MASK_WATER);
+	_player._ship._bvh.setMask(BVH::_MASK_SHIP);
+	_player._avatar._bvh.setMask(BVH::_MASK_AVATAR);
 	
-	// Build TLAS.
-	_tlas.build();
+	// Build both TLASes and start tracing the BLASes where they were placed.
+	_tlas[0].build();
+	_tlas[1].build();
+	publishTransforms();
 
 	// Initialize player.
 	_player.initialize();
@@ -292,46 +298,125 @@ void Scene::updateWorld(const float delta_time, const KeyboardManager& km)
 
 void Scene::refitAS()
 {
-	static uint rebuild_cycle{ 60u };
-	static uint progress{ 0u };
+	// Only cube BLASes change their contents. Moved instances keep their BLAS and only move their TLAS leaf.
+	for (BVH* bvh : _bvh_list)
+	{
+		bvh->update();
+	}
+
+	// Only instances that moved are refit in the TLAS.
+	endRefitAS();
+	_front_tlas->refit();
+	publishTransforms();
+}
 
-	++progress;
 
-	if (progress >= rebuild_cycle)
+void Scene::beginRefitAS()
+{
+	// BLAS geometry is traversed while rendering, so BLAS updates stay on this thread.
+	for (BVH* bvh : _bvh_list)
 	{
-		for (BVH* bvh : _bvh_list)
-		{
-			bvh->build();
-		}
+		bvh->update();
+	}
+
+	// The back TLAS only reads BLAS bounds, which gameplay does not touch until endRefitAS() has joined.
+	_refit_job = std::async(std::launch::async, [this]() { _back_tlas->refit(); });
+}
+
+
+void Scene::endRefitAS()
+{
+	if (!_refit_job.valid())
+	{
+		return;
+	}
+
+	_refit_job.get();
+
+	std::swap(_front_tlas, _back_tlas);
+	publishTransforms();
+}
 
-		_tlas.build();
 
-		progress = 0u;
+void Scene::setBoxBLAS(const bool use_boxes)
+{
+	// Walls, piers and islands are mostly solid, so they trace as merged boxes. The rest keep stepping through their grids.
+	std::vector<CubeBVH*> solid_cubes;
+	for (Island& island : _islands)
+	{
+		solid_cubes.push_back(&island._bvh);
+		solid_cubes.push_back(&island._pier._bvh);
 	}
-	else
+	for (Wall& wall : _walls)
 	{
-		for (BVH* bvh : _bvh_list)
-		{
-			bvh->refitBVH();
-		}
+		solid_cubes.push_back(&wall._bvh);
+	}
+
+	// Only the cube's item changes. Its node and world bounds stay the same, so the TLAS is left as is.
+	for (CubeBVH* cube_bvh : solid_cubes)
+	{
+		cube_bvh->_use_boxes = use_boxes;
+		cube_bvh->buildBoxBVH();
+	}
+}
+
 
-		_tlas.build();
+void Scene::setCompressedNodes(const bool use_compressed_nodes)
+{
+	// Node formats are picked at build time, so everything is rebuilt.
+	endRefitAS();
+
+	for (BVH* bvh : _bvh_list)
+	{
+		bvh->_use_compressed_nodes = use_compressed_nodes;
+		bvh->build();
+	}
+
+	for (TLAS& tlas : _tlas)
+	{
+		tlas._use_compressed_nodes = use_compressed_nodes;
+		tlas.build();
+	}
+
+	publishTransforms();
+}
+
+
+void Scene::publishTransforms()
+{
+	// Rays are transformed with the matrices matching the bounds in the front TLAS.
+	for (BVH* bvh : _bvh_list)
+	{
+		bvh->publishTransform();
 	}
 }
 
 
 bool Scene::findNearest(Ray& ray) const
 {
-	_tlas.findNearest(ray, 0);
+	_front_tlas->findNearest(ray, 0);
 	
 	// If t is less than max t, an intersection was found.
 	return ray.t < Ray::t_max;
 }
 
 
-void Scene::findNearestToPlayer(Ray& player_ray, const int source_id) const
+// Packet version of findNearest for four coherent rays.
+void Scene::findNearest4(Ray* rays) const
+{
+	_front_tlas->findNearest4(rays, 0);
+}
+
+
+// Mask of the instance a ray hit. Only instances with an id in the BVH list can be looked up.
+uint Scene::getHitMask(const Ray& ray) const
 {
-	_tlas.findNearestToPlayer(player_ray, 0, source_id);
+	if (ray._id < 0 || ray._id >= static_cast<int>(_bvh_list.size()))
+	{
+		return 0;
+	}
+
+	return _bvh_list[ray._id]->_mask;
 }
 
 
@@ -373,7 +458,7 @@ bool Scene::isOccluded(Ray& ray) const
 
 bool Scene::isOccluded(Ray& ray, TintData& tint_data) const
 {
-	if (_tlas.findOcclusion(ray, tint_data, 0))
+	if (_front_tlas->findOcclusion(ray, tint_data, 0))
 	{
 		return true;
 	}
@@ -384,7 +469,7 @@ bool Scene::isOccluded(Ray& ray, TintData& tint_data) const
 
 void Scene::eraseVoxels(Ray& ray)
 {	
-	_tlas.eraseVoxels(ray, 0, modified_cube);
+	_front_tlas->eraseVoxels(ray, 0, modified_cube);
 }
 
 
@@ -397,4 +482,176 @@ void Scene::restoreVoxels()
 		modified_cube = nullptr;
 	}
 
-}
\ No newline at end of file
+}
+
+
+// Compare how many cache lines rays read from the island and wall voxels under the linear and tiled layouts.
+// The timing is for the layout selected by TILED_VOXELS in cube.h.
+Scene::VoxelLayoutStats Scene::benchmarkVoxelLayout() const
+{
+	std::vector<Ray> rays;
+	std::vector<const Cube*> ray_cubes;
+	generateBenchmarkRays(rays, ray_cubes);
+
+	VoxelLayoutStats stats{};
+	if (rays.empty())
+	{
+		return stats;
+	}
+
+	uint64_t linear_lines{ 0 };
+	uint64_t tiled_lines{ 0 };
+	for (size_t i = 0; i < rays.size(); ++i)
+	{
+		uint linear{ 0 };
+		uint tiled{ 0 };
+		ray_cubes[i]->measureCacheLines(rays[i], linear, tiled);
+
+		linear_lines += linear;
+		tiled_lines += tiled;
+	}
+
+	Timer timer;
+	for (size_t i = 0; i < rays.size(); ++i)
+	{
+		Ray ray{ rays[i] };
+		ray_cubes[i]->findNearest(ray);
+	}
+	const float elapsed{ timer.elapsed() };
+
+	const float ray_count{ static_cast<float>(rays.size()) };
+	stats._linear_lines_per_ray = static_cast<float>(linear_lines) / ray_count;
+	stats._tiled_lines_per_ray = static_cast<float>(tiled_lines) / ray_count;
+	stats._microseconds_per_ray = elapsed * 1000000.0f / ray_count;
+
+	return stats;
+}
+
+
+// Compare the island and wall cubes against sparse 64-tree copies of them, in memory and in time per ray.
+// Each side gets a TLAS of its own over the same instances, transforms and masks, and is traced with the same world-space rays.
+// Hits are checked against each other, so the comparison only counts when there are no mismatches.
+Scene::SparseVoxelStats Scene::benchmarkSparseVoxels()
+{
+	std::vector<CubeBVH*> dense_cube_bvhs;
+	for (Island& island : _islands)
+	{
+		dense_cube_bvhs.push_back(&island._bvh);
+	}
+	for (Wall& wall : _walls)
+	{
+		dense_cube_bvhs.push_back(&wall._bvh);
+	}
+
+	SparseVoxelStats stats{};
+	if (dense_cube_bvhs.empty())
+	{
+		return stats;
+	}
+
+	// Place a sparse copy of every cube where the dense one is.
+	std::vector<std::unique_ptr<SparseCubeBVH>> sparse_cube_bvhs;
+	std::vector<BVH*> dense_blas_list;
+	std::vector<BVH*> sparse_blas_list;
+	for (CubeBVH* dense_cube_bvh : dense_cube_bvhs)
+	{
+		SparseCubeBVH& sparse_cube_bvh{ *sparse_cube_bvhs.emplace_back(std::make_unique<SparseCubeBVH>()) };
+		sparse_cube_bvh.setCube(dense_cube_bvh->_cube);
+		sparse_cube_bvh.setID(dense_cube_bvh->_id);
+		sparse_cube_bvh.setTransform(dense_cube_bvh->_scale, dense_cube_bvh->_rotate, dense_cube_bvh->_translate);
+		sparse_cube_bvh.setMask(dense_cube_bvh->_mask);
+		sparse_cube_bvh.publishTransform();
+
+		dense_blas_list.push_back(dense_cube_bvh);
+		sparse_blas_list.push_back(&sparse_cube_bvh);
+
+		stats._dense_bytes += dense_cube_bvh->_cube.getMemoryUsage();
+		stats._sparse_bytes += sparse_cube_bvh._cube.getMemoryUsage();
+	}
+
+	TLAS dense_tlas{ dense_blas_list };
+	TLAS sparse_tlas{ sparse_blas_list };
+	dense_tlas.build();
+	sparse_tlas.build();
+
+	// Rays from around each instance towards a point inside its world bounds.
+	constexpr int rays_per_cube{ 4096 };
+
+	std::vector<Ray> rays;
+	for (const BVH* blas : dense_blas_list)
+	{
+		const float3 extent{ blas->_bounds.bmax3 - blas->_bounds.bmin3 };
+		const float3 center{ blas->_bounds.bmin3 + extent * 0.5f };
+		const float radius{ length(extent) };
+
+		for (int i = 0; i < rays_per_cube; ++i)
+		{
+			const float3 origin{ center + normalize(float3{ RandomFloat() - 0.5f, RandomFloat() - 0.5f, RandomFloat() - 0.5f }) * radius };
+			const float3 target{ blas->_bounds.bmin3 + extent * float3{ RandomFloat(), RandomFloat(), RandomFloat() } };
+
+			rays.emplace_back(origin, normalize(target - origin), 0u, false);
+		}
+	}
+
+	std::vector<Ray> dense_rays{ rays };
+	Timer timer;
+	for (Ray& ray : dense_rays)
+	{
+		dense_tlas.findNearest(ray, 0);
+	}
+	const float dense_elapsed{ timer.elapsed() };
+
+	std::vector<Ray> sparse_rays{ rays };
+	timer.reset();
+	for (Ray& ray : sparse_rays)
+	{
+		sparse_tlas.findNearest(ray, 0);
+	}
+	const float sparse_elapsed{ timer.elapsed() };
+
+	for (size_t i = 0; i < rays.size(); ++i)
+	{
+		if (dense_rays[i]._hit_data != sparse_rays[i]._hit_data)
+		{
+			++stats._mismatches;
+		}
+	}
+
+	const float ray_count{ static_cast<float>(rays.size()) };
+	stats._dense_microseconds_per_ray = dense_elapsed * 1000000.0f / ray_count;
+	stats._sparse_microseconds_per_ray = sparse_elapsed * 1000000.0f / ray_count;
+
+	return stats;
+}
+
+
+void Scene::generateBenchmarkRays(std::vector<Ray>& rays, std::vector<const Cube*>& ray_cubes) const
+{
+	constexpr int rays_per_cube{ 4096 };
+
+	std::vector<const Cube*> cubes;
+	for (const Island& island : _islands)
+	{
+		cubes.push_back(&island._bvh._cube);
+	}
+	for (const Wall& wall : _walls)
+	{
+		cubes.push_back(&wall._bvh._cube);
+	}
+
+	for (const Cube* cube : cubes)
+	{
+		const float3 extent{ cube->_bounds[1] - cube->_bounds[0] };
+		const float3 center{ cube->_bounds[0] + extent * 0.5f };
+		const float radius{ length(extent) };
+
+		for (int i = 0; i < rays_per_cube; ++i)
+		{
+			const float3 origin{ center + normalize(float3{ RandomFloat() - 0.5f, RandomFloat() - 0.5f, RandomFloat() - 0.5f }) * radius };
+			const float3 target{ cube->_bounds[0] + extent * float3{ RandomFloat(), RandomFloat(), RandomFloat() } };
+
+			rays.emplace_back(origin, normalize(target - origin), 0u, false);
+			ray_cubes.push_back(cube);
+		}
+	}
+}
@@ -18,14 +18,40 @@ namespace Tmpl8
 		void update(const float delta_time, const KeyboardManager& km);
 
 		void refitAS();
+		void beginRefitAS();
+		void endRefitAS();
+		void setCompressedNodes(const bool use_compressed_nodes);
+		void setBoxBLAS(const bool use_boxes);
 
 		bool findNearest(Ray& ray) const;
-		void findNearestToPlayer(Ray& player_ray, const int source_id) const;
+		void findNearest4(Ray* rays) const;
+		uint getHitMask(const Ray& ray) const;
 		void findMaterialExit(Ray& ray, const uint material_type) const;
 		bool isOccluded(Ray& ray) const;
 		bool isOccluded(Ray& ray, TintData& tint_datang) const;				
 		void eraseVoxels(Ray& ray);
 		void restoreVoxels();
+
+		// Benchmarks.
+		struct VoxelLayoutStats
+		{
+			float _linear_lines_per_ray{ 0.0f };
+			float _tiled_lines_per_ray{ 0.0f };
+			float _microseconds_per_ray{ 0.0f };
+		};
+
+		VoxelLayoutStats benchmarkVoxelLayout() const;
+
+		struct SparseVoxelStats
+		{
+			size_t _dense_bytes{ 0 };
+			size_t _sparse_bytes{ 0 };
+			float _dense_microseconds_per_ray{ 0.0f };
+			float _sparse_microseconds_per_ray{ 0.0f };
+			uint _mismatches{ 0 };
+		};
+
+		SparseVoxelStats benchmarkSparseVoxels();
 		
 		Stage _stage{ Stage::INTRO };
 
@@ -60,8 +86,12 @@ namespace Tmpl8
 		Player _player;
 
 		// TLAS / BLAS's
+		// Two TLASes over the same BLASes. Rays traverse the front one while the back one is refit on a worker.
 		std::vector<BVH*> _bvh_list;
-		TLAS _tlas{ _bvh_list };
+		TLAS _tlas[2]{ { _bvh_list }, { _bvh_list } };
+		TLAS* _front_tlas{ &_tlas[0] };
+		TLAS* _back_tlas{ &_tlas[1] };
+		std::future<void> _refit_job; // Declared after the TLASes so it is joined before they are destroyed.
 		
 		// Cubes that need to be restored.
 		Cube* modified_cube{ nullptr };
@@ -76,6 +106,11 @@ namespace Tmpl8
 		void generateIntro(uint non_metal_id, uint emissive_id, uint glass_id);
 		void generateWorld(uint non_metal_id, uint emissive_id, uint glass_id);
 
+		void publishTransforms();
+
+		// Rays for the voxel benchmarks. They start outside each island and wall cube and aim at a random point inside, in the cube's object space.
+		void generateBenchmarkRays(std::vector<Ray>& rays, std::vector<const Cube*>& ray_cubes) const;
+
 
 		Island::Data _island_data[_ISLAND_COUNT]
 		{
@@ -347,6 +347,13 @@ void main()
 			// draw template application output
 			if (app->screen)
 			{
+				// The app may change its render resolution at runtime. The quad stretches it over the window either way.
+				if (renderTarget->width != static_cast<uint>(app->screen->width) || renderTarget->height != static_cast<uint>(app->screen->height))
+				{
+					delete renderTarget;
+					InitRenderTarget(app->screen->width, app->screen->height);
+				}
+
 				renderTarget->CopyFrom(app->screen);
 			}
 			
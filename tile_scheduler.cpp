@@ -0,0 +1,193 @@
+#include "precomp.h"
+
+
+TileScheduler::TileScheduler(const int thread_count)
+{
+	const int worker_count{ thread_count > 0 ? thread_count : max(1, static_cast<int>(std::thread::hardware_concurrency())) };
+
+	_workers.reserve(worker_count);
+	for (int i = 0; i < worker_count; ++i)
+	{
+		_workers.push_back(std::make_unique<Worker>());
+	}
+
+	// Worker 0 is whichever thread calls run().
+	_threads.reserve(worker_count - 1);
+	for (int i = 1; i < worker_count; ++i)
+	{
+		_threads.emplace_back(&TileScheduler::workerLoop, this, i);
+	}
+}
+
+
+TileScheduler::~TileScheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock{ _run_lock };
+		_is_shutting_down = true;
+	}
+	_run_signal.notify_all();
+
+	for (std::thread& thread : _threads)
+	{
+		thread.join();
+	}
+}
+
+
+void TileScheduler::run(const std::vector<uint>& initial_tasks, const TaskFunction& task_function)
+{
+	if (initial_tasks.empty())
+	{
+		return;
+	}
+
+	const int worker_count{ getWorkerCount() };
+
+	_task_function = &task_function;
+	_pending_tasks = static_cast<int>(initial_tasks.size());
+	_active_workers = worker_count - 1;
+
+	for (int i = 0; i < worker_count; ++i)
+	{
+		_workers[i]->_stats = WorkerStats{};
+	}
+
+	// No worker is running yet, so the deques can be filled without locking.
+	for (size_t i = 0; i < initial_tasks.size(); ++i)
+	{
+		_workers[i % worker_count]->_tasks.push_back(initial_tasks[i]);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock{ _run_lock };
+		++_run_generation;
+	}
+	_run_signal.notify_all();
+
+	drainTasks(0);
+
+	// The other workers may still be between their last task and leaving drainTasks().
+	while (_active_workers > 0)
+	{
+		std::this_thread::yield();
+	}
+
+	_task_function = nullptr;
+}
+
+
+void TileScheduler::push(const int worker_index, const uint task)
+{
+	// Counted before it is visible, so the run cannot look finished while the task waits in a deque.
+	++_pending_tasks;
+
+	Worker& worker{ *_workers[worker_index] };
+	std::lock_guard<std::mutex> lock{ worker._lock };
+	worker._tasks.push_back(task);
+}
+
+
+void TileScheduler::workerLoop(const int worker_index)
+{
+	// Every new thread starts from the same thread_local seed.
+	InitSeedFromThread(static_cast<uint>(worker_index));
+
+	uint seen_generation{ 0 };
+
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock{ _run_lock };
+			_run_signal.wait(lock, [this, seen_generation]() { return _is_shutting_down || _run_generation != seen_generation; });
+
+			if (_is_shutting_down)
+			{
+				return;
+			}
+
+			seen_generation = _run_generation;
+		}
+
+		drainTasks(worker_index);
+
+		--_active_workers;
+	}
+}
+
+
+void TileScheduler::drainTasks(const int worker_index)
+{
+	Worker& worker{ *_workers[worker_index] };
+	WorkerStats& stats{ worker._stats };
+
+	Timer run_timer;
+
+	// A task only leaves the pending count once it has run, so anything it pushed is already counted.
+	while (_pending_tasks > 0)
+	{
+		uint task;
+		if (popTask(worker_index, task) || stealTask(worker_index, task))
+		{
+			Timer task_timer;
+
+			(*_task_function)(task, worker_index);
+
+			stats._busy_time += task_timer.elapsed();
+			++stats._tasks_run;
+
+			--_pending_tasks;
+		}
+		else
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	stats._idle_time = run_timer.elapsed() - stats._busy_time;
+}
+
+
+// Newest first, while its data is still in cache.
+bool TileScheduler::popTask(const int worker_index, uint& task)
+{
+	Worker& worker{ *_workers[worker_index] };
+	std::lock_guard<std::mutex> lock{ worker._lock };
+
+	if (worker._tasks.empty())
+	{
+		return false;
+	}
+
+	task = worker._tasks.back();
+	worker._tasks.pop_back();
+
+	return true;
+}
+
+
+// Oldest first, since it is the one the owner will get to last.
+bool TileScheduler::stealTask(const int worker_index, uint& task)
+{
+	const int worker_count{ getWorkerCount() };
+
+	for (int i = 1; i < worker_count; ++i)
+	{
+		Worker& victim{ *_workers[(worker_index + i) % worker_count] };
+		std::lock_guard<std::mutex> lock{ victim._lock };
+
+		if (victim._tasks.empty())
+		{
+			continue;
+		}
+
+		task = victim._tasks.front();
+		victim._tasks.pop_front();
+
+		++_workers[worker_index]->_stats._tasks_stolen;
+
+		return true;
+	}
+
+	return false;
+}
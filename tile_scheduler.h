@@ -0,0 +1,81 @@
+#pragma once
+
+
+// Work-stealing pool of std::threads. The template's JobManager is Win32-only and OpenMP joins every loop.
+// Each worker owns a deque of tasks: it pops its own newest task, and steals the oldest task of another worker when it runs dry.
+// Tasks are plain uints (the renderer packs a stage and tile index into them) and may push follow-up tasks while they run.
+class TileScheduler
+{
+public:
+	using TaskFunction = std::function<void(const uint task, const int worker_index)>;
+
+
+	// Busy/idle time of one worker during the last run.
+	struct WorkerStats
+	{
+		float _busy_time{ 0.0f };
+		float _idle_time{ 0.0f };
+		int _tasks_run{ 0 };
+		int _tasks_stolen{ 0 };
+	};
+
+
+	// 0 uses every hardware thread. The calling thread is worker 0, so thread_count - 1 threads are started.
+	explicit TileScheduler(const int thread_count = 0);
+
+	~TileScheduler();
+
+	TileScheduler(const TileScheduler&) = delete;
+	TileScheduler& operator=(const TileScheduler&) = delete;
+
+
+	// Run the initial tasks and everything they push. Returns when no task is left anywhere.
+	// Initial tasks are dealt round-robin over the workers.
+	void run(const std::vector<uint>& initial_tasks, const TaskFunction& task_function);
+
+
+	// Only valid from inside a task, on the worker index the task was given.
+	void push(const int worker_index, const uint task);
+
+
+	int getWorkerCount() const { return static_cast<int>(_workers.size()); }
+
+
+	const WorkerStats& getWorkerStats(const int worker_index) const { return _workers[worker_index]->_stats; }
+
+
+private:
+	struct alignas(64) Worker
+	{
+		std::mutex _lock;
+		std::deque<uint> _tasks;
+		WorkerStats _stats{};
+	};
+
+
+	void workerLoop(const int worker_index);
+
+
+	void drainTasks(const int worker_index);
+
+
+	bool popTask(const int worker_index, uint& task);
+
+
+	bool stealTask(const int worker_index, uint& task);
+
+
+	// Properties.
+	std::vector<std::unique_ptr<Worker>> _workers;
+	std::vector<std::thread> _threads;
+
+	const TaskFunction* _task_function{ nullptr };
+	std::atomic<int> _pending_tasks{ 0 };
+	std::atomic<int> _active_workers{ 0 };
+
+	// Workers sleep between runs. A new generation wakes them.
+	std::mutex _run_lock;
+	std::condition_variable _run_signal;
+	uint _run_generation{ 0 };
+	bool _is_shutting_down{ false };
+};
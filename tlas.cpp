@@ -7,10 +7,49 @@ TLAS::TLAS(std::vector<BVH*>& bvh_list)
 {	}
 
 
+TLAS::~TLAS()
+{
+	FREE64(_nodes);
+	FREE64(_qnodes);
+	FREE64(_cqnodes);
+}
+
+
 void TLAS::build()
 {
 	_blas_count = static_cast<int>(_blas.size());
-	_nodes = static_cast<TLASNode*>MALLOC64(sizeof(TLASNode) * 2 * _blas_count);
+
+	// Keep node storage across builds, only growing it when the instance count does.
+	const uint required_nodes{ static_cast<uint>(2 * max(_blas_count, 1)) };
+
+	if (required_nodes > _nodes_capacity)
+	{
+		FREE64(_nodes);
+		FREE64(_qnodes);
+		FREE64(_cqnodes);
+
+		_nodes = static_cast<TLASNode*>MALLOC64(sizeof(TLASNode) * required_nodes);
+		_qnodes = static_cast<QBVHNode*>MALLOC64(sizeof(QBVHNode) * required_nodes);
+		_cqnodes = nullptr;
+		_nodes_capacity = required_nodes;
+
+		_is_node_dirty.assign(required_nodes, false);
+	}
+
+	// Compressed nodes are only allocated while requested.
+	if (_use_compressed_nodes && _cqnodes == nullptr)
+	{
+		_cqnodes = static_cast<CompressedQBVHNode*>MALLOC64(sizeof(CompressedQBVHNode) * _nodes_capacity);
+	}
+	else if (!_use_compressed_nodes && _cqnodes != nullptr)
+	{
+		FREE64(_cqnodes);
+		_cqnodes = nullptr;
+	}
+
+	_build_instances.resize(_blas_count);
+	_leaf_indices.resize(_blas_count);
+	_leaf_versions.resize(_blas_count);
 
 	rebuild();
 }
@@ -18,308 +57,327 @@ void TLAS::build()
 
 void TLAS::rebuild()
 {
-	// Assign a TLASleaf node to each BLAS
-	int node_index[256];
-	int node_indices{ _blas_count };
-
-	_nodes_used = 1;
+	// Node 1 stays unused so sibling pairs share a cache line.
+	_nodes_used = 2;
 
 	for (int i = 0; i < _blas_count; ++i)
 	{
-		node_index[i] = _nodes_used;
-		_nodes[_nodes_used]._aabb_min = _blas[i]->_bounds.bmin3;
-		_nodes[_nodes_used]._aabb_max = _blas[i]->_bounds.bmax3;
-		_nodes[_nodes_used]._blas_index = i;
-		_nodes[_nodes_used++]._left_right = 0; // Makes it a leaf
+		BuildInstance& instance{ _build_instances[i] };
+
+		instance._bounds = _blas[i]->_bounds;
+		instance._centroid = (instance._bounds.bmin3 + instance._bounds.bmax3) * 0.5f;
+		instance._blas_index = i;
+
+		_leaf_versions[i] = _blas[i]->_bounds_version;
 	}
 
-	// Use agglomerative clustering to build the TLAS.
-	int A = 0;
-	int B = findBestMatch(node_index, node_indices, A);
+	// Binned SAH build over the instance bounds, top-down from the root.
+	TLASNode& root{ _nodes[0] };
+	root._aabb_min = float3{ 1e30f };
+	root._aabb_max = float3{ -1e30f };
+	root._blas_index = 0;
+	root._left_child = 0;
 
-	while (node_indices > 1)
+	if (_blas_count > 0)
 	{
-		int C{ findBestMatch(node_index, node_indices, B) };
+		subdivide(0, 0, _blas_count);
+	}
 
-		if (A == C)
-		{
-			int node_index_A{ node_index[A] };
-			int node_index_B{ node_index[B] };
+	_build_cost = calculateCost();
+
+#if USE_QBVH
+	buildQBVH();
+#endif
+}
 
-			TLASNode& node_A = _nodes[node_index_A];
-			TLASNode& node_B = _nodes[node_index_B];
-			TLASNode& new_node = _nodes[_nodes_used];
 
-			new_node._left_right = node_index_A + (node_index_B << 16);
+void TLAS::refit()
+{
+	// A different instance count invalidates the tree layout.
+	if (static_cast<int>(_blas.size()) != _blas_count)
+	{
+		build();
 
-			new_node._aabb_min = fminf(node_A._aabb_min, node_B._aabb_min);
-			new_node._aabb_max = fmaxf(node_A._aabb_max, node_B._aabb_max);
+		return;
+	}
 
-			node_index[A] = _nodes_used++;
-			node_index[B] = node_index[node_indices - 1];
+	// Only update the leaves of instances whose bounds changed since this TLAS was last refit.
+	bool has_any_moved{ false };
 
-			B = findBestMatch(node_index, --node_indices, A);
-		}
-		else
+	for (int i = 0; i < _blas_count; ++i)
+	{
+		const BVH& blas{ *_blas[i] };
+
+		if (blas._bounds_version != _leaf_versions[i])
 		{
-			A = B;
-			B = C;
-		}
-	}
-	_nodes[0] = _nodes[node_index[A]];
+			TLASNode& leaf{ _nodes[_leaf_indices[i]] };
 
-}
+			leaf._aabb_min = blas._bounds.bmin3;
+			leaf._aabb_max = blas._bounds.bmax3;
+			leaf._blas_index = packLeaf(i, blas._mask);
 
+			_is_node_dirty[_leaf_indices[i]] = true;
+			has_any_moved = true;
 
-int TLAS::findBestMatch(int* list, int N, int A)
-{
-	float smallest = 1e30f;
+			_leaf_versions[i] = blas._bounds_version;
+		}
+	}
 
-	int best_b{ -1 };
+	if (!has_any_moved)
+	{
+		return;
+	}
 
-	for (int B = 0; B < N; ++B)
+	// Children are always created after their parent, so a single descending sweep refits bottom-up.
+	for (int i = static_cast<int>(_nodes_used) - 1; i >= 0; --i)
 	{
-		if (B != A)
+		TLASNode& node{ _nodes[i] };
+
+		if (i == 1 || node._left_child == 0)
 		{
-			// Find max and min of the proposed merge.
-			float3 bmax{ fmaxf(_nodes[list[A]]._aabb_max, _nodes[list[B]]._aabb_max) };
-			float3 bmin{ fminf(_nodes[list[A]]._aabb_min, _nodes[list[B]]._aabb_min) };
+			continue;
+		}
 
-			// Find the area of the proposed merge.
-			float3 e{ bmax - bmin };
-			float surface_area{ (e.x * e.y) + (e.y * e.z) + (e.z * e.x) };
+		if (_is_node_dirty[node._left_child] || _is_node_dirty[node._left_child + 1])
+		{
+			const TLASNode& left{ _nodes[node._left_child] };
+			const TLASNode& right{ _nodes[node._left_child + 1] };
 
-			// Store proposed merge candidate if it makes the best (smallest) surface area.
-			if (surface_area < smallest)
-			{
-				smallest = surface_area;
-				best_b = B;
-			}
+			node._aabb_min = fminf(left._aabb_min, right._aabb_min);
+			node._aabb_max = fmaxf(left._aabb_max, right._aabb_max);
+
+			_is_node_dirty[i] = true;
 		}
 	}
 
-	return best_b;
+	std::fill(_is_node_dirty.begin(), _is_node_dirty.begin() + _nodes_used, false);
+
+	// Moving instances loosen the tree over time. Rebuild once it has degraded too far.
+	if (calculateCost() > _build_cost * _REBUILD_THRESHOLD)
+	{
+		rebuild();
+	}
+#if USE_QBVH
+	else
+	{
+		buildQBVH();
+	}
+#endif
 }
 
 
-void TLAS::findNearest(Ray& ray, const uint) const
+void TLAS::buildQBVH()
 {
-	TLASNode* node_ptr{ &_nodes[0] };
-	TLASNode* stack[64];
-	uint stack_ptr{ 0 };
+	uint qnodes_used{ 1 };
+	BVH::collapseToQBVH(*this, _nodes[0], _qnodes, 0, qnodes_used);
 
-	while (true)
+	if (_cqnodes != nullptr)
 	{
-		TLASNode& node{ *node_ptr };
+		BVH::compressQBVH(_qnodes, qnodes_used, _cqnodes);
+	}
+}
 
-		// Resolve leaf node.
-		if (node._left_right == 0)
-		{
-			_blas[node._blas_index]->findNearest(ray, 0);
 
-			if (stack_ptr == 0)
-			{
-				break;
-			}
-			else
-			{
-				node_ptr = stack[--stack_ptr];
-			}
+void TLAS::subdivide(const uint node_index, const uint first, const uint count)
+{
+	TLASNode& node{ _nodes[node_index] };
 
-			continue;
-		}
+	// Update node bounds, and the bounds of the centroids to bin between.
+	aabb node_bounds;
+	aabb centroid_bounds;
 
-		// Check child nodes.
-		TLASNode* child1{ &_nodes[node._left_right & 0xFFFF] };
-		TLASNode* child2{ &_nodes[node._left_right >> 16] };
-
-#if USE_SSE == 1
-		float dist2 = BVH::intersectAABBForNearest_SSE(ray, child2->_aabb_min4, child2->_aabb_max4);
-		float dist1 = BVH::intersectAABBForNearest_SSE(ray, child1->_aabb_min4, child1->_aabb_max4);
-#else
-		float dist1 = BVH::intersectAABBForNearest(ray, child1->_aabb_min, child1->_aabb_max);
-		float dist2 = BVH::intersectAABBForNearest(ray, child2->_aabb_min, child2->_aabb_max);
-#endif
+	for (uint i = 0; i < count; ++i)
+	{
+		const BuildInstance& instance{ _build_instances[first + i] };
 
-		// Place closer child first for intersection resolution.
-		if (dist1 > dist2)
-		{
-			swap(dist1, dist2);
+		node_bounds.Grow(instance._bounds);
+		centroid_bounds.Grow(instance._centroid);
+	}
 
-			swap(child1, child2);
-		}
+	node._aabb_min = node_bounds.bmin3;
+	node._aabb_max = node_bounds.bmax3;
 
-		if (dist1 == Ray::t_max)
-		{
-			if (stack_ptr == 0)
-			{
-				break;
-			}
-			else
-			{
-				node_ptr = stack[--stack_ptr];
-			}
-		}
-		else
+	// Every leaf holds a single instance.
+	if (count == 1)
+	{
+		const uint blas_index{ _build_instances[first]._blas_index };
+
+		node._blas_index = packLeaf(blas_index, _blas[blas_index]->_mask);
+		node._left_child = 0;
+
+		_leaf_indices[blas_index] = node_index;
+
+		return;
+	}
+
+	// Partition instances on the best split plane. Swap elements so they are consecutive within their new container.
+	uint left_count{ 0 };
+	{
+		int axis{ -1 };
+		float split_position{ 0.0f };
+
+		findBestSplitPlane(first, count, centroid_bounds, /*inout*/ axis, /*inout*/ split_position);
+
+		if (axis != -1)
 		{
-			node_ptr = child1;
+			int left_i{ static_cast<int>(first) };
+			int right_i{ left_i + static_cast<int>(count) - 1 };
 
-			if (dist2 != Ray::t_max)
+			while (left_i <= right_i)
 			{
-				stack[stack_ptr++] = child2;
+				if (_build_instances[left_i]._centroid[axis] < split_position)
+				{
+					++left_i;
+				}
+				else
+				{
+					std::swap(_build_instances[left_i], _build_instances[right_i--]);
+				}
 			}
+
+			left_count = left_i - first;
 		}
 	}
+
+	// Instances with coinciding centroids can't be binned apart. Split them evenly instead.
+	if (left_count == 0 || left_count == count)
+	{
+		left_count = count / 2;
+	}
+
+	// Create new child nodes.
+	const uint left_child_index{ _nodes_used };
+	_nodes_used += 2;
+
+	node._blas_index = 0;
+	node._left_child = left_child_index;
+
+	subdivide(left_child_index, first, left_count);
+	subdivide(left_child_index + 1, first + left_count, count - left_count);
 }
 
 
-bool TLAS::findOcclusion(Ray& ray, TintData& tint_data, const uint) const
+float TLAS::findBestSplitPlane(const uint first, const uint count, const aabb& centroid_bounds, int& best_axis, float& best_position) const
 {
-	TLASNode* node_ptr{ &_nodes[0] };
-	TLASNode* stack[64];
-	uint stack_ptr{ 0 };
+	float best_cost{ 1e30f };
 
-	while (true)
-	{
-		TLASNode& node{ *node_ptr };
+	// Small nodes dominate the tree, use fewer bins for them to keep their fixed cost down.
+	const int bin_count{ min(_BINS, static_cast<int>(count)) };
 
-		// Resolve leaf node.
-		if (node._left_right == 0)
-		{
-			if (_blas[node._blas_index]->findOcclusion(ray, tint_data, 0))
-			{
-				return true;
-			}
+	// BIN creation for all axes in a single pass over the instances.
+	Bin bins[3][_BINS];
+	float scale[3];
 
-			if (stack_ptr == 0)
-			{
-				return false;
-			}
-			else
-			{
-				node_ptr = stack[--stack_ptr];
-			}
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		const float extent{ centroid_bounds.Extend(axis) };
 
-			continue;
-		}
+		scale[axis] = extent > 0.0f ? bin_count / extent : 0.0f;
+	}
 
-		// Check child nodes.
-		TLASNode* child1{ &_nodes[node._left_right & 0xFFFF] };
-		TLASNode* child2{ &_nodes[node._left_right >> 16] };
-
-#if USE_SSE == 1
-		float dist2 = BVH::intersectAABBForNearest_SSE(ray, child2->_aabb_min4, child2->_aabb_max4);
-		float dist1 = BVH::intersectAABBForNearest_SSE(ray, child1->_aabb_min4, child1->_aabb_max4);
-#else
-		float dist1 = BVH::intersectAABBForNearest(ray, child1->_aabb_min, child1->_aabb_max);
-		float dist2 = BVH::intersectAABBForNearest(ray, child2->_aabb_min, child2->_aabb_max);
-#endif
+	for (uint i = 0; i < count; ++i)
+	{
+		const BuildInstance& instance{ _build_instances[first + i] };
 
-		// Place closer child first for intersection resolution.
-		if (dist1 > dist2)
+		for (int axis = 0; axis < 3; ++axis)
 		{
-			swap(dist1, dist2);
+			const int bin_index{ min(bin_count - 1, static_cast<int>((instance._centroid.cell[axis] - centroid_bounds.bmin[axis]) * scale[axis])) };
+			bins[axis][bin_index]._count++;
+			bins[axis][bin_index]._bounds.Grow(instance._bounds);
+		}
+	}
 
-			swap(child1, child2);
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		// If flat, skip.
+		if (scale[axis] == 0.0f)
+		{
+			continue;
 		}
 
-		if (dist1 > ray.t)
+		// Plane setup.
+		int left_count[_BINS - 1];
+		int right_count[_BINS - 1];
+		float left_area[_BINS - 1];
+		float right_area[_BINS - 1];
 		{
-			if (stack_ptr == 0)
+			aabb left_box;
+			aabb right_box;
+
+			int left_sum{ 0 };
+			int right_sum{ 0 };
+
+			for (int i = 0; i < bin_count - 1; ++i)
 			{
-				return false;
-			}
-			else
-			{
-				node_ptr = stack[--stack_ptr];
+				left_sum += bins[axis][i]._count;
+				left_count[i] = left_sum;
+				left_box.Grow(bins[axis][i]._bounds);
+				left_area[i] = left_box.Area();
+
+				right_sum += bins[axis][bin_count - 1 - i]._count;
+				right_count[bin_count - 2 - i] = right_sum;
+				right_box.Grow(bins[axis][bin_count - 1 - i]._bounds);
+				right_area[bin_count - 2 - i] = right_box.Area();
 			}
 		}
-		else
+
+		// Get interval to check splits at.
 		{
-			node_ptr = child1;
+			const float interval{ centroid_bounds.Extend(axis) / bin_count };
 
-			if (dist2 < ray.t)
+			for (int i = 0; i < bin_count - 1; ++i)
 			{
-				stack[stack_ptr++] = child2;
+				const float plane_cost{ (left_count[i] * left_area[i]) + (right_count[i] * right_area[i]) };
+
+				if (plane_cost < best_cost)
+				{
+					best_axis = axis;
+					best_position = centroid_bounds.bmin[axis] + interval * (i + 1);
+					best_cost = plane_cost;
+				}
 			}
 		}
 	}
+
+	return best_cost;
 }
 
 
-void TLAS::findNearestToPlayer(Ray& ray, const uint, const int source_id) const
+// Surface area heuristic cost of the tree, relative to the root's surface area.
+float TLAS::calculateCost() const
 {
-	TLASNode* node_ptr{ &_nodes[0] };
-	TLASNode* stack[64];
-	uint stack_ptr{ 0 };
+	float summed_area{ 0.0f };
 
-	while (true)
+	for (uint i = 2; i < _nodes_used; ++i)
 	{
-		TLASNode& node{ *node_ptr };
+		const float3 e{ _nodes[i]._aabb_max - _nodes[i]._aabb_min };
 
-		// Resolve leaf node.
-		if (node._left_right == 0)
-		{
-			_blas[node._blas_index]->findNearestToPlayer(ray, 0, source_id);
-
-			if (stack_ptr == 0)
-			{
-				break;
-			}
-			else
-			{
-				node_ptr = stack[--stack_ptr];
-			}
-
-			continue;
-		}
+		summed_area += (e.x * e.y) + (e.y * e.z) + (e.z * e.x);
+	}
 
-		// Check child nodes.
-		TLASNode* child1{ &_nodes[node._left_right & 0xFFFF] };
-		TLASNode* child2{ &_nodes[node._left_right >> 16] };
-
-#if USE_SSE == 1
-		float dist2 = BVH::intersectAABBForNearest_SSE(ray, child2->_aabb_min4, child2->_aabb_max4);
-		float dist1 = BVH::intersectAABBForNearest_SSE(ray, child1->_aabb_min4, child1->_aabb_max4);
-#else
-		float dist1 = BVH::intersectAABBForNearest(ray, child1->_aabb_min, child1->_aabb_max);
-		float dist2 = BVH::intersectAABBForNearest(ray, child2->_aabb_min, child2->_aabb_max);
-#endif
+	const float3 e{ _nodes[0]._aabb_max - _nodes[0]._aabb_min };
+	const float root_area{ (e.x * e.y) + (e.y * e.z) + (e.z * e.x) };
 
-		// Place closer child first for intersection resolution.
-		if (dist1 > dist2)
-		{
-			swap(dist1, dist2);
+	return root_area > 0.0f ? summed_area / root_area : 0.0f;
+}
 
-			swap(child1, child2);
-		}
 
-		if (dist1 == Ray::t_max)
-		{
-			if (stack_ptr == 0)
-			{
-				break;
-			}
-			else
-			{
-				node_ptr = stack[--stack_ptr];
-			}
-		}
-		else
-		{
-			node_ptr = child1;
+void TLAS::findNearest(Ray& ray, const uint) const
+{
+	traverseInstances(ray, [this](Ray& leaf_ray, const int blas_index)
+	{
+		_blas[blas_index]->findNearest(leaf_ray, 0);
 
-			if (dist2 != Ray::t_max)
-			{
-				stack[stack_ptr++] = child2;
-			}
-		}
-	}
+		return false;
+	});
 }
 
 
-void TLAS::eraseVoxels(Ray& ray, const uint, Cube*& modified_cube)
+// Packet version of findNearest for four coherent rays, such as a 2x2 quad of primary rays.
+void TLAS::findNearest4(Ray* rays, const uint) const
 {
+	RayPacket4 packet{ rays };
+
 	TLASNode* node_ptr{ &_nodes[0] };
 	TLASNode* stack[64];
 	uint stack_ptr{ 0 };
@@ -328,10 +386,15 @@ void TLAS::eraseVoxels(Ray& ray, const uint, Cube*& modified_cube)
 	{
 		TLASNode& node{ *node_ptr };
 
-		// Resolve leaf node.
-		if (node._left_right == 0)
+		// Resolve leaf node. The four rays of a packet share their mask.
+		if (node._left_child == 0)
 		{
-			_blas[node._blas_index]->eraseVoxels(ray, 0, modified_cube);
+			if (((node._blas_index >> _MASK_SHIFT) & rays[0]._mask) != 0)
+			{
+				_blas[node._blas_index & _INDEX_BITS]->findNearest4(rays, 0);
+			}
+
+			packet.updateT(rays);
 
 			if (stack_ptr == 0)
 			{
@@ -346,16 +409,11 @@ void TLAS::eraseVoxels(Ray& ray, const uint, Cube*& modified_cube)
 		}
 
 		// Check child nodes.
-		TLASNode* child1{ &_nodes[node._left_right & 0xFFFF] };
-		TLASNode* child2{ &_nodes[node._left_right >> 16] };
-
-#if USE_SSE == 1
-		float dist1 = BVH::intersectAABBForNearest_SSE(ray, child1->_aabb_min4, child1->_aabb_max4);
-		float dist2 = BVH::intersectAABBForNearest_SSE(ray, child2->_aabb_min4, child2->_aabb_max4);
-#else
-		float dist1 = BVH::intersectAABBForNearest(ray, child1->_aabb_min, child1->_aabb_max);
-		float dist2 = BVH::intersectAABBForNearest(ray, child2->_aabb_min, child2->_aabb_max);
-#endif
+		TLASNode* child1{ &_nodes[node._left_child] };
+		TLASNode* child2{ &_nodes[node._left_child + 1] };
+
+		float dist1 = BVH::getPacketNearest(BVH::intersectAABBForNearest4(packet, child1->_aabb_min, child1->_aabb_max));
+		float dist2 = BVH::getPacketNearest(BVH::intersectAABBForNearest4(packet, child2->_aabb_min, child2->_aabb_max));
 
 		// Place closer child first for intersection resolution.
 		if (dist1 > dist2)
@@ -386,4 +444,24 @@ void TLAS::eraseVoxels(Ray& ray, const uint, Cube*& modified_cube)
 			}
 		}
 	}
-}
\ No newline at end of file
+}
+
+
+bool TLAS::findOcclusion(Ray& ray, TintData& tint_data, const uint) const
+{
+	return traverseInstances(ray, [this, &tint_data](Ray& leaf_ray, const int blas_index)
+	{
+		return _blas[blas_index]->findOcclusion(leaf_ray, tint_data, 0);
+	});
+}
+
+
+void TLAS::eraseVoxels(Ray& ray, const uint, Cube*& modified_cube)
+{
+	traverseInstances(ray, [this, &modified_cube](Ray& leaf_ray, const int blas_index)
+	{
+		_blas[blas_index]->eraseVoxels(leaf_ray, 0, modified_cube);
+
+		return false;
+	});
+}
@@ -10,33 +10,33 @@ struct TLASNode
 #if USE_SSE
 #pragma warning ( push )
 #pragma warning ( disable: 4201 /* nameless struct / union */ )
-	// Index of child.
+	// Index of BLAS. Leaves pack the instance mask into the top bits, see TLAS::packLeaf().
 	union
 	{
 		struct
 		{
 			float3 _aabb_min;
-			int _blas_index;
+			uint _blas_index;
 		};
 		__m128 _aabb_min4;
 	};
 
-	// Index of left and right child. Leaf if zero.
+	// Index of left child, the right child directly follows it. Leaf if zero.
 	union
 	{
 		struct
 		{
 			float3 _aabb_max;
-			int _left_right;
+			uint _left_child;
 		};
 		__m128 _aabb_max4;
 	};
 #pragma warning ( pop )
 #else
 	float3 _aabb_min{ 0.0f };
-	int _blas_index{ 0 };
+	uint _blas_index{ 0 };
 	float3 _aabb_max{ 1.0f };
-	int _left_right{ 0 };
+	uint _left_child{ 0 };
 #endif
 };
 
@@ -47,30 +47,130 @@ public:
 	TLAS(std::vector<BVH*>& bvh_list);
 
 
+	~TLAS();
+
+
 	void build();
 
 
 	void rebuild();
 
 
-	int findBestMatch(int* list, int N, int A);
+	// Refits the existing tree to the current BLAS bounds, only rebuilding when its quality degrades.
+	void refit();
 
 
 	void findNearest(Ray& ray, const uint) const;
 
 
-	bool findOcclusion(Ray& ray, TintData& tint_data, const uint) const;
+	void findNearest4(Ray* rays, const uint) const;
 
 
-	void findNearestToPlayer(Ray& ray, const uint, const int source_id) const;
+	bool findOcclusion(Ray& ray, TintData& tint_data, const uint) const;
 
 
 	void eraseVoxels(Ray& ray, const uint, Cube*& modified_cube);
 
 
+	// Tree interface used by BVH::traverse().
+	bool isLeaf(const TLASNode& node) const { return node._left_child == 0; }
+	const TLASNode* getLeftChild(const TLASNode& node) const { return &_nodes[node._left_child]; }
+	const TLASNode* getRightChild(const TLASNode& node) const { return &_nodes[node._left_child + 1]; }
+	int getLeafFirst(const TLASNode& node) const { return static_cast<int>(node._blas_index); }
+	int getLeafCount(const TLASNode&) const { return 1; }
+
+	// Traverse quantized four-wide nodes. Takes effect on the next build().
+	bool _use_compressed_nodes{ false };
+
+
 private:
+	// Leaves keep the BLAS mask in the top bits of their BLAS index, so masked out instances are skipped without touching the BLAS.
+	static constexpr uint _MASK_SHIFT{ 24 };
+	static constexpr uint _INDEX_BITS{ (1u << _MASK_SHIFT) - 1 };
+
+	static uint packLeaf(const uint blas_index, const uint mask) { return blas_index | (mask << _MASK_SHIFT); }
+
+	// Runs visit_instance(ray, blas_index) on every BLAS the ray reaches whose mask it shares, through the four-wide nodes when enabled.
+	template <typename InstanceVisitor>
+	bool traverseInstances(Ray& ray, InstanceVisitor&& visit_instance) const
+	{
+		auto visit_masked = [&visit_instance](Ray& leaf_ray, const uint leaf)
+		{
+			if (((leaf >> _MASK_SHIFT) & leaf_ray._mask) == 0)
+			{
+				return false;
+			}
+
+			return visit_instance(leaf_ray, static_cast<int>(leaf & _INDEX_BITS));
+		};
+
+#if USE_QBVH
+		auto visit_leaf = [&visit_masked](Ray& leaf_ray, const int first, const int)
+		{
+			return visit_masked(leaf_ray, static_cast<uint>(first));
+		};
+
+		if (_cqnodes != nullptr)
+		{
+			return BVH::traverseQBVH(_cqnodes, 0, ray, visit_leaf);
+		}
+
+		return BVH::traverseQBVH(_qnodes, 0, ray, visit_leaf);
+#else
+		return BVH::traverse(*this, &_nodes[0], ray, [&visit_masked](Ray& leaf_ray, const TLASNode& node)
+		{
+			return visit_masked(leaf_ray, node._blas_index);
+		});
+#endif
+	}
+
+
+	void subdivide(const uint node_index, const uint first, const uint count);
+
+
+	float findBestSplitPlane(const uint first, const uint count, const aabb& centroid_bounds, int& best_axis, float& best_position) const;
+
+
+	float calculateCost() const;
+
+
+	// Collapses the binary tree into four-wide nodes, and quantizes them when compressed nodes are in use.
+	void buildQBVH();
+
+
+	// Refitted tree may cost this much more than a fresh build before it is rebuilt.
+	static constexpr float _REBUILD_THRESHOLD{ 1.3f };
+
+	// Amount of centroid bins tested per axis when splitting.
+	static constexpr int _BINS{ 16 };
+
+	struct Bin
+	{
+		aabb _bounds;
+		int _count{ 0 };
+	};
+
+	// Build-time copy of a BLAS' bounds, kept contiguous so partitioning streams through memory.
+	struct BuildInstance
+	{
+		aabb _bounds;
+		float3 _centroid;
+		uint _blas_index;
+	};
+
 	TLASNode* _nodes{ nullptr };
-	uint _nodes_used{ 1 };
+	QBVHNode* _qnodes{ nullptr };
+	CompressedQBVHNode* _cqnodes{ nullptr };
+	uint _nodes_used{ 2 };
+	uint _nodes_capacity{ 0 };
+	float _build_cost{ 0.0f };
+	std::vector<bool> _is_node_dirty;
+
+	std::vector<BuildInstance> _build_instances;
+
+	// Leaf node holding each BLAS, and the BLAS bounds version it was last refit to.
+	std::vector<uint> _leaf_indices;
+	std::vector<uint> _leaf_versions;
 	std::vector<BVH*>& _blas;
 	int _blas_count{ 0 };
 };
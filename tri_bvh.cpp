@@ -138,18 +138,6 @@ bool TriBVH::intersectItemForOcclusion(Ray& transformed_ray, TintData& tint_data
 }
 
 
-void TriBVH::intersectItemForNearestToPlayer(Ray& ray, const uint item_index, const int source_id) const
-{
-	// Camera obstruction ray ignores water during flip.
-	if (source_id == _id)
-	{
-		return;
-	}
-
-	intersectItemForNearest(ray, item_index);
-}
-
-
 // BUILD METHODS //
 
 void TriBVH::build()
@@ -178,6 +166,9 @@ void TriBVH::build()
 	updateNodeBounds(0);
 	subdivide(0);
 	setBounds();
+	finishBuild();
+
+	_build_time = t.elapsed();
 }
 
 
@@ -260,11 +251,11 @@ void TriBVH::subdivide(const uint node_index)
 	}
 
 	// Create new child nodes.
-	const int left_child_index{ _nodes_used++ };
+	const int left_child_index{ allocateChildPair() };
 	_nodes[left_child_index]._significant_index = node._significant_index;
 	_nodes[left_child_index]._child_count = left_count;
 
-	const int right_child_index{ _nodes_used++ };
+	const int right_child_index{ left_child_index + 1 };
 	_nodes[right_child_index]._significant_index = left_i;
 	_nodes[right_child_index]._child_count = node._child_count - left_count;
 
@@ -276,97 +267,19 @@ void TriBVH::subdivide(const uint node_index)
 	updateNodeBounds(left_child_index);
 	updateNodeBounds(right_child_index);
 
-	subdivide(left_child_index);
-	subdivide(right_child_index);
+	subdivideChildren(left_child_index, right_child_index, [this](const uint child_index) { subdivide(child_index); });
 }
 
 
 float TriBVH::findBestSplitPlane(BVHNode& node, int& best_axis, float& best_position) const
 {
-	constexpr static int splits{ 8 };
-
-	float best_cost{ 1e30f };
-
-	for (int axis = 0; axis < 3; ++axis)
-	{
-		// Find min/max bounds to make splits between.
-		float bounds_min = 1e30f;
-		float bounds_max = -1e30f;
-		{
-			for (int i = 0; i < node._child_count; ++i)
-			{
-				Triangle& tri{ _triangles[_item_indicies[node._significant_index + i]] };
-
-				bounds_min = min(bounds_min, tri._centroid[axis]);
-				bounds_max = max(bounds_max, tri._centroid[axis]);
-			}
-
-			// If flat, skip.
-			if (bounds_min == bounds_max)
-			{
-				continue;
-			}
-		}
-
-		// BIN creation.
-		Bin bins[splits];
-		{
-			float scale{ splits / (bounds_max - bounds_min) };
-
-			for (int i = 0; i < node._child_count; ++i)
-			{
-				Triangle& tri{ _triangles[_item_indicies[node._significant_index + i]] };
-
-				int bin_index{ min(splits - 1, static_cast<int>((tri._centroid[axis] - bounds_min) * scale)) };
-				bins[bin_index]._count++;
-				bins[bin_index]._bounds.Grow(tri._vertex_A);
-				bins[bin_index]._bounds.Grow(tri._vertex_B);
-				bins[bin_index]._bounds.Grow(tri._vertex_C);
-			}
-		}
-
-		// Plane setup.
-		int left_count[splits - 1];
-		int right_count[splits - 1];
-		float left_area[splits - 1];
-		float right_area[splits - 1];
-		{
-			aabb left_box;
-			aabb right_box;
-
-			int left_sum{ 0 };
-			int right_sum{ 0 };
-
-			for (int i = 0; i < splits - 1; ++i)
-			{
-				left_sum += bins[i]._count;
-				left_count[i] = left_sum;
-				left_box.Grow(bins[i]._bounds);
-				left_area[i] = left_box.Area();
-
-				right_sum += bins[splits - 1 - i]._count;
-				right_count[splits - 2 - i] = right_sum;
-				right_box.Grow(bins[splits - 1 - i]._bounds);
-				right_area[splits - 2 - i] = right_box.Area();
-			}
-		}
-
-		// Get interval to check splits at.
+	return findBinnedSplitPlane(node,
+		[this](const uint item_index) { return _triangles[item_index]._centroid; },
+		[this](const uint item_index)
 		{
-			float scale{ (bounds_max - bounds_min) / splits };
-
-			for (int i = 0; i < splits - 1; ++i)
-			{
-				float plane_cost{ (left_count[i] * left_area[i]) + (right_count[i] * right_area[i]) };
-				if (plane_cost < best_cost)
-				{
-					best_axis = axis;
-					best_position = bounds_min + scale * (i + 1);
-					best_cost = plane_cost;
-				}
-			}
-		}
-	}
+			const Triangle& tri{ _triangles[item_index] };
 
-	return best_cost;
+			return aabb{ fminf(fminf(tri._vertex_A, tri._vertex_B), tri._vertex_C), fmaxf(fmaxf(tri._vertex_A, tri._vertex_B), tri._vertex_C) };
+		},
+		best_axis, best_position);
 }
\ No newline at end of file
@@ -11,7 +11,7 @@ void Wall::initialize(Data& data)
 	_bvh.build();
 
 	// Place.	
-	_offset = _bvh._bounds.bmax3 * 0.5f;
+	_offset = make_float3(_bvh._cube._size) * VOXELSIZE * 0.5f;
 	_position = data._position;
 
 	float3 translation{ _position - _offset };
@@ -50,7 +50,7 @@ void Wall::initialize(Data& data, int2 gate_opening, uint glass_id, const char*)
 	_bvh.build();
 
 	// Place.	
-	_offset = _bvh._bounds.bmax3 * 0.5f;
+	_offset = make_float3(_bvh._cube._size) * VOXELSIZE * 0.5f;
 	_position = data._position;
 
 	float3 translation{ _position - _offset };